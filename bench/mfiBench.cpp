@@ -0,0 +1,361 @@
+// Throughput benchmark for the parser (mfiMediaFile::readFile, into an
+// mfiSong and into an mfiEventCounter), the event pre-scan
+// (mfiMediaFile::scanTrack), the MIDI encoder (mfiMidiWriter::writeTrack)
+// and the way back (mfiMidiReader into mfiMfiEncoder).
+//
+//   mfiBench [-t seconds] [file.mld|dir ...]
+//
+// Synthetic scenarios always run; every file or directory (searched
+// recursively for *.mld) given on the command line is added as one more
+// "corpus" scenario. Parse, count and scan MB/s count MFi input bytes, encode
+// and to-MFi MB/s count SMF bytes. Both run entirely in memory.
+
+#include "mfi/mfi.h"
+
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+struct mfiBenchScenario {
+    const char *name;
+    mfiNoteType noteType;
+    int numTracks;
+    int numEventsPerTrack;
+    int chordPercent;  // notes that start on the same tick as the previous event
+    int sysexPercent;  // events that are SysEx instead of notes
+    int sysexSize;
+    int numAdpcmChunks;
+    int adpcmChunkSize;
+};
+
+static const mfiBenchScenario g_benchScenarios[] = {
+    // name            note type             trk  events chord sysex  size adpcm  size
+    { "short-notes",  MFI_NOTE_TYPE_SHORT,  4,   20000, 10,   0,     0,   0,     0      },
+    { "long-notes",   MFI_NOTE_TYPE_LONG,   4,   20000, 10,   0,     0,   0,     0      },
+    { "sysex-adpcm",  MFI_NOTE_TYPE_SHORT,  2,   5000,  10,   20,    512, 4,     65536  },
+    { "short-tracks", MFI_NOTE_TYPE_LONG,   4,   1000,  10,   0,     0,   0,     0      },
+    { "dense-chords", MFI_NOTE_TYPE_SHORT,  4,   20000, 90,   0,     0,   0,     0      },
+};
+
+// xorshift32; the files only have to be the same from run to run
+struct mfiBenchRandom {
+    uint32_t state;
+
+    uint32_t next() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    uint32_t below(uint32_t n) {
+        return next() % n;
+    }
+};
+
+static void writeTypeB(mfiBufferWriter *wr, uint8_t deltaTime, uint8_t eventId, uint8_t data) {
+    wr->writeUint8(deltaTime);
+    wr->writeUint8((3 << 6) | 0x3F);
+    wr->writeUint8(eventId);
+    wr->writeUint8(data);
+}
+
+static void writeSyntheticTrack(mfiBufferWriter *wr, const mfiBenchScenario &sc, mfiBenchRandom *rng) {
+    wr->writeUint32(0x74726163); // 'trac'
+    size_t sizeOffset = wr->tell();
+    wr->writeUint32(0);
+
+    writeTypeB(wr, 0, 0xC2, 120); // tempo, timebase 24
+    for (uint8_t channel = 0; channel < 4; channel++) {
+        writeTypeB(wr, 0, 0xE1, channel << 6);
+        writeTypeB(wr, 0, 0xE0, (channel << 6) | rng->below(64));
+    }
+
+    for (int i = 0; i < sc.numEventsPerTrack; i++) {
+        uint8_t deltaTime = (int)rng->below(100) < sc.chordPercent ? 0 : 1 + rng->below(24);
+        uint32_t kind     = rng->below(100);
+        if ((int)kind < sc.sysexPercent) {
+            wr->writeUint8(deltaTime);
+            wr->writeUint8((3 << 6) | 0x3F);
+            wr->writeUint8(0xF0);
+            wr->writeUint16(sc.sysexSize);
+            for (int j = 0; j < sc.sysexSize; j++) {
+                wr->writeUint8(rng->next());
+            }
+        } else if (kind < 95) {
+            wr->writeUint8(deltaTime);
+            wr->writeUint8((rng->below(4) << 6) | rng->below(63));
+            wr->writeUint8(1 + rng->below(96)); // gate time
+            if (sc.noteType == MFI_NOTE_TYPE_LONG) {
+                wr->writeUint8((rng->below(64) << 2) | rng->below(4)); // velocity, octave shift
+            }
+        } else {
+            static const uint8_t controls[] = { 0xE2, 0xE3, 0xE4, 0xEA };
+            writeTypeB(wr, deltaTime, controls[rng->below(4)], rng->next());
+        }
+    }
+
+    writeTypeB(wr, 0, 0xDF, 0);
+    wr->patchUint32(sizeOffset, wr->tell() - sizeOffset - 4);
+}
+
+static std::vector<uint8_t> makeSyntheticFile(const mfiBenchScenario &sc) {
+    mfiBenchRandom rng{ 0x2545F491 };
+    mfiBufferWriter wr;
+
+    wr.writeUint32(0x6D656C6F); // 'melo'
+    wr.writeUint32(0);          // file length, patched below
+    size_t fileStart = wr.tell();
+
+    wr.writeUint16(0); // header length, patched below
+    size_t headerStart = wr.tell();
+    wr.writeUint8(MFI_CT_MELODY);
+    wr.writeUint8(MFI_MELODY_TYPE_COMPLETE);
+    wr.writeUint8(sc.numTracks);
+
+    wr.writeUint32(0x6E6F7465); // 'note'
+    wr.writeUint16(2);
+    wr.writeUint16(sc.noteType);
+    if (sc.numAdpcmChunks) {
+        wr.writeUint32(0x61696E66); // 'ainf'
+        wr.writeUint16(2);
+        wr.writeUint8(sc.numAdpcmChunks & 0xFF); // little-endian
+        wr.writeUint8(sc.numAdpcmChunks >> 8);
+    }
+    wr.patchUint16(fileStart, wr.tell() - headerStart);
+
+    for (int i = 0; i < sc.numAdpcmChunks; i++) {
+        wr.writeUint32(0x61646174); // 'adat'
+        wr.writeUint32(sc.adpcmChunkSize);
+        for (int j = 0; j < sc.adpcmChunkSize; j++) {
+            wr.writeUint8(rng.next());
+        }
+    }
+
+    for (int i = 0; i < sc.numTracks; i++) {
+        writeSyntheticTrack(&wr, sc, &rng);
+    }
+    wr.patchUint32(fileStart - 4, wr.tell() - fileStart);
+
+    return std::vector<uint8_t>(wr.data(), wr.data() + wr.size());
+}
+
+static bool parseSong(const std::vector<uint8_t> &file, mfiSong *song) {
+    mfiBufferReader rd(file.data(), file.size());
+    mfiMediaFile mff(&rd);
+    return mff.readFile(song);
+}
+
+static size_t encodeSong(const mfiSong &song, std::vector<uint8_t> *smf = nullptr) {
+    mfiBufferWriter wr;
+    mfiMidiWriter midiWriter(&wr);
+    midiWriter.writeHeader(&song);
+    uint8_t channelOffset = 0;
+    for (const mfiTrack &track : song.m_tracks) {
+        midiWriter.writeTrack(&track, channelOffset);
+        channelOffset += 4;
+    }
+    size_t size = wr.size();
+    if (smf) wr.takeBuffer(smf);
+    return size;
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Runs whole passes over the file set until minSeconds have gone by. False
+// if a file fails to convert at any stage, so no figures are printed for it.
+static bool runScenario(const char *name, const std::vector<std::vector<uint8_t>> &files, double minSeconds) {
+    std::vector<mfiSong> songs(files.size());
+    std::vector<mfiFileIndex> indexes(files.size());
+    std::vector<std::vector<uint8_t>> smfs(files.size());
+    size_t inputBytes  = 0;
+    size_t outputBytes = 0;
+    size_t numEvents   = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        mfiBufferReader rd(files[i].data(), files[i].size());
+        if (!parseSong(files[i], &songs[i]) || !mfiMediaFile(&rd).readIndex(&indexes[i])) {
+            fprintf(stderr, "%s: file %zu doesn't parse\n", name, i);
+            return false;
+        }
+        inputBytes  += files[i].size();
+        outputBytes += encodeSong(songs[i], &smfs[i]);
+        for (const mfiTrack &track : songs[i].m_tracks) {
+            numEvents += track.size();
+        }
+    }
+
+    auto start     = std::chrono::steady_clock::now();
+    size_t nParses = 0;
+    double parseSeconds;
+    do {
+        for (const std::vector<uint8_t> &file : files) {
+            mfiSong song;
+            if (!parseSong(file, &song)) {
+                fprintf(stderr, "%s: a file that parsed before doesn't parse any more\n", name);
+                return false;
+            }
+        }
+        nParses++;
+    } while ((parseSeconds = secondsSince(start)) < minSeconds);
+
+    start           = std::chrono::steady_clock::now();
+    size_t nCounts  = 0;
+    mfiStats counts = {};
+    double countSeconds;
+    do {
+        for (const std::vector<uint8_t> &file : files) {
+            mfiBufferReader rd(file.data(), file.size());
+            mfiEventCounter counter(&counts);
+            if (!mfiMediaFile(&rd).readFile(&counter)) {
+                fprintf(stderr, "%s: counting rejects a file the parser reads\n", name);
+                return false;
+            }
+        }
+        nCounts++;
+    } while ((countSeconds = secondsSince(start)) < minSeconds);
+
+    if (counts.numNoteEvents + counts.numTypeBEvents + counts.numSysExEvents != numEvents * nCounts) {
+        fprintf(stderr, "%s: counting found %zu events per pass, the parser %zu\n",
+            name,
+            (size_t)((counts.numNoteEvents + counts.numTypeBEvents + counts.numSysExEvents) / nCounts),
+            numEvents);
+    }
+
+    start             = std::chrono::steady_clock::now();
+    size_t nScans     = 0;
+    size_t numScanned = 0;
+    mfiTrackLayout layout;
+    double scanSeconds;
+    do {
+        for (size_t i = 0; i < files.size(); i++) {
+            mfiBufferReader rd(files[i].data(), files[i].size());
+            mfiMediaFile mff(&rd);
+            for (size_t track = 0; track < indexes[i].tracks.size(); track++) {
+                if (!mff.scanTrack(indexes[i], track, &layout)) {
+                    fprintf(stderr, "%s: the scan rejects track %zu of file %zu\n", name, track, i);
+                    return false;
+                }
+                numScanned += layout.eventOffsets.size();
+            }
+        }
+        nScans++;
+    } while ((scanSeconds = secondsSince(start)) < minSeconds);
+
+    if (numScanned != numEvents * nScans) {
+        fprintf(stderr, "%s: scan found %zu events per pass, the parser %zu\n", name, numScanned / nScans, numEvents);
+    }
+
+    start           = std::chrono::steady_clock::now();
+    size_t nEncodes = 0;
+    size_t checksum = 0;
+    double encodeSeconds;
+    do {
+        for (const mfiSong &song : songs) {
+            checksum += encodeSong(song);
+        }
+        nEncodes++;
+    } while ((encodeSeconds = secondsSince(start)) < minSeconds);
+
+    if (checksum != outputBytes * nEncodes) {
+        fprintf(stderr, "%s: encoder output size changed between passes\n", name);
+    }
+
+    // and back: the encoder's SMF output converted to MFi again
+    start              = std::chrono::steady_clock::now();
+    size_t nReverses   = 0;
+    size_t reverseSize = 0;
+    mfiMfiEncoder mfiEncoder;
+    mfiBufferWriter mfiOutput;
+    double reverseSeconds;
+    do {
+        for (const std::vector<uint8_t> &smf : smfs) {
+            mfiBufferReader rd(smf.data(), smf.size());
+            mfiEncoder.reset();
+            mfiOutput.clear();
+            if (!mfiMidiReader(&rd).readFile(&mfiEncoder) || !mfiEncoder.finish(&mfiOutput)) {
+                fprintf(stderr, "%s: the encoder's SMF output doesn't convert back\n", name);
+                return false;
+            }
+            reverseSize += mfiOutput.size();
+        }
+        nReverses++;
+    } while ((reverseSeconds = secondsSince(start)) < minSeconds);
+
+    if (reverseSize % nReverses) {
+        fprintf(stderr, "%s: MFi output size changed between passes\n", name);
+    }
+
+    printf("%-14s %6zu %10zu %10zu %11.1f %11.2f %11.1f %11.1f %11.1f %11.2f %11.1f\n",
+        name,
+        files.size(),
+        inputBytes,
+        numEvents,
+        inputBytes * nParses / parseSeconds / 1e6,
+        numEvents * nParses / parseSeconds / 1e6,
+        inputBytes * nCounts / countSeconds / 1e6,
+        inputBytes * nScans / scanSeconds / 1e6,
+        outputBytes * nEncodes / encodeSeconds / 1e6,
+        numEvents * nEncodes / encodeSeconds / 1e6,
+        outputBytes * nReverses / reverseSeconds / 1e6);
+    return true;
+}
+
+static bool addCorpusFile(const std::filesystem::path &path, std::vector<std::vector<uint8_t>> *files) {
+    mfiMappedFile file(path.string().c_str());
+    if (!file.isOpen()) {
+        fprintf(stderr, "cannot open %s\n", path.string().c_str());
+        return false;
+    }
+    files->emplace_back(file.data(), file.data() + file.size());
+    return true;
+}
+
+static bool collectCorpus(const char *source, std::vector<std::vector<uint8_t>> *files) {
+    namespace fs = std::filesystem;
+
+    std::error_code ec;
+    if (!fs::is_directory(source, ec)) {
+        return addCorpusFile(source, files);
+    }
+
+    for (auto it = fs::recursive_directory_iterator(source, ec); !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        std::string ext = it->path().extension().string();
+        for (char &c : ext) c = (char)tolower((unsigned char)c);
+        if (it->is_regular_file(ec) && ext == ".mld" && !addCorpusFile(it->path(), files)) return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    double minSeconds = 1.0;
+    std::vector<std::vector<uint8_t>> corpus;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            minSeconds = atof(argv[++i]);
+        } else if (!collectCorpus(argv[i], &corpus)) {
+            return 1;
+        }
+    }
+
+    // the corpus may well contain files with unknown events
+    g_mfiLogLevel = MFI_LOG_ERROR;
+
+    printf("%-14s %6s %10s %10s %11s %11s %11s %11s %11s %11s %11s\n",
+        "scenario", "files", "bytes", "events", "parse MB/s", "parse Mev/s", "count MB/s", "scan MB/s", "encode MB/s", "encode Mev/s", "to-MFi MB/s");
+    bool ok = true;
+    for (const mfiBenchScenario &sc : g_benchScenarios) {
+        std::vector<std::vector<uint8_t>> files;
+        files.push_back(makeSyntheticFile(sc));
+        if (!runScenario(sc.name, files, minSeconds)) ok = false;
+    }
+    if (!corpus.empty() && !runScenario("corpus", corpus, minSeconds)) ok = false;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,457 @@
+// Golden-output and differential speed check for the MFi to SMF engines.
+// Every engine converts every file of a corpus, and its output has to be
+// byte for byte the SMF stored for that file; then each one is timed over
+// the corpus against the reference, mfiMidiWriter::writeTrack called
+// track by track on a parsed mfiSong.
+//
+//   mfiGolden [-u] [-t seconds] [-j threads] [-e engine,...] <file.mld|dir> <goldendir>
+//
+// Goldens mirror the corpus tree, foo/bar.mld becoming foo/bar.mid under
+// goldendir. -u writes them with the reference engine instead of checking;
+// a file the reference rejects gets an empty golden, and every engine has
+// to reject it as well. Exits with 1 if any output differs, after printing
+// the first event where it does.
+//
+// The reference can only vouch for the other engines. The goldens under
+// tests/, which ctest checks, were written by MFi2MIDI as it was before
+// the mfi library, so they also catch the reference itself drifting; they
+// are not to be rewritten with -u unless the output is meant to change.
+
+#include "mfi/mfi.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct mfiGoldenFile {
+    std::string name; // relative to the corpus root
+    std::string goldenPath;
+    std::vector<uint8_t> mfi;
+    std::vector<uint8_t> golden;
+};
+
+// One way of turning MFi into SMF. convert() gets every file of the corpus
+// in turn, pass after pass, and may keep whatever it likes in between.
+class mfiGoldenEngine {
+public:
+    virtual ~mfiGoldenEngine() = default;
+
+    virtual const char *name() const = 0;
+
+    // false if the input is rejected
+    virtual bool convert(const std::vector<uint8_t> &mfi, std::vector<uint8_t> *smf) = 0;
+};
+
+// the reference: a full parse, then the encoder track by track
+class mfiSongEngine : public mfiGoldenEngine {
+public:
+    const char *name() const override {
+        return "song";
+    }
+
+    bool convert(const std::vector<uint8_t> &mfi, std::vector<uint8_t> *smf) override {
+        mfiBufferReader rd(mfi.data(), mfi.size());
+        mfiSong song;
+        if (!mfiMediaFile(&rd).readFile(&song)) return false;
+
+        mfiBufferWriter wr;
+        mfiMidiWriter midiWriter(&wr);
+        midiWriter.writeHeader(&song);
+        uint8_t channelOffset = 0;
+        for (const mfiTrack &track : song.m_tracks) {
+            midiWriter.writeTrack(&track, channelOffset);
+            channelOffset += 4;
+        }
+        wr.takeBuffer(smf);
+        return true;
+    }
+};
+
+// event by event through mfiMidiStreamWriter, fresh for every file
+class mfiStreamEngine : public mfiGoldenEngine {
+public:
+    const char *name() const override {
+        return "stream";
+    }
+
+    bool convert(const std::vector<uint8_t> &mfi, std::vector<uint8_t> *smf) override {
+        return mfiConvertToMidi(mfi.data(), mfi.size(), smf);
+    }
+};
+
+// one mfiConverter for the whole corpus, as a batch worker uses it
+class mfiConverterEngine : public mfiGoldenEngine {
+    mfiConverter m_converter;
+
+public:
+    const char *name() const override {
+        return "converter";
+    }
+
+    bool convert(const std::vector<uint8_t> &mfi, std::vector<uint8_t> *smf) override {
+        if (!m_converter.convert(mfi.data(), mfi.size())) return false;
+        m_converter.takeOutput(smf);
+        return true;
+    }
+};
+
+class mfiParallelEngine : public mfiGoldenEngine {
+    unsigned m_numThreads;
+
+public:
+    explicit mfiParallelEngine(unsigned numThreads)
+        : m_numThreads(numThreads) {
+    }
+
+    const char *name() const override {
+        return "parallel";
+    }
+
+    bool convert(const std::vector<uint8_t> &mfi, std::vector<uint8_t> *smf) override {
+        mfiBufferReader rd(mfi.data(), mfi.size());
+        mfiSong song;
+        if (!mfiMediaFile(&rd).readFile(&song)) return false;
+
+        mfiBufferWriter wr;
+        mfiParallelMidiWriter(&wr, m_numThreads).writeSong(&song);
+        wr.takeBuffer(smf);
+        return true;
+    }
+};
+
+// mfiConverter in front of an in-memory cache: the first pass fills it,
+// every later one is served from it
+class mfiCachedEngine : public mfiGoldenEngine {
+    mfiMemoryCache m_cache;
+    mfiConverter m_converter;
+
+public:
+    mfiCachedEngine()
+        : m_cache((size_t)1 << 30) {
+        m_converter.setCache(&m_cache);
+    }
+
+    const char *name() const override {
+        return "cached";
+    }
+
+    bool convert(const std::vector<uint8_t> &mfi, std::vector<uint8_t> *smf) override {
+        if (!m_converter.convert(mfi.data(), mfi.size())) return false;
+        m_converter.takeOutput(smf);
+        return true;
+    }
+};
+
+// an SMF decoded into a flat event list, to point at what differs
+class mfiGoldenDecoder : public mfiMidiEventSink {
+public:
+    struct Event {
+        uint16_t track;
+        mfiMidiEvent ev; // data points into the SMF that was decoded
+    };
+
+    std::vector<Event> m_events;
+    uint16_t m_format    = 0;
+    uint16_t m_numTracks = 0;
+    uint16_t m_division  = 0;
+    uint16_t m_track     = 0;
+    bool m_ok            = false;
+
+    explicit mfiGoldenDecoder(const std::vector<uint8_t> &smf) {
+        mfiBufferReader rd(smf.data(), smf.size());
+        m_ok = mfiMidiReader(&rd).readFile(this);
+    }
+
+    void consumeMidiHeader(uint16_t format, uint16_t numTracks, uint16_t division) override {
+        m_format    = format;
+        m_numTracks = numTracks;
+        m_division  = division;
+    }
+
+    void consumeMidiTrackStart(uint16_t track) override {
+        m_track = track;
+    }
+
+    void consumeMidiEvent(const mfiMidiEvent &ev) override {
+        m_events.push_back({ m_track, ev });
+    }
+
+    // the reader doesn't pass end-of-track on as an event; keep it, so a
+    // track that ends early shows up as a difference too
+    void consumeMidiTrackEnd(uint32_t tick) override {
+        mfiMidiEvent ev{};
+        ev.eventType = MFI_MIDI_EVENT_META;
+        ev.status    = 0x2F;
+        ev.tick      = tick;
+        m_events.push_back({ m_track, ev });
+    }
+};
+
+static bool sameEvent(const mfiGoldenDecoder::Event &a, const mfiGoldenDecoder::Event &b) {
+    const mfiMidiEvent &x = a.ev;
+    const mfiMidiEvent &y = b.ev;
+    if (a.track != b.track || x.eventType != y.eventType || x.status != y.status || x.tick != y.tick) return false;
+    if (x.eventType == MFI_MIDI_EVENT_CHANNEL) return x.data1 == y.data1 && x.data2 == y.data2;
+    return x.size == y.size && (x.size == 0 || memcmp(x.data, y.data, x.size) == 0);
+}
+
+static std::string describeEvent(const mfiGoldenDecoder::Event &event) {
+    static const char *const s_channelMessages[] = {
+        "note off", "note on", "key pressure", "control change", "program change", "channel pressure", "pitch bend"
+    };
+
+    const mfiMidiEvent &ev = event.ev;
+    char text[160];
+    int length = snprintf(text, sizeof(text), "track %u tick %u: ", event.track, ev.tick);
+    if (ev.eventType == MFI_MIDI_EVENT_CHANNEL) {
+        snprintf(text + length, sizeof(text) - length, "%s, channel %u, %u %u",
+            s_channelMessages[(ev.status >> 4) - 8], ev.status & 0xF, ev.data1, ev.data2);
+        return text;
+    }
+
+    if (ev.eventType == MFI_MIDI_EVENT_META) {
+        length += snprintf(text + length, sizeof(text) - length, "meta %02X, %u bytes", ev.status, ev.size);
+    } else {
+        length += snprintf(text + length, sizeof(text) - length, "SysEx %02X, %u bytes", ev.status, ev.size);
+    }
+    for (uint32_t i = 0; i < ev.size && i < 16; i++) {
+        length += snprintf(text + length, sizeof(text) - length, " %02X", ev.data[i]);
+    }
+    if (ev.size > 16) snprintf(text + length, sizeof(text) - length, " ...");
+    return text;
+}
+
+// prints where output first departs from golden, as bytes and as events
+static void reportMismatch(const mfiGoldenFile &file, const char *engine, bool ok, const std::vector<uint8_t> &output) {
+    if (file.golden.empty() || !ok) {
+        printf("FAIL %s [%s]: %s\n", file.name.c_str(), engine,
+            file.golden.empty() ? "converted a file the reference rejects" : "rejected a file the reference converts");
+        return;
+    }
+
+    size_t common = std::min(file.golden.size(), output.size());
+    size_t offset = std::mismatch(file.golden.begin(), file.golden.begin() + common, output.begin()).first - file.golden.begin();
+    printf("FAIL %s [%s]: first difference at byte %zu (golden %zu bytes, output %zu)\n",
+        file.name.c_str(), engine, offset, file.golden.size(), output.size());
+
+    mfiGoldenDecoder expected(file.golden);
+    mfiGoldenDecoder actual(output);
+    if (!expected.m_ok) {
+        printf("  the golden doesn't decode as SMF\n");
+    }
+    if (!actual.m_ok) {
+        printf("  the output doesn't decode as SMF\n");
+    }
+    if (expected.m_format != actual.m_format || expected.m_numTracks != actual.m_numTracks || expected.m_division != actual.m_division) {
+        printf("  header: golden format %u, %u tracks, division %u; output format %u, %u tracks, division %u\n",
+            expected.m_format, expected.m_numTracks, expected.m_division, actual.m_format, actual.m_numTracks, actual.m_division);
+        return;
+    }
+
+    size_t numEvents = std::min(expected.m_events.size(), actual.m_events.size());
+    for (size_t i = 0; i < numEvents; i++) {
+        if (!sameEvent(expected.m_events[i], actual.m_events[i])) {
+            printf("  event %zu is the first that differs\n", i);
+            printf("    golden: %s\n", describeEvent(expected.m_events[i]).c_str());
+            printf("    output: %s\n", describeEvent(actual.m_events[i]).c_str());
+            return;
+        }
+    }
+    if (expected.m_events.size() != actual.m_events.size()) {
+        bool goldenLonger = expected.m_events.size() > numEvents;
+        printf("  event %zu is the first that differs, only the %s has it\n", numEvents, goldenLonger ? "golden" : "output");
+        printf("    %s: %s\n", goldenLonger ? "golden" : "output", describeEvent((goldenLonger ? expected : actual).m_events[numEvents]).c_str());
+        return;
+    }
+    printf("  the events are the same, only their encoding differs\n");
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Checks two passes, since engines that keep state between files are
+// most likely to go wrong on the second, then times whole passes until
+// minSeconds have gone by. Returns the seconds per pass, or -1 on a
+// mismatch.
+static double runEngine(mfiGoldenEngine *engine, const std::vector<mfiGoldenFile> &corpus, double minSeconds) {
+    std::vector<uint8_t> output;
+    size_t numMismatches = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (const mfiGoldenFile &file : corpus) {
+            output.clear();
+            bool ok = engine->convert(file.mfi, &output);
+            if (ok == !file.golden.empty() && (!ok || output == file.golden)) continue;
+            if (numMismatches++ < 10) reportMismatch(file, engine->name(), ok, output);
+        }
+        if (numMismatches) break;
+    }
+    if (numMismatches) {
+        printf("%-10s %zu of %zu files differ\n", engine->name(), numMismatches, corpus.size());
+        return -1;
+    }
+
+    auto start     = std::chrono::steady_clock::now();
+    size_t nPasses = 0;
+    double seconds;
+    do {
+        for (const mfiGoldenFile &file : corpus) {
+            engine->convert(file.mfi, &output);
+        }
+        nPasses++;
+    } while ((seconds = secondsSince(start)) < minSeconds);
+    return seconds / nPasses;
+}
+
+static bool readFile(const std::string &path, std::vector<uint8_t> *data) {
+    mfiMappedFile file(path.c_str());
+    if (!file.isOpen()) return false;
+    data->assign(file.data(), file.data() + file.size());
+    return true;
+}
+
+static bool addCorpusFile(const std::filesystem::path &path, const std::filesystem::path &relativePath, const std::filesystem::path &goldenDir, std::vector<mfiGoldenFile> *corpus) {
+    mfiGoldenFile file;
+    file.name       = relativePath.generic_string();
+    file.goldenPath = (goldenDir / std::filesystem::path(relativePath).replace_extension(".mid")).string();
+    if (!readFile(path.string(), &file.mfi)) {
+        fprintf(stderr, "cannot open %s\n", path.string().c_str());
+        return false;
+    }
+    corpus->push_back(std::move(file));
+    return true;
+}
+
+static bool collectCorpus(const char *source, const std::filesystem::path &goldenDir, std::vector<mfiGoldenFile> *corpus) {
+    namespace fs = std::filesystem;
+
+    std::error_code ec;
+    if (!fs::is_directory(source, ec)) {
+        return addCorpusFile(source, fs::path(source).filename(), goldenDir, corpus);
+    }
+
+    for (auto it = fs::recursive_directory_iterator(source, ec); !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        std::string ext = it->path().extension().string();
+        for (char &c : ext) c = (char)tolower((unsigned char)c);
+        if (!it->is_regular_file(ec) || ext != ".mld") continue;
+        if (!addCorpusFile(it->path(), it->path().lexically_relative(source), goldenDir, corpus)) return false;
+    }
+
+    // the same order, and so the same report, on every platform
+    std::sort(corpus->begin(), corpus->end(), [](const mfiGoldenFile &a, const mfiGoldenFile &b) { return a.name < b.name; });
+    return true;
+}
+
+static int writeGoldens(const std::vector<mfiGoldenFile> &corpus) {
+    mfiSongEngine reference;
+    std::vector<uint8_t> smf;
+    size_t numRejected = 0;
+    for (const mfiGoldenFile &file : corpus) {
+        smf.clear();
+        if (!reference.convert(file.mfi, &smf)) {
+            smf.clear();
+            numRejected++;
+        }
+
+        std::error_code ec;
+        std::filesystem::create_directories(std::filesystem::path(file.goldenPath).parent_path(), ec);
+        if (!mfiWriteFile(file.goldenPath.c_str(), smf.data(), smf.size())) {
+            fprintf(stderr, "cannot write %s\n", file.goldenPath.c_str());
+            return 1;
+        }
+    }
+    printf("wrote %zu goldens (%zu for rejected files)\n", corpus.size(), numRejected);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    double minSeconds   = 1.0;
+    unsigned numThreads = std::max(1u, std::thread::hardware_concurrency());
+    bool update         = false;
+    const char *engines = nullptr;
+    const char *paths[2];
+    int numPaths = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-u") == 0) {
+            update = true;
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            minSeconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            numThreads = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            engines = argv[++i];
+        } else if (numPaths < 2) {
+            paths[numPaths++] = argv[i];
+        } else {
+            numPaths = 0;
+            break;
+        }
+    }
+    if (numPaths != 2) {
+        fprintf(stderr, "Usage: mfiGolden [-u] [-t seconds] [-j threads] [-e engine,...] <file.mld|dir> <goldendir>\n"
+                        "  engines: song (the reference), stream, converter, parallel, cached\n");
+        return 1;
+    }
+
+    // the corpus may well contain files with unknown events
+    g_mfiLogLevel = -1;
+
+    std::vector<mfiGoldenFile> corpus;
+    if (!collectCorpus(paths[0], paths[1], &corpus)) return 1;
+    if (corpus.empty()) {
+        fprintf(stderr, "no *.mld files in %s\n", paths[0]);
+        return 1;
+    }
+    if (update) return writeGoldens(corpus);
+
+    size_t inputBytes = 0;
+    for (mfiGoldenFile &file : corpus) {
+        if (!readFile(file.goldenPath, &file.golden)) {
+            fprintf(stderr, "no golden for %s at %s; write them with -u\n", file.name.c_str(), file.goldenPath.c_str());
+            return 1;
+        }
+        inputBytes += file.mfi.size();
+    }
+
+    std::vector<std::unique_ptr<mfiGoldenEngine>> list;
+    list.push_back(std::make_unique<mfiSongEngine>());
+    list.push_back(std::make_unique<mfiStreamEngine>());
+    list.push_back(std::make_unique<mfiConverterEngine>());
+    list.push_back(std::make_unique<mfiParallelEngine>(numThreads));
+    list.push_back(std::make_unique<mfiCachedEngine>());
+
+    printf("%zu files, %zu bytes\n", corpus.size(), inputBytes);
+    printf("%-10s %10s %10s %8s\n", "engine", "ms/pass", "MB/s", "speedup");
+    bool ok                 = true;
+    double referenceSeconds = 0;
+    for (const std::unique_ptr<mfiGoldenEngine> &engine : list) {
+        // the reference always runs; the speedups are relative to it
+        bool isReference = engine == list.front();
+        if (!isReference && engines) {
+            std::string selected = std::string(",") + engines + ",";
+            if (selected.find(std::string(",") + engine->name() + ",") == std::string::npos) continue;
+        }
+
+        double seconds = runEngine(engine.get(), corpus, minSeconds);
+        if (seconds < 0) {
+            ok = false;
+            continue;
+        }
+        if (isReference) referenceSeconds = seconds;
+        printf("%-10s %10.3f %10.1f %7.2fx\n",
+            engine->name(),
+            seconds * 1e3,
+            inputBytes / seconds / 1e6,
+            referenceSeconds > 0 ? referenceSeconds / seconds : 0.0);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,64 @@
+// Fuzz target for mfiMediaFile::readFile and the other entry points that
+// parse untrusted input. Built against libFuzzer with clang; with other
+// compilers MFI_FUZZ_STANDALONE is defined and main() runs the target on
+// every file given on the command line, for replaying crashes.
+
+#include "mfi/mfi.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    g_mfiLogLevel = -1; // errors are expected here
+
+    {
+        mfiBufferReader rd(data, size);
+        mfiSong song;
+        mfiMediaFile(&rd).readFile(&song);
+    }
+
+    // the streaming encoder sees partial songs when parsing fails
+    {
+        mfiBufferReader rd(data, size);
+        mfiBufferWriter wr;
+        mfiMidiStreamWriter midiWriter(&wr);
+        mfiMediaFile(&rd).readFile(&midiWriter);
+    }
+
+    {
+        mfiBufferReader rd(data, size);
+        mfiFileHeader header;
+        mfiMediaFile(&rd).readFileHeader(&header);
+    }
+
+    {
+        mfiBufferReader rd(data, size);
+        mfiMediaFile mff(&rd);
+        mfiFileIndex index;
+        if (mff.readIndex(&index)) {
+            for (size_t i = 0; i < index.tracks.size(); i++) {
+                mfiBufferReader trackReader(data, size);
+                mfiSong song;
+                song.consumeSongStart(index.info);
+                mfiMediaFile(&trackReader).readTrack(index, i, &song);
+            }
+        }
+    }
+    return 0;
+}
+
+#ifdef MFI_FUZZ_STANDALONE
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        mfiMappedFile file(argv[i]);
+        if (!file.isOpen()) {
+            fprintf(stderr, "cannot open %s\n", argv[i]);
+            return 1;
+        }
+        LLVMFuzzerTestOneInput(file.data(), file.size());
+    }
+    return 0;
+}
+#endif
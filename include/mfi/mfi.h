@@ -0,0 +1,37 @@
+#pragma once
+
+#include "mfi/mfiAdpcm.h"
+#include "mfi/mfiBytes.h"
+#include "mfi/mfiCache.h"
+#include "mfi/mfiConverter.h"
+#include "mfi/mfiIO.h"
+#include "mfi/mfiLog.h"
+#include "mfi/mfiMediaFile.h"
+#include "mfi/mfiMediaFileWriter.h"
+#include "mfi/mfiMfiEncoder.h"
+#include "mfi/mfiMidiReader.h"
+#include "mfi/mfiMidiWriter.h"
+#include "mfi/mfiPack.h"
+#include "mfi/mfiPipeline.h"
+#include "mfi/mfiRenderer.h"
+#include "mfi/mfiServer.h"
+#include "mfi/mfiSong.h"
+#include "mfi/mfiStats.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Converts an MFi file held in memory to a Standard MIDI File. Returns false
+// if the input is malformed; errors are reported through MFI_LOG. If stats
+// isn't null it is filled in, also for files that fail to parse.
+bool mfiConvertToMidi(const void *data, size_t size, std::vector<uint8_t> *smf, mfiStats *stats = nullptr);
+
+// Same as above, but looks the input up in cache first and stores the result
+// there after a successful conversion.
+bool mfiConvertToMidiCached(const void *data, size_t size, std::vector<uint8_t> *smf, mfiConversionCache *cache);
+
+// Converts a Standard MIDI File held in memory to MFi with mfiMfiEncoder.
+// Returns false if the input is malformed; errors are reported through
+// MFI_LOG.
+bool mfiConvertToMfi(const void *data, size_t size, std::vector<uint8_t> *mfi);
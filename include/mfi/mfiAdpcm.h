@@ -0,0 +1,31 @@
+#pragma once
+
+#include "mfi/mfiIO.h"
+
+#include <cstddef>
+#include <cstdint>
+
+// ADPCM chunks carry no format description of their own. The handsets that
+// play them use Yamaha MA-series sound chips, so they are decoded as mono
+// 4-bit Yamaha ADPCM, low nibble first, at the rate those chips default to.
+constexpr uint32_t MFI_ADPCM_SAMPLE_RATE = 8000;
+
+// Decoder state carries over between calls, so a chunk can be decoded in
+// pieces.
+class mfiAdpcmDecoder {
+    int32_t m_predictor;
+    int32_t m_step;
+
+public:
+    mfiAdpcmDecoder()
+        : m_predictor(0),
+          m_step(127) {
+    }
+
+    // writes 2 * size samples to pcm
+    void decode(const uint8_t *data, size_t size, int16_t *pcm);
+};
+
+// a complete RIFF/WAVE file with 16-bit PCM; numSamples counts the samples
+// of all channels, which are interleaved
+void mfiWriteWav(mfiBufferWriter *wr, const int16_t *pcm, size_t numSamples, uint32_t sampleRate, uint16_t numChannels = 1);
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(_WIN32) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define MFI_LITTLE_ENDIAN 1
+#else
+#define MFI_LITTLE_ENDIAN 0
+#endif
+
+inline uint32_t mfiByteSwap32(uint32_t value) {
+#if defined(_MSC_VER)
+    return _byteswap_ulong(value);
+#elif defined(__GNUC__)
+    return __builtin_bswap32(value);
+#else
+    return (value >> 24) | ((value >> 8) & 0xFF00) | ((value << 8) & 0xFF0000) | (value << 24);
+#endif
+}
+
+inline uint16_t mfiByteSwap16(uint16_t value) {
+#if defined(_MSC_VER)
+    return _byteswap_ushort(value);
+#elif defined(__GNUC__)
+    return __builtin_bswap16(value);
+#else
+    return (uint16_t)(value >> 8 | value << 8);
+#endif
+}
+
+// Unaligned big-endian loads and stores; memcpy compiles down to a single
+// move, followed by one bswap on little-endian hosts
+inline uint32_t mfiLoadBE32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return MFI_LITTLE_ENDIAN ? mfiByteSwap32(value) : value;
+}
+
+inline uint16_t mfiLoadBE16(const uint8_t *p) {
+    uint16_t value;
+    memcpy(&value, p, sizeof(value));
+    return MFI_LITTLE_ENDIAN ? mfiByteSwap16(value) : value;
+}
+
+inline void mfiStoreBE32(uint8_t *p, uint32_t value) {
+    if (MFI_LITTLE_ENDIAN) value = mfiByteSwap32(value);
+    memcpy(p, &value, sizeof(value));
+}
+
+inline void mfiStoreBE16(uint8_t *p, uint16_t value) {
+    if (MFI_LITTLE_ENDIAN) value = mfiByteSwap16(value);
+    memcpy(p, &value, sizeof(value));
+}
+
+// little-endian, for WAV output and zip containers
+inline uint32_t mfiLoadLE32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return MFI_LITTLE_ENDIAN ? value : mfiByteSwap32(value);
+}
+
+inline uint16_t mfiLoadLE16(const uint8_t *p) {
+    uint16_t value;
+    memcpy(&value, p, sizeof(value));
+    return MFI_LITTLE_ENDIAN ? value : mfiByteSwap16(value);
+}
+
+inline void mfiStoreLE32(uint8_t *p, uint32_t value) {
+    if (!MFI_LITTLE_ENDIAN) value = mfiByteSwap32(value);
+    memcpy(p, &value, sizeof(value));
+}
+
+inline void mfiStoreLE16(uint8_t *p, uint16_t value) {
+    if (!MFI_LITTLE_ENDIAN) value = mfiByteSwap16(value);
+    memcpy(p, &value, sizeof(value));
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "mfi/mfiIO.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Bump whenever the SMF written for the same input, or the layout of a disk
+// cache entry, changes, so entries written by an older converter are never
+// served.
+constexpr uint64_t MFI_CACHE_FORMAT_VERSION = 2;
+
+// 64-bit xxHash (XXH64) of size bytes
+uint64_t mfiHash64(const void *data, size_t size, uint64_t seed);
+
+// Identifies one conversion: a hash of the input bytes, the input size as a
+// cheap second check against collisions, and whatever options change the
+// output, hashed by the caller (0 for the defaults).
+struct mfiCacheKey {
+    uint64_t contentHash;
+    uint64_t inputSize;
+    uint64_t options;
+
+    bool operator==(const mfiCacheKey &other) const {
+        return contentHash == other.contentHash && inputSize == other.inputSize && options == other.options;
+    }
+};
+
+mfiCacheKey mfiMakeCacheKey(const void *data, size_t size, uint64_t options);
+
+// Stores finished SMF files. Implementations must be safe to call from
+// several threads at once.
+class mfiConversionCache {
+public:
+    virtual ~mfiConversionCache() = default;
+
+    // appends the cached SMF to out; false on a miss
+    virtual bool lookup(const mfiCacheKey &key, mfiBufferWriter *out) = 0;
+    virtual void store(const mfiCacheKey &key, const uint8_t *smf, size_t size) = 0;
+};
+
+// Keeps the most recently used entries up to maxBytes of SMF data in memory.
+class mfiMemoryCache : public mfiConversionCache {
+    struct KeyHash {
+        size_t operator()(const mfiCacheKey &key) const {
+            return (size_t)(key.contentHash ^ key.options);
+        }
+    };
+
+    struct Entry {
+        mfiCacheKey key;
+        std::vector<uint8_t> smf;
+    };
+
+    std::mutex m_mutex;
+    std::list<Entry> m_entries; // most recently used first
+    std::unordered_map<mfiCacheKey, std::list<Entry>::iterator, KeyHash> m_index;
+    size_t m_maxBytes;
+    size_t m_bytes;
+
+public:
+    explicit mfiMemoryCache(size_t maxBytes)
+        : m_maxBytes(maxBytes),
+          m_bytes(0) {
+    }
+
+    bool lookup(const mfiCacheKey &key, mfiBufferWriter *out) override;
+    void store(const mfiCacheKey &key, const uint8_t *smf, size_t size) override;
+};
+
+// One file per entry under a directory, so the cache survives restarts and
+// can be shared between processes. Entries are written to a temporary file
+// named after the writing process and thread, and renamed into place, so
+// readers never see a partial one. Each entry records its key and the size
+// and hash of its SMF, and lookups check all of them.
+class mfiDiskCache : public mfiConversionCache {
+    std::string m_directory;
+
+public:
+    // creates directory if it doesn't exist yet
+    explicit mfiDiskCache(const char *directory);
+
+    bool lookup(const mfiCacheKey &key, mfiBufferWriter *out) override;
+    void store(const mfiCacheKey &key, const uint8_t *smf, size_t size) override;
+
+private:
+    std::string entryPath(const mfiCacheKey &key) const;
+};
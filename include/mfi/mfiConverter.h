@@ -0,0 +1,62 @@
+#pragma once
+
+#include "mfi/mfiCache.h"
+#include "mfi/mfiIO.h"
+#include "mfi/mfiMidiWriter.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Converts one file after another and keeps everything it allocated in
+// between: the output buffer and the note-off queue are cleared, not
+// freed. Once it has seen a file at least as large, a conversion allocates
+// nothing. Meant to be owned by one batch worker; it is not thread-safe.
+class mfiConverter {
+    mfiBufferWriter m_output;
+    mfiMidiStreamWriter m_streamWriter;
+    mfiConversionCache *m_cache;
+
+public:
+    mfiConverter()
+        : m_streamWriter(&m_output),
+          m_cache(nullptr) {
+    }
+
+    mfiConverter(const mfiConverter &)            = delete;
+    mfiConverter &operator=(const mfiConverter &) = delete;
+
+    // Serves conversions from cache when the same bytes were converted
+    // before, and stores new ones there. A hit skips parsing and encoding,
+    // so per-file counters like numUnknownTypeBEvents() read 0 for it.
+    void setCache(mfiConversionCache *cache) {
+        m_cache = cache;
+    }
+
+    // converts data to SMF into the converter's own buffer; see output()
+    bool convert(const void *data, size_t size);
+
+    // maps inputPath, converts it and writes outputPath
+    bool convertFile(const char *inputPath, const char *outputPath);
+
+    // the SMF from the last successful convert, valid until the next one
+    const uint8_t *data() const {
+        return m_output.data();
+    }
+
+    size_t size() const {
+        return m_output.size();
+    }
+
+    // Swaps the SMF from the last convert into out. The converter keeps
+    // out's old storage for the next file, so passing the same vectors back
+    // and forth doesn't allocate.
+    void takeOutput(std::vector<uint8_t> *out) {
+        m_output.takeBuffer(out);
+    }
+
+    // Type B events dropped in the last file
+    uint32_t numUnknownTypeBEvents() const {
+        return m_streamWriter.midiWriter().numUnknownTypeBEvents();
+    }
+};
@@ -0,0 +1,355 @@
+#pragma once
+
+#include "mfi/mfiBytes.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// "-" names stdin for mfiMappedFile and stdout for mfiWriteFile
+inline bool mfiIsStdioPath(const char *filename) {
+    return filename[0] == '-' && filename[1] == '\0';
+}
+
+class mfiMappedFile {
+    const uint8_t *m_data;
+    size_t m_size;
+    bool m_open;
+    bool m_mapped;
+    std::vector<uint8_t> m_buffer; // used when the file can't be mapped (pipes, special files)
+
+public:
+    // "-" reads all of stdin
+    explicit mfiMappedFile(const char *filename);
+
+    ~mfiMappedFile();
+
+    mfiMappedFile(const mfiMappedFile &)            = delete;
+    mfiMappedFile &operator=(const mfiMappedFile &) = delete;
+
+    bool isOpen() const { return m_open; }
+    const uint8_t *data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    bool readWhole(const char *filename);
+    bool readStream(FILE *fp);
+};
+
+// Writes a whole file with plain system calls, no stdio buffer involved.
+// Returns false if it couldn't be created or not all bytes were written.
+// "-" writes to stdout, which is left open.
+bool mfiWriteFile(const char *filename, const void *data, size_t size);
+
+// Decodes big-endian MFi fields from a memory span. Reading past the end
+// doesn't touch memory outside the span: it returns zeros and raises the
+// sticky overrun flag, which the parser checks at chunk boundaries.
+class mfiBufferReader {
+    const uint8_t *m_data;
+    size_t m_size;
+    size_t m_pos;
+    bool m_overrun;
+
+public:
+    mfiBufferReader(const void *data, size_t size)
+        : m_data(static_cast<const uint8_t *>(data)),
+          m_size(size),
+          m_pos(0),
+          m_overrun(false) {
+    }
+
+    size_t tell() const {
+        return m_pos;
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+
+    size_t remaining() const {
+        return m_size - m_pos;
+    }
+
+    bool overrun() const {
+        return m_overrun;
+    }
+
+    void skip(size_t size) {
+        if (!ensure(size)) return;
+        m_pos += size;
+    }
+
+    void seek(size_t pos) {
+        if (pos > m_size) {
+            m_pos     = m_size;
+            m_overrun = true;
+            return;
+        }
+        m_pos = pos;
+    }
+
+    uint32_t readUint32() {
+        if (!ensure(sizeof(uint32_t))) return 0;
+        uint32_t value = mfiLoadBE32(m_data + m_pos);
+        m_pos += sizeof(uint32_t);
+        return value;
+    }
+
+    uint16_t readUint16() {
+        if (!ensure(sizeof(uint16_t))) return 0;
+        uint16_t value = mfiLoadBE16(m_data + m_pos);
+        m_pos += sizeof(uint16_t);
+        return value;
+    }
+
+    uint16_t readUint16LE() {
+        if (!ensure(sizeof(uint16_t))) return 0;
+        const uint8_t *p = m_data + m_pos;
+        m_pos += sizeof(uint16_t);
+        return (uint16_t)(p[1] << 8 | p[0]);
+    }
+
+    uint8_t readUint8() {
+        if (!ensure(sizeof(uint8_t))) return 0;
+        return m_data[m_pos++];
+    }
+
+    // returns a pointer into the underlying buffer, or nullptr if fewer than size bytes are left
+    const uint8_t *readView(size_t size) {
+        if (!ensure(size)) return nullptr;
+        const uint8_t *view = m_data + m_pos;
+        m_pos += size;
+        return view;
+    }
+
+    void read(void *data, size_t size) {
+        if (!ensure(size)) {
+            memset(data, 0, size);
+            return;
+        }
+        memcpy(data, m_data + m_pos, size);
+        m_pos += size;
+    }
+
+private:
+    bool ensure(size_t size) {
+        if (m_size - m_pos >= size) return true;
+        m_pos     = m_size;
+        m_overrun = true;
+        return false;
+    }
+};
+
+// mfiMappedFile is the first base, so the mapping exists before the cursor is set up over it
+class mfiFileReader : private mfiMappedFile, public mfiBufferReader {
+public:
+    explicit mfiFileReader(const char *filename)
+        : mfiMappedFile(filename),
+          mfiBufferReader(mfiMappedFile::data(), mfiMappedFile::size()) {
+    }
+
+    using mfiMappedFile::isOpen;
+};
+
+// Accumulates output in a growable buffer. Chunk sizes are back-patched in
+// memory, so the destination never has to be seekable.
+//
+// The storage vector is grown ahead of m_size, so the encoders can store a
+// whole word at the write position and then commit only the bytes that
+// belong to the value.
+class mfiBufferWriter {
+protected:
+    std::vector<uint8_t> m_buffer;
+    size_t m_size;    // bytes of m_buffer that hold output
+    size_t m_flushed; // bytes already handed to the destination
+
+public:
+    mfiBufferWriter()
+        : m_size(0),
+          m_flushed(0) {
+    }
+
+    virtual ~mfiBufferWriter() = default;
+
+    // hands the buffered bytes to the destination; a plain memory writer keeps them
+    virtual bool flush() {
+        return true;
+    }
+
+    size_t tell() const {
+        return m_flushed + m_size;
+    }
+
+    // the bytes written since the last flush
+    const uint8_t *data() const {
+        return m_buffer.data();
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+
+    // makes room for size more bytes, so writing them doesn't reallocate
+    void reserve(size_t size) {
+        prepare(size);
+    }
+
+    // starts over at offset 0, keeping the buffer's capacity
+    void clear() {
+        m_size    = 0;
+        m_flushed = 0;
+    }
+
+    // moves the unflushed bytes into out and leaves the writer empty
+    void takeBuffer(std::vector<uint8_t> *out) {
+        m_buffer.resize(m_size);
+        out->swap(m_buffer);
+        m_buffer.clear();
+        m_flushed += m_size;
+        m_size = 0;
+    }
+
+    // offset must still be in the buffer, i.e. not flushed yet
+    void patchUint32(size_t offset, uint32_t value) {
+        mfiStoreBE32(m_buffer.data() + (offset - m_flushed), value);
+    }
+
+    void patchUint16(size_t offset, uint16_t value) {
+        mfiStoreBE16(m_buffer.data() + (offset - m_flushed), value);
+    }
+
+    void writeUint32(uint32_t value) {
+        mfiStoreBE32(prepare(sizeof(uint32_t)), value);
+        m_size += sizeof(uint32_t);
+    }
+
+    void writeUint16(uint16_t value) {
+        mfiStoreBE16(prepare(sizeof(uint16_t)), value);
+        m_size += sizeof(uint16_t);
+    }
+
+    // little-endian, for the WAV files written next to the MIDI output
+    void writeUint32LE(uint32_t value) {
+        mfiStoreLE32(prepare(sizeof(uint32_t)), value);
+        m_size += sizeof(uint32_t);
+    }
+
+    void writeUint16LE(uint16_t value) {
+        mfiStoreLE16(prepare(sizeof(uint16_t)), value);
+        m_size += sizeof(uint16_t);
+    }
+
+    void writeUint8(uint8_t value) {
+        *prepare(1) = value;
+        m_size += 1;
+    }
+
+    // a complete channel message (note on/off, CC, pitch bend) as one store
+    void writeMessage3(uint8_t status, uint8_t data1, uint8_t data2) {
+        mfiStoreBE32(prepare(4), (uint32_t)status << 24 | (uint32_t)data1 << 16 | (uint32_t)data2 << 8);
+        m_size += 3;
+    }
+
+    // MIDI variable-length quantity, most significant group first
+    void writeVarInt(uint32_t value) {
+        if (value < 0x80) {
+            writeUint8(value);
+            return;
+        }
+
+        if (value >= 1u << 28) {
+            // doesn't fit a 4-byte quantity; the SMF spec stops there, but stay lossless
+            writeUint8(0x80 | value >> 28);
+            value &= (1u << 28) - 1;
+            writeUint32(spreadVarInt(value) | 0x80808000);
+            return;
+        }
+
+        uint32_t numBytes = 1 + (value >= 1u << 7) + (value >= 1u << 14) + (value >= 1u << 21);
+        uint32_t shift    = 8 * (4 - numBytes);
+
+        // continuation bits on every group but the last one
+        uint32_t encoded = spreadVarInt(value) | (0x80808000u & (0xFFFFFFFFu >> shift));
+        mfiStoreBE32(prepare(4), encoded << shift);
+        m_size += numBytes;
+    }
+
+    void write(const void *data, size_t size) {
+        memcpy(prepare(size), data, size);
+        m_size += size;
+    }
+
+    // For large payloads taken verbatim from the input. A file writer sends
+    // them straight to the file instead of copying them into the buffer, so
+    // nothing written before may still need patching.
+    virtual void writeDirect(const void *data, size_t size) {
+        write(data, size);
+    }
+
+protected:
+    // returns room for at least size bytes at the write position
+    uint8_t *prepare(size_t size) {
+        if (m_buffer.size() - m_size < size) {
+            m_buffer.resize(std::max(m_buffer.size() * 2, m_size + size + 256));
+        }
+        return m_buffer.data() + m_size;
+    }
+
+private:
+    // moves each 7-bit group of value into its own byte, lowest group in the lowest byte
+    static uint32_t spreadVarInt(uint32_t value) {
+        return (value & 0x7F) |
+               ((value << 1) & 0x7F00) |
+               ((value << 2) & 0x7F0000) |
+               ((value << 3) & 0x7F000000);
+    }
+};
+
+class mfiFileWriter : public mfiBufferWriter {
+    FILE *m_fp;
+    bool m_failed; // a direct write went wrong; reported by the next flush
+
+public:
+    explicit mfiFileWriter(const char *filename)
+        : m_fp(nullptr),
+          m_failed(false) {
+        m_fp = fopen(filename, "wb");
+    }
+
+    ~mfiFileWriter() override {
+        if (m_fp) {
+            flush();
+            fclose(m_fp);
+        }
+    }
+
+    mfiFileWriter(const mfiFileWriter &)            = delete;
+    mfiFileWriter &operator=(const mfiFileWriter &) = delete;
+
+    bool isOpen() const {
+        return m_fp != nullptr;
+    }
+
+    // writes everything buffered so far with a single fwrite
+    bool flush() override {
+        if (!m_fp) return false;
+
+        bool ok = fwrite(m_buffer.data(), 1, m_size, m_fp) == m_size && fflush(m_fp) == 0 && !m_failed;
+        m_flushed += m_size;
+        m_size = 0;
+        return ok;
+    }
+
+    void writeDirect(const void *data, size_t size) override {
+        if (!m_fp) return;
+
+        if (fwrite(m_buffer.data(), 1, m_size, m_fp) != m_size || fwrite(data, 1, size, m_fp) != size) {
+            m_failed = true;
+        }
+        m_flushed += m_size + size;
+        m_size = 0;
+    }
+};
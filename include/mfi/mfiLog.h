@@ -0,0 +1,26 @@
+#pragma once
+
+enum mfiLogLevel : int {
+    MFI_LOG_ERROR = 0,
+    MFI_LOG_WARN  = 1,
+    MFI_LOG_INFO  = 2, // file structure: sub-chunks, ADPCM chunks, track count
+    MFI_LOG_TRACE = 3, // one line per event
+};
+
+// Messages above this level are compiled out entirely
+#ifndef MFI_LOG_MAX_LEVEL
+#define MFI_LOG_MAX_LEVEL MFI_LOG_TRACE
+#endif
+
+extern int g_mfiLogLevel;
+
+void mfiLogPrint(int level, const char *format, ...);
+
+// When a level is disabled at runtime this costs a single compare, and the
+// arguments aren't evaluated
+#define MFI_LOG(level, ...)                                                  \
+    do {                                                                     \
+        if ((level) <= MFI_LOG_MAX_LEVEL && (level) <= g_mfiLogLevel) {      \
+            mfiLogPrint((level), __VA_ARGS__);                               \
+        }                                                                    \
+    } while (0)
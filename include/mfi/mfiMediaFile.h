@@ -0,0 +1,167 @@
+#pragma once
+
+#include "mfi/mfiIO.h"
+#include "mfi/mfiSong.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class mfiMidiStreamWriter;
+class mfiEventCounter;
+
+// why the last mfiMediaFile call failed
+enum mfiParseError : uint8_t {
+    MFI_PARSE_OK = 0,
+    MFI_PARSE_BAD_MAGIC,       // not a `melo` file
+    MFI_PARSE_BAD_HEADER,      // a header sub-chunk has the wrong size
+    MFI_PARSE_TRUNCATED,       // a chunk or event runs past the data it belongs to
+    MFI_PARSE_BAD_CHUNK,       // something other than `trac` where a track was expected
+    MFI_PARSE_BAD_EVENT,       // an event the parser doesn't know how to size
+    MFI_PARSE_NO_END_OF_TRACK, // a track chunk ends without its end-of-track event
+};
+
+// where a track chunk's events are in the file
+struct mfiTrackChunk {
+    size_t offset; // first byte after the chunk header
+    uint32_t size;
+};
+
+// an ADPCM chunk's payload, in the order the `ainf` count announced them
+struct mfiAdpcmChunk {
+    uint32_t fourCC;
+    size_t offset; // first byte after the chunk header
+    uint32_t size;
+};
+
+struct mfiHeaderChunk {
+    uint32_t fourCC;
+    std::string data;
+};
+
+// Everything in the file header, for indexing without reading the ADPCM or
+// track data. Text sub-chunks are kept as the raw bytes, which handsets
+// store in Shift_JIS; absent ones are empty.
+struct mfiFileHeader {
+    uint32_t fileLength;
+    uint8_t contentType; // mfiContentType
+    uint8_t subType;     // mfiMelodyType for melodies
+    mfiSongInfo info;    // numTracks stays 0, the track chunks aren't scanned
+
+    std::string title;      // `titl`
+    std::string copyright;  // `copy`
+    std::string version;    // `vers`
+    std::string date;       // `date`
+    std::string source;     // `sorc`
+    std::string protection; // `prot`
+
+    // every sub-chunk in file order, including the ones decoded above
+    std::vector<mfiHeaderChunk> chunks;
+};
+
+struct mfiFileIndex {
+    mfiSongInfo info;
+    std::vector<mfiAdpcmChunk> adpcmChunks;
+    std::vector<mfiTrackChunk> tracks;
+};
+
+// Where the events of one track chunk start, found without decoding them.
+// The offsets let a caller check a track before decoding it, or cut it into
+// ranges that are decoded separately.
+struct mfiTrackLayout {
+    std::vector<uint32_t> eventOffsets; // relative to the start of the event data
+    uint32_t endOffset;                 // just past the end-of-track event
+    uint32_t numNoteEvents;
+};
+
+// Walks the events in data, which is a track chunk's payload, and fills in
+// layout. Runs of note events, which have a fixed stride of 3 or 4 bytes,
+// are checked 16 bytes at a time where SSE2 is available. Returns the same
+// error readTrack would report for the chunk, without logging it.
+mfiParseError mfiScanTrackEvents(const uint8_t *data, size_t size, mfiNoteType noteType, mfiTrackLayout *layout);
+
+class mfiMediaFile {
+    mfiBufferReader *m_rd;
+    mfiNoteType m_noteType;
+    mfiParseError m_error;
+
+public:
+    explicit mfiMediaFile(mfiBufferReader *file)
+        : m_rd(file),
+          m_noteType(MFI_NOTE_TYPE_SHORT),
+          m_error(MFI_PARSE_OK) {
+    }
+
+    // set by every read call that returns false
+    mfiParseError error() const {
+        return m_error;
+    }
+
+    // Returns false if the file is malformed; the sink has then seen
+    // whatever was decoded up to that point.
+    bool readFile(mfiEventSink *sink);
+
+    // Same as above, with the decoder compiled for the sink's type: its
+    // per-event calls are direct and can be inlined into the event loop.
+    bool readFile(mfiSong *song);
+    bool readFile(mfiMidiStreamWriter *writer);
+    bool readFile(mfiEventCounter *counter);
+
+    // Decodes the file header and its sub-chunks and stops at the end of
+    // the header, before the ADPCM and track chunks.
+    bool readFileHeader(mfiFileHeader *header);
+
+    // Parses the file header and records where each track chunk is, without
+    // decoding any events.
+    bool readIndex(mfiFileIndex *index);
+
+    // Decodes one track of an indexed file; the sink sees only its track
+    // start, events and the track end. The index may come from a different
+    // mfiMediaFile over the same data, so tracks can be decoded on several
+    // threads, each with its own reader. A track that runs past the end of
+    // the data leaves the reader overrun, which fails any later track.
+    bool readTrack(const mfiFileIndex &index, size_t track, mfiEventSink *sink);
+
+    // Finds the event boundaries of one track of an indexed file with
+    // mfiScanTrackEvents; fails where readTrack would.
+    bool scanTrack(const mfiFileIndex &index, size_t track, mfiTrackLayout *layout);
+
+private:
+    // the file header and the ADPCM chunks after it; adpcmChunks, if not
+    // null, receives where each ADPCM chunk is
+    bool readHeader(mfiSongInfo *info, size_t *fileStart, uint32_t *fileLength, std::vector<mfiAdpcmChunk> *adpcmChunks);
+
+    // just the file header; header, if not null, also receives every sub-chunk
+    bool readHeaderChunks(mfiSongInfo *info, size_t *fileStart, uint32_t *fileLength, mfiFileHeader *header);
+
+    // walks the track chunk headers without decoding them, then rewinds;
+    // tracks, if not null, receives where each chunk is
+    uint16_t scanTracks(size_t fileStart, uint32_t fileLength, std::vector<mfiTrackChunk> *tracks);
+
+    template <typename Sink>
+    bool readFileAs(Sink *sink);
+
+    template <typename Sink>
+    bool readTrack(Sink *sink);
+
+    // The note type is fixed per file by the `note` sub-chunk, so readTrack
+    // picks one of the two decoders per track and the event loop doesn't
+    // test it again.
+    template <mfiNoteType NoteType, typename Sink>
+    bool readTrackEvents(mfiBufferReader *rd, size_t chunkOffset, Sink *sink);
+
+    bool failTruncatedEvent(size_t chunkOffset);
+
+    bool fail(mfiParseError error) {
+        m_error = error;
+        return false;
+    }
+
+    template <typename Sink>
+    static void emitEvent(Sink *sink, const mfiEvent &ev, uint32_t *absoluteTicks);
+};
+
+// Reads only the file header from disk, unbuffered, so indexing a file costs
+// two reads about the size of the header.
+bool mfiReadFileHeader(const char *filename, mfiFileHeader *header);
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "mfi/mfiIO.h"
+#include "mfi/mfiMediaFile.h"
+#include "mfi/mfiSong.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// the payload of an ADPCM or track chunk to write
+struct mfiChunkData {
+    uint32_t fourCC;
+    const uint8_t *data;
+    uint32_t size;
+};
+
+// Serializes a song back to the `melo` format. Unchanged chunks are passed
+// as views into the original file and go to the output with
+// mfiBufferWriter::writeDirect, which for a file writer means no copy at
+// all; only tracks that were modified need encodeTrack.
+class mfiMediaFileWriter {
+    mfiBufferWriter *m_wr;
+
+public:
+    explicit mfiMediaFileWriter(mfiBufferWriter *wr)
+        : m_wr(wr) {
+    }
+
+    // Writes the whole file. The header sub-chunks go out in the order of
+    // header.chunks, so dropping one from the list strips it. `note` is
+    // rebuilt from header.info.noteType, and `ainf` and the declared track
+    // count from the chunks passed in; either sub-chunk is appended if the
+    // file needs it and header.chunks lacks it. Returns false, having
+    // written nothing, if a count, sub-chunk, the header or the file is too
+    // large for its field.
+    bool writeFile(const mfiFileHeader &header, const std::vector<mfiChunkData> &adpcmChunks, const std::vector<mfiChunkData> &tracks);
+
+    // the events of a track, which like a parsed one has to end with its
+    // end-of-track event, as the payload of a `trac` chunk
+    static void encodeTrack(const mfiTrack &track, mfiNoteType noteType, mfiBufferWriter *out);
+
+    // an unchanged chunk, straight from the input the index was read from
+    static mfiChunkData rawChunk(const uint8_t *input, const mfiAdpcmChunk &chunk) {
+        return { chunk.fourCC, input + chunk.offset, chunk.size };
+    }
+
+    static mfiChunkData rawChunk(const uint8_t *input, const mfiTrackChunk &chunk) {
+        return { 0x74726163, input + chunk.offset, chunk.size }; // 'trac'
+    }
+};
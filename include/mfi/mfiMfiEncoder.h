@@ -0,0 +1,123 @@
+#pragma once
+
+#include "mfi/mfiIO.h"
+#include "mfi/mfiMidiReader.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Builds an MFi file from a Standard MIDI File as mfiMidiReader decodes
+// it: the inverse of mfiMidiWriter. MIDI channel c goes to channel c % 4 of
+// MFi track c / 4, so files written by mfiMidiWriter come back track for
+// track. Note on/off pairs become long-format notes (velocity / 2, key - 45
+// with an octave shift where needed); notes longer than a gate time's 255
+// ticks are split into consecutive notes. CC 7/10/1, banks and programs,
+// pitch bend, tempo and GM master volume map to their class 3 Type B
+// events; everything else is dropped and counted.
+//
+// Events are gathered at absolute ticks, one flat array per MFi track, and
+// delta times are only worked out by finish(). It sizes the output exactly
+// before writing a byte, so the file goes into one preallocated buffer.
+class mfiMfiEncoder : public mfiMidiEventSink {
+    static constexpr size_t NUM_TRACKS = 4;
+
+    // a long-format note or a Type B event; both are 3 bytes after the delta time
+    struct TimedEvent {
+        uint32_t tick;
+        uint8_t bytes[3];
+    };
+
+    struct PendingNote {
+        uint8_t midiChannel;
+        uint8_t midiKey;
+        uint16_t midiTrack;
+        uint8_t track;
+        uint32_t tick;
+        size_t index; // in m_events[track]
+    };
+
+    std::vector<TimedEvent> m_events[NUM_TRACKS];
+    bool m_unsorted[NUM_TRACKS]; // an event went in before an earlier-ticked one
+    uint32_t m_endTicks[NUM_TRACKS];
+    uint8_t m_banks[16];     // the MFi bank each MIDI channel is on
+    uint8_t m_midiBanks[16]; // the last CC 0 on each channel
+
+    std::vector<PendingNote> m_pendingNotes;
+    uint16_t m_division;
+    uint16_t m_timebase;
+    uint8_t m_timebaseCode;
+    uint16_t m_midiTrack;
+    uint8_t m_touchedTracks; // bit per MFi track this MIDI track put events in
+    uint8_t m_usedTracks;    // the same for all MIDI tracks so far
+
+    std::string m_title;
+    std::string m_copyright;
+    mfiBufferWriter m_trackBuffer; // the encoded track chunks, back to back
+
+    uint32_t m_numDroppedEvents;
+    uint32_t m_numSplitNotes;
+    uint32_t m_numTransposedNotes;
+
+public:
+    mfiMfiEncoder() {
+        reset();
+    }
+
+    // forgets the last file but keeps the memory grown for it
+    void reset();
+
+    void consumeMidiHeader(uint16_t format, uint16_t numTracks, uint16_t division) override;
+    void consumeMidiTrackStart(uint16_t track) override;
+    void consumeMidiEvent(const mfiMidiEvent &ev) override;
+    void consumeMidiTrackEnd(uint32_t tick) override;
+
+    // Writes the MFi file for everything consumed since the last reset.
+    // False, with nothing written, if it doesn't fit the format's size fields.
+    bool finish(mfiBufferWriter *out);
+
+    // channel messages, meta and SysEx events with no MFi equivalent
+    uint32_t numDroppedEvents() const {
+        return m_numDroppedEvents;
+    }
+
+    // notes that had to be cut into several because they were too long
+    uint32_t numSplitNotes() const {
+        return m_numSplitNotes;
+    }
+
+    // notes moved by whole octaves into the range MFi keys can reach
+    uint32_t numTransposedNotes() const {
+        return m_numTransposedNotes;
+    }
+
+    // the MFi timebase code for a division: the exact one if there is one,
+    // otherwise the nearest, and the ticks get rescaled
+    static uint8_t timebaseCode(uint16_t division);
+
+private:
+    void addEvent(uint8_t track, uint32_t tick, uint8_t b0, uint8_t b1, uint8_t b2);
+
+    void addTypeB(uint8_t track, uint32_t tick, uint8_t eventId, uint8_t data) {
+        addEvent(track, tick, 3 << 6 | 0x3F, eventId, data);
+    }
+
+    void noteOn(uint8_t channel, uint8_t key, uint8_t velocity, uint32_t tick);
+
+    void noteOff(uint8_t channel, uint8_t key, uint32_t tick);
+
+    void setGateTime(const PendingNote &note, uint32_t tick);
+
+    void programChange(uint8_t channel, uint8_t program, uint32_t tick);
+
+    uint32_t scaleTick(uint32_t tick) const {
+        if (m_division == m_timebase) return tick;
+        return (uint32_t)(((uint64_t)tick * m_timebase + m_division / 2) / m_division);
+    }
+
+    // the MFi track for events that belong to no channel, like tempo
+    uint8_t globalTrack() const {
+        return m_midiTrack < NUM_TRACKS ? (uint8_t)m_midiTrack : NUM_TRACKS - 1;
+    }
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "mfi/mfiIO.h"
+#include "mfi/mfiMediaFile.h"
+
+#include <cstddef>
+#include <cstdint>
+
+enum mfiMidiEventType : uint8_t {
+    MFI_MIDI_EVENT_CHANNEL, // note, controller, program, pressure, pitch bend
+    MFI_MIDI_EVENT_META,
+    MFI_MIDI_EVENT_SYSEX,
+};
+
+struct mfiMidiEvent {
+    mfiMidiEventType eventType;
+    uint8_t status; // channel message status byte, meta type, or F0/F7
+    uint8_t data1;  // channel messages only; data2 is 0 for one-byte messages
+    uint8_t data2;
+    uint32_t tick; // from the start of the track, in the file's division
+
+    // meta and SysEx payload, a view into the buffer being read
+    const uint8_t *data;
+    uint32_t size;
+};
+
+// Receives a Standard MIDI File from mfiMidiReader::readFile as it is
+// parsed. Every track start is matched by a track end, at the tick of its
+// end-of-track event.
+class mfiMidiEventSink {
+public:
+    virtual ~mfiMidiEventSink() = default;
+
+    virtual void consumeMidiHeader([[maybe_unused]] uint16_t format, [[maybe_unused]] uint16_t numTracks, [[maybe_unused]] uint16_t division) {}
+    virtual void consumeMidiTrackStart([[maybe_unused]] uint16_t track) {}
+    virtual void consumeMidiEvent(const mfiMidiEvent &ev) = 0;
+    virtual void consumeMidiTrackEnd([[maybe_unused]] uint32_t tick) {}
+};
+
+// Decodes SMF in one pass over the input, event by event, with running
+// status. Chunks other than MThd and MTrk are skipped, as the format asks.
+// Only divisions in ticks per quarter note are supported, not SMPTE time.
+class mfiMidiReader {
+    mfiBufferReader *m_rd;
+    mfiParseError m_error;
+
+public:
+    explicit mfiMidiReader(mfiBufferReader *rd)
+        : m_rd(rd),
+          m_error(MFI_PARSE_OK) {
+    }
+
+    // set by readFile when it returns false
+    mfiParseError error() const {
+        return m_error;
+    }
+
+    // Returns false if the file is malformed; the sink has then seen
+    // whatever was decoded up to that point.
+    bool readFile(mfiMidiEventSink *sink);
+
+private:
+    bool readTrackEvents(mfiBufferReader *rd, size_t chunkOffset, mfiMidiEventSink *sink);
+
+    bool fail(mfiParseError error) {
+        m_error = error;
+        return false;
+    }
+};
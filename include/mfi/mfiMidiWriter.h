@@ -0,0 +1,335 @@
+#pragma once
+
+#include "mfi/mfiIO.h"
+#include "mfi/mfiSong.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+struct mfiActiveNote {
+    uint8_t channel;
+    uint8_t key;
+    uint32_t absoluteGateTime;
+};
+
+// Pending note-offs, earliest due first. This is the binary heap that
+// std::priority_queue with std::greater kept before: std::push_heap and
+// std::pop_heap over a vector, ordered by due time only. Which of several
+// note-offs due on the same tick comes out first depends on the layout of
+// the whole heap, and the SMF byte order with it, so the same algorithm has
+// to run on the same entries in the same order to give the same output. On
+// top of the old queue it keeps its storage across clear().
+class mfiNoteOffQueue {
+    std::vector<mfiActiveNote> m_heap;
+    size_t m_peakSize;
+
+    static bool laterDue(const mfiActiveNote &a, const mfiActiveNote &b) {
+        return a.absoluteGateTime > b.absoluteGateTime;
+    }
+
+public:
+    mfiNoteOffQueue()
+        : m_peakSize(0) {
+    }
+
+    bool empty() const {
+        return m_heap.empty();
+    }
+
+    size_t size() const {
+        return m_heap.size();
+    }
+
+    // the most entries ever pending at once, also across clear()
+    size_t peakSize() const {
+        return m_peakSize;
+    }
+
+    void push(const mfiActiveNote &note) {
+        m_heap.push_back(note);
+        std::push_heap(m_heap.begin(), m_heap.end(), laterDue);
+        m_peakSize = std::max(m_peakSize, m_heap.size());
+    }
+
+    // the earliest pending note-off, if it is due at or before now, or nullptr
+    const mfiActiveNote *peekDue(uint32_t now) const {
+        if (m_heap.empty() || m_heap.front().absoluteGateTime > now) return nullptr;
+        return &m_heap.front();
+    }
+
+    // retires the entry last returned by peekDue
+    void pop() {
+        std::pop_heap(m_heap.begin(), m_heap.end(), laterDue);
+        m_heap.pop_back();
+    }
+
+    // drops every pending entry; the storage is kept for reuse
+    void clear() {
+        m_heap.clear();
+    }
+};
+
+class mfiMidiWriter {
+    mfiBufferWriter *m_wr;
+    size_t m_trackSizeOffset;
+    uint8_t m_channelOffset;
+    uint32_t m_absoluteTime;
+    uint32_t m_cumulativeDeltaTime;
+    uint8_t m_midiBanks[16];
+    uint32_t m_numUnknownTypeBEvents;
+
+    // Note-offs still pending when a track ends stay queued with their due
+    // times on that track's timeline, and come out once the next track
+    // gets that far, same as they always have.
+    mfiNoteOffQueue m_activeNoteEvents;
+
+public:
+    explicit mfiMidiWriter(mfiBufferWriter *wr)
+        : m_wr(wr),
+          m_trackSizeOffset(0),
+          m_channelOffset(0),
+          m_absoluteTime(0),
+          m_cumulativeDeltaTime(0),
+          m_midiBanks{},
+          m_numUnknownTypeBEvents(0) {
+    }
+
+    // Forgets everything about the previous song, including note-offs it
+    // left pending, but keeps the memory grown for it.
+    void reset() {
+        m_trackSizeOffset       = 0;
+        m_channelOffset         = 0;
+        m_absoluteTime          = 0;
+        m_cumulativeDeltaTime   = 0;
+        m_numUnknownTypeBEvents = 0;
+        m_activeNoteEvents.clear();
+    }
+
+    void writeHeader(const mfiSong *song);
+
+    // the timebase field is the last one, 12 bytes into the header
+    void writeHeader(uint16_t numTracks, uint16_t timebase) {
+        m_wr->writeUint32(0x4D546864); // MThd
+        m_wr->writeUint32(6);
+        m_wr->writeUint16(1);
+        m_wr->writeUint16(numTracks);
+        m_wr->writeUint16(timebase);
+    }
+
+    void writeTrack(const mfiTrack *track, uint8_t channelOffset) {
+        beginTrack(channelOffset);
+        for (const mfiEvent &ev : *track) {
+            writeEvent(ev);
+        }
+        endTrack();
+    }
+
+    void beginTrack(uint8_t channelOffset);
+
+    void endTrack();
+
+    void writeEvent(const mfiEvent &ev);
+
+    // Type B events that were dropped because no MIDI equivalent is known
+    uint32_t numUnknownTypeBEvents() const {
+        return m_numUnknownTypeBEvents;
+    }
+
+    // largest number of note-offs that were waiting to be written at once,
+    // since the writer was constructed
+    size_t peakPendingNoteOffs() const {
+        return m_activeNoteEvents.peakSize();
+    }
+
+    // true if the last track ended with note-offs that will go into the next one
+    bool hasPendingNoteOffs() const {
+        return !m_activeNoteEvents.empty();
+    }
+
+    static bool isTimebaseEvent(const mfiEvent &ev) {
+        return ev.eventType == MFI_EVENT_TYPE_B && ev.typeB.eventClass == 3 && (ev.typeB.eventId & 0xF0) == 0xC0;
+    }
+
+    static uint16_t convertTimebase(uint8_t value) {
+        if (value >= 8) {
+            return 15 << (value - 8);
+        }
+        return 6 << value;
+    }
+
+    // ticks per quarter note: the first timebase event of track 0, or 48
+    static uint16_t songTimebase(const mfiSong *song);
+
+private:
+    // class 3 Type B handlers, indexed by event ID
+    using TypeBHandler = void (mfiMidiWriter::*)(uint8_t data);
+
+    struct TypeBHandlerTable {
+        TypeBHandler handlers[256];
+    };
+
+    static constexpr TypeBHandlerTable makeTypeBHandlerTable() {
+        TypeBHandlerTable table{};
+        table.handlers[0xB0] = &mfiMidiWriter::writeMasterVolume;
+        for (int eventId = 0xC0; eventId <= 0xCF; eventId++) {
+            table.handlers[eventId] = &mfiMidiWriter::writeTempo;
+        }
+        table.handlers[0xDE] = &mfiMidiWriter::writeNop;
+        table.handlers[0xDF] = &mfiMidiWriter::writeEndOfTrack;
+        table.handlers[0xE0] = &mfiMidiWriter::writeProgramSelect;
+        table.handlers[0xE1] = &mfiMidiWriter::writeBankSelect;
+        table.handlers[0xE2] = &mfiMidiWriter::writeVolume;
+        table.handlers[0xE3] = &mfiMidiWriter::writePanning;
+        table.handlers[0xE4] = &mfiMidiWriter::writePitchBend;
+        table.handlers[0xEA] = &mfiMidiWriter::writeModWheel;
+        return table;
+    }
+
+    static const TypeBHandlerTable s_typeBHandlers;
+
+    void writeMasterVolume(uint8_t data);
+
+    // tempo/timebase; the timebase half goes into the SMF header
+    void writeTempo(uint8_t data);
+
+    // no operation; pads delta times past 255 ticks, which go to the next event
+    void writeNop([[maybe_unused]] uint8_t data) {
+    }
+
+    void writeEndOfTrack(uint8_t data);
+
+    void writeProgramSelect(uint8_t data);
+
+    void writeBankSelect(uint8_t data);
+
+    void writeVolume(uint8_t data);
+
+    void writePanning(uint8_t data);
+
+    void writePitchBend(uint8_t data);
+
+    void writeModWheel(uint8_t data);
+
+    // One of the 16 MIDI channels for channel 0-3 of the current track.
+    // MFi songs have at most 4 tracks, so this is just the track's channel
+    // offset plus the channel; the tracks of a malformed song with more
+    // wrap around onto the channels of the first ones, instead of running
+    // past m_midiBanks and into the status nibble.
+    uint8_t midiChannel(uint8_t channel) const {
+        return (m_channelOffset + channel) & 0x0F;
+    }
+
+    void writeCCEvent(uint8_t channel, uint8_t cc, uint8_t value);
+
+    void processNoteOffs();
+
+    void writeDeltaTime() {
+        writeVarInt(m_cumulativeDeltaTime);
+        m_cumulativeDeltaTime = 0;
+    }
+
+    void writeVarInt(uint32_t value) {
+        m_wr->writeVarInt(value);
+    }
+};
+
+// Writes SMF while the file is being parsed: events go straight from
+// mfiMediaFile into the MIDI encoder and every finished track is flushed, so
+// only the current track is ever held in memory. The track count comes from
+// the chunk scan in readFile, and the timebase is patched into the header
+// while it is still buffered together with track 0.
+class mfiMidiStreamWriter final : public mfiEventSink {
+    mfiBufferWriter *m_wr;
+    mfiMidiWriter m_midi;
+    size_t m_headerOffset;
+    uint16_t m_numTracksDone;
+    bool m_timebaseKnown;
+    bool m_flushFailed;
+
+public:
+    explicit mfiMidiStreamWriter(mfiBufferWriter *wr)
+        : m_wr(wr),
+          m_midi(wr),
+          m_headerOffset(0),
+          m_numTracksDone(0),
+          m_timebaseKnown(false),
+          m_flushFailed(false) {
+    }
+
+    bool ok() const {
+        return !m_flushFailed;
+    }
+
+    // ready for the next song; the output writer stays the same
+    void reset() {
+        m_midi.reset();
+        m_headerOffset  = 0;
+        m_numTracksDone = 0;
+        m_timebaseKnown = false;
+        m_flushFailed   = false;
+    }
+
+    const mfiMidiWriter &midiWriter() const {
+        return m_midi;
+    }
+
+    void consumeSongStart(const mfiSongInfo &info) override {
+        m_headerOffset = m_wr->tell();
+        m_midi.writeHeader(info.numTracks, 48);
+    }
+
+    void consumeTrackStart([[maybe_unused]] uint32_t chunkSize) override {
+        m_midi.beginTrack(m_numTracksDone * 4);
+    }
+
+    void consumeEvent(const mfiEvent &ev) override {
+        if (m_numTracksDone == 0 && !m_timebaseKnown && mfiMidiWriter::isTimebaseEvent(ev)) {
+            m_wr->patchUint16(m_headerOffset + 12, mfiMidiWriter::convertTimebase(ev.typeB.eventId & 0xF));
+            m_timebaseKnown = true;
+        }
+        m_midi.writeEvent(ev);
+    }
+
+    void consumeTrackEnd() override {
+        m_midi.endTrack();
+        m_numTracksDone++;
+        if (!m_wr->flush()) m_flushFailed = true;
+    }
+};
+
+// Encodes the tracks of a parsed song on several threads, each with its own
+// mfiMidiWriter and buffer, and appends the buffers to the output after the
+// header. Tracks don't share state, with one exception: note-offs still
+// pending at the end of a track are written into the next one. When a track
+// leaves any, the tracks after it are encoded again in order by that
+// track's writer, so the output always matches mfiMidiWriter::writeTrack
+// called track by track.
+class mfiParallelMidiWriter {
+    mfiBufferWriter *m_wr;
+    unsigned m_numThreads;
+    uint32_t m_numUnknownTypeBEvents;
+    size_t m_peakPendingNoteOffs;
+
+public:
+    mfiParallelMidiWriter(mfiBufferWriter *wr, unsigned numThreads)
+        : m_wr(wr),
+          m_numThreads(numThreads),
+          m_numUnknownTypeBEvents(0),
+          m_peakPendingNoteOffs(0) {
+    }
+
+    void writeSong(const mfiSong *song);
+
+    // Type B events dropped in all tracks of the last song
+    uint32_t numUnknownTypeBEvents() const {
+        return m_numUnknownTypeBEvents;
+    }
+
+    // the highest mfiMidiWriter::peakPendingNoteOffs of any one track
+    size_t peakPendingNoteOffs() const {
+        return m_peakPendingNoteOffs;
+    }
+};
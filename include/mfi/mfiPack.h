@@ -0,0 +1,58 @@
+#pragma once
+
+#include "mfi/mfiIO.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Pack files: many MFi files in one container, converted in one pass
+// without opening each file on its own.
+enum mfiPackFormat : uint8_t {
+    MFI_PACK_RAW, // melo records back to back
+    MFI_PACK_TAR,
+    MFI_PACK_ZIP, // stored entries only; compressed ones are skipped
+};
+
+// one MFi file inside a pack
+struct mfiPackEntry {
+    std::string name; // empty for raw packs
+    size_t offset;
+    size_t size;
+};
+
+// Finds the MFi files in data. Tar and zip entries that don't start with
+// the melo magic are left out; bytes between raw records are skipped up to
+// the next magic. Returns false if data isn't a usable container at all.
+bool mfiScanPack(const uint8_t *data, size_t size, mfiPackFormat *format, std::vector<mfiPackEntry> *entries);
+
+// Writes converted files in the pack format matching the input: SMF files
+// back to back for raw packs, a ustar archive otherwise. The SMF bytes go
+// out through writeDirect, so a file writer doesn't copy them.
+class mfiPackWriter {
+    mfiBufferWriter *m_wr;
+    mfiPackFormat m_format;
+
+public:
+    mfiPackWriter(mfiBufferWriter *wr, mfiPackFormat format)
+        : m_wr(wr),
+          m_format(format == MFI_PACK_RAW ? MFI_PACK_RAW : MFI_PACK_TAR) {
+    }
+
+    // false if name doesn't fit a ustar header
+    bool writeEntry(const std::string &name, const uint8_t *smf, size_t size);
+
+    // the end-of-archive marker
+    void finish();
+};
+
+struct mfiPackStats {
+    size_t numEntries;
+    size_t numFailed;
+};
+
+// Converts every entry of the pack in data on numThreads threads and writes
+// the results to out in the input's order. Entries that fail to convert are
+// logged and left out. Returns false if data isn't a pack.
+bool mfiConvertPack(const void *data, size_t size, mfiBufferWriter *out, unsigned numThreads, mfiPackStats *stats);
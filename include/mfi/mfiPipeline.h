@@ -0,0 +1,49 @@
+#pragma once
+
+#include "mfi/mfiCache.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct mfiBatchJob {
+    std::string inputPath;
+    std::string outputPath;
+};
+
+// Converts a list of files in three overlapping stages: the calling thread
+// reads inputs and writes outputs asynchronously, numWorkers threads
+// convert. At most queueDepth files are in flight at once, each holding
+// one input and one output buffer; the buffers are reused for later files,
+// so memory stays bounded by the largest files seen.
+//
+// On Linux the I/O goes through io_uring (opens and closes included). If
+// the kernel doesn't support it or any of those operations, or the build
+// sets MFI_NO_IO_URING, a pool of threads doing blocking I/O stands in.
+class mfiBatchPipeline {
+    unsigned m_numWorkers;
+    unsigned m_queueDepth;
+    mfiConversionCache *m_cache;
+    const char *m_backendName;
+
+public:
+    mfiBatchPipeline(unsigned numWorkers, unsigned queueDepth)
+        : m_numWorkers(numWorkers),
+          m_queueDepth(queueDepth),
+          m_cache(nullptr),
+          m_backendName("none") {
+    }
+
+    void setCache(mfiConversionCache *cache) {
+        m_cache = cache;
+    }
+
+    // returns the number of jobs that failed; each failure is logged
+    size_t run(const std::vector<mfiBatchJob> &jobs);
+
+    // "io_uring" or "threads", whichever the last run used
+    const char *backendName() const {
+        return m_backendName;
+    }
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "mfi/mfiSong.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+constexpr uint32_t MFI_RENDER_SAMPLE_RATE = 44100;
+
+// songs are cut off after this long, so a broken tempo can't ask for hours of audio
+constexpr uint32_t MFI_RENDER_MAX_SECONDS = 600;
+
+// one note, with the state of its channel at the note-on
+struct mfiRenderVoice {
+    uint32_t startFrame;
+    uint32_t endFrame; // the note-off; the release runs past it
+    float phaseStep;   // wavetable periods per frame
+    float gainLeft;
+    float gainRight;
+    uint8_t family; // General MIDI instrument family, program / 8
+};
+
+// mono PCM mixed in at a fixed point, already at the output rate
+struct mfiRenderClip {
+    std::vector<float> samples;
+    uint32_t startFrame;
+};
+
+// Renders a parsed song straight to 16-bit stereo PCM. Notes and Type B
+// events mean what they mean to mfiMidiWriter: the same keys, velocities,
+// gate times, banks and programs, volume, panning, pitch bend and tempo.
+// Channel state is taken at each note-on and holds for the whole note.
+//
+// The song is turned into a list of voices first. Every voice is a pure
+// function of time, so the output is cut into blocks that are mixed on
+// numThreads threads independently of each other. The instruments are
+// built-in wavetables, one per General MIDI family: a preview of the
+// arrangement, not the sound of a handset.
+class mfiRenderer {
+    uint32_t m_sampleRate;
+    unsigned m_numThreads;
+    std::vector<mfiRenderVoice> m_voices;
+    std::vector<mfiRenderClip> m_clips;
+
+public:
+    explicit mfiRenderer(uint32_t sampleRate = MFI_RENDER_SAMPLE_RATE, unsigned numThreads = 1)
+        : m_sampleRate(sampleRate),
+          m_numThreads(numThreads) {
+    }
+
+    uint32_t sampleRate() const {
+        return m_sampleRate;
+    }
+
+    // Mixes mono PCM recorded at sampleRate into the next render, starting
+    // startSeconds into the song. Clips are kept until reset().
+    void addClip(const int16_t *pcm, size_t numSamples, uint32_t sampleRate, double startSeconds);
+
+    // drops the clips and the voices of the last song
+    void reset() {
+        m_voices.clear();
+        m_clips.clear();
+    }
+
+    // interleaved left/right frames, replacing the contents of pcm
+    void render(const mfiSong &song, std::vector<int16_t> *pcm);
+
+    // notes played in the last render
+    size_t numVoices() const {
+        return m_voices.size();
+    }
+
+private:
+    void collectVoices(const mfiSong &song);
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "mfi/mfiCache.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Frame header ops, and the status a response frame carries in their place
+enum mfiServerOp : uint8_t {
+    MFI_SERVER_OP_TO_MIDI = 'M', // MFi in, SMF out
+    MFI_SERVER_OP_TO_MFI  = 'F', // SMF in, MFi out
+};
+
+enum mfiServerStatus : uint8_t {
+    MFI_SERVER_OK          = 0, // the payload is the converted file
+    MFI_SERVER_BAD_INPUT   = 1, // the input is malformed; no payload
+    MFI_SERVER_BAD_REQUEST = 2, // unknown op or too large; the server closes the connection after it
+};
+
+// Serves conversions over TCP from one long-running process, so callers pay
+// neither the exec nor the warm-up of a fresh converter per file. Each
+// worker thread owns an mfiConverter and an mfiMfiEncoder for its whole
+// life. One event loop thread does all the socket I/O: epoll on Linux,
+// poll() on other POSIX systems and WSAPoll() on Windows.
+//
+// Connections speak one of two protocols, told apart by their first bytes:
+//
+//   Frames: an 8-byte header, then the payload. The request header is
+//   'M' 'F' op 0 followed by the payload size as a big-endian u32; the
+//   response header is the same with a mfiServerStatus in place of op.
+//
+//   HTTP/1.1: POST /midi converts MFi to SMF, POST /mfi SMF to MFi. The
+//   body needs a Content-Length. Malformed input gets 422, an oversized
+//   body 413. Connections are kept alive unless the client says otherwise
+//   or speaks HTTP/1.0.
+//
+// Either way clients may pipeline: requests are converted in parallel and
+// answered in the order they came in. A connection stops being read while
+// it has too many requests pending or too many response bytes unsent, and
+// all connections stop being read while maxInFlight conversions are queued,
+// so a flood of requests is pushed back onto the clients' socket buffers
+// instead of growing the server's memory.
+class mfiServer {
+    unsigned m_numWorkers;
+    unsigned m_maxInFlight;
+    size_t m_maxRequestSize;
+    mfiConversionCache *m_cache;
+    const char *m_backendName;
+
+    intptr_t m_listenSocket; // -1 when not listening
+    uint16_t m_port;
+    intptr_t m_wakeFds[2]; // a pipe, a socket pair on Windows; [0] is polled, [1] wakes the loop
+    std::atomic<bool> m_stopRequested;
+
+public:
+    mfiServer(unsigned numWorkers, unsigned maxInFlight);
+    ~mfiServer();
+
+    mfiServer(const mfiServer &)            = delete;
+    mfiServer &operator=(const mfiServer &) = delete;
+
+    // MFi to SMF conversions go through cache; it must outlive run()
+    void setCache(mfiConversionCache *cache) {
+        m_cache = cache;
+    }
+
+    // larger request payloads are refused; 64 MiB unless set
+    void setMaxRequestSize(size_t size) {
+        m_maxRequestSize = size;
+    }
+
+    // Binds "[host:]port", where host defaults to 127.0.0.1, may be an IPv6
+    // address in brackets, and left empty means every interface. Port 0
+    // picks a free one; see port().
+    bool listen(const char *address);
+
+    uint16_t port() const {
+        return m_port;
+    }
+
+    // Serves until stop() is called. Returns false if the event loop
+    // itself broke down; failed requests are only logged.
+    bool run();
+
+    // makes run() return soon; safe from any thread and from signal handlers
+    void stop();
+
+    // "epoll", "poll" or "WSAPoll", whichever the last run used
+    const char *backendName() const {
+        return m_backendName;
+    }
+};
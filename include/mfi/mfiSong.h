@@ -0,0 +1,268 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+enum mfiContentType : uint8_t {
+    MFI_CT_MELODY = 1,
+    MFI_CT_SONG   = 2,
+};
+
+enum mfiMelodyType : uint8_t {
+    MFI_MELODY_TYPE_COMPLETE = 1,
+    MFI_MELODY_TYPE_PART     = 2,
+};
+
+enum mfiNoteType : uint16_t {
+    MFI_NOTE_TYPE_SHORT = 0,
+    MFI_NOTE_TYPE_LONG  = 1,
+};
+
+enum mfiEventType : uint8_t {
+    MFI_EVENT_TYPE_NOTE,
+    MFI_EVENT_TYPE_B,
+    MFI_EVENT_TYPE_SYSEX,
+};
+
+struct mfiNoteEvent {
+    uint8_t channel;
+    uint8_t key;
+    uint8_t gateTime;
+    uint8_t velocity;
+    uint8_t octaveShift;
+};
+
+struct mfiTypeBEvent {
+    uint8_t eventClass;
+    uint8_t eventId;
+    uint8_t data;
+};
+
+// data is a view, either into the buffer the song was parsed from (which
+// must outlive the song) or into the song's own arena after detachPayloads()
+struct mfiSysExEvent {
+    uint8_t eventClass;
+    uint8_t eventId;
+    uint16_t size;
+    const uint8_t *data;
+};
+
+struct mfiEvent {
+    mfiEventType eventType;
+    uint8_t deltaTime;
+    union {
+        mfiNoteEvent note;
+        mfiTypeBEvent typeB;
+        mfiSysExEvent sysex;
+    };
+};
+
+struct mfiSongInfo {
+    mfiNoteType noteType;
+    uint8_t numTrackChunks;  // as declared in the header
+    uint16_t numTracks;      // `trac` chunks actually present in the file
+    uint16_t numAdpcmChunks; // from the `ainf` sub-chunk
+};
+
+// Receives a song from mfiMediaFile::readFile as it is parsed. Every track
+// start is matched by a track end once its end-of-track event was consumed.
+class mfiEventSink {
+public:
+    virtual ~mfiEventSink() = default;
+
+    virtual void consumeSongStart([[maybe_unused]] const mfiSongInfo &info) {}
+    virtual void consumeTrackStart(uint32_t chunkSize) = 0;
+    virtual void consumeEvent(const mfiEvent &ev)      = 0;
+    virtual void consumeTrackEnd() {}
+};
+
+// Events are kept in one packed array per kind, in track order, plus a
+// 2-byte entry per event with its delta time and kind. A note costs 7 bytes
+// instead of a full mfiEvent. Iterating the track reassembles mfiEvents by
+// walking the three arrays in step.
+class mfiTrack {
+    struct EventRef {
+        uint8_t deltaTime;
+        mfiEventType eventType;
+    };
+
+    std::vector<EventRef> m_refs;
+    std::vector<mfiNoteEvent> m_notes;
+    std::vector<mfiTypeBEvent> m_typeBEvents;
+    std::vector<mfiSysExEvent> m_sysexEvents;
+
+public:
+    class const_iterator {
+        const mfiTrack *m_track;
+        size_t m_ref;
+        size_t m_note;
+        size_t m_typeB;
+        size_t m_sysex;
+
+    public:
+        const_iterator(const mfiTrack *track, size_t ref)
+            : m_track(track),
+              m_ref(ref),
+              m_note(0),
+              m_typeB(0),
+              m_sysex(0) {
+        }
+
+        mfiEvent operator*() const {
+            const EventRef &ref = m_track->m_refs[m_ref];
+
+            mfiEvent ev{};
+            ev.eventType = ref.eventType;
+            ev.deltaTime = ref.deltaTime;
+            if (ref.eventType == MFI_EVENT_TYPE_NOTE) {
+                ev.note = m_track->m_notes[m_note];
+            } else if (ref.eventType == MFI_EVENT_TYPE_B) {
+                ev.typeB = m_track->m_typeBEvents[m_typeB];
+            } else {
+                ev.sysex = m_track->m_sysexEvents[m_sysex];
+            }
+            return ev;
+        }
+
+        const_iterator &operator++() {
+            mfiEventType eventType = m_track->m_refs[m_ref++].eventType;
+            if (eventType == MFI_EVENT_TYPE_NOTE) {
+                m_note++;
+            } else if (eventType == MFI_EVENT_TYPE_B) {
+                m_typeB++;
+            } else {
+                m_sysex++;
+            }
+            return *this;
+        }
+
+        bool operator!=(const const_iterator &other) const {
+            return m_ref != other.m_ref;
+        }
+    };
+
+    const_iterator begin() const {
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, m_refs.size());
+    }
+
+    size_t size() const {
+        return m_refs.size();
+    }
+
+    const std::vector<mfiNoteEvent> &notes() const {
+        return m_notes;
+    }
+
+    const std::vector<mfiTypeBEvent> &typeBEvents() const {
+        return m_typeBEvents;
+    }
+
+    std::vector<mfiSysExEvent> &sysexEvents() {
+        return m_sysexEvents;
+    }
+
+    const std::vector<mfiSysExEvent> &sysexEvents() const {
+        return m_sysexEvents;
+    }
+
+    // Sizes the event and note arrays for a track chunk of chunkSize bytes.
+    // The smallest event is a short note (3 bytes, 4 for long notes), so
+    // neither array can outgrow this for a well-formed chunk.
+    void reserve(uint32_t chunkSize, mfiNoteType noteType) {
+        size_t maxEvents = chunkSize / (noteType == MFI_NOTE_TYPE_LONG ? 4 : 3);
+        m_refs.reserve(maxEvents);
+        m_notes.reserve(maxEvents);
+    }
+
+    // empties the track but keeps its arrays' capacity
+    void clear() {
+        m_refs.clear();
+        m_notes.clear();
+        m_typeBEvents.clear();
+        m_sysexEvents.clear();
+    }
+
+    void consumeEvent(const mfiEvent &ev) {
+        m_refs.push_back({ ev.deltaTime, ev.eventType });
+        if (ev.eventType == MFI_EVENT_TYPE_NOTE) {
+            m_notes.push_back(ev.note);
+        } else if (ev.eventType == MFI_EVENT_TYPE_B) {
+            m_typeBEvents.push_back(ev.typeB);
+        } else {
+            m_sysexEvents.push_back(ev.sysex);
+        }
+    }
+};
+
+class mfiSong : public mfiEventSink {
+    std::vector<uint8_t> m_payloadArena;
+    std::vector<mfiTrack> m_spareTracks; // emptied by clear(), handed out again by consumeTrackStart
+
+public:
+    mfiSongInfo m_info{};
+    std::vector<mfiTrack> m_tracks;
+
+    // Empties the song for the next file. The tracks are kept with their
+    // capacity, so parsing a song no bigger than an earlier one allocates
+    // nothing.
+    void clear() {
+        for (mfiTrack &track : m_tracks) {
+            track.clear();
+            m_spareTracks.push_back(std::move(track));
+        }
+        m_tracks.clear();
+        m_info = mfiSongInfo{};
+        m_payloadArena.clear();
+    }
+
+    void consumeSongStart(const mfiSongInfo &info) override {
+        m_info = info;
+        m_tracks.reserve(info.numTracks);
+    }
+
+    // final, like consumeEvent, so the typed mfiMediaFile::readFile calls
+    // them directly
+    void consumeTrackStart(uint32_t chunkSize) final {
+        if (m_spareTracks.empty()) {
+            m_tracks.emplace_back();
+        } else {
+            m_tracks.push_back(std::move(m_spareTracks.back()));
+            m_spareTracks.pop_back();
+        }
+        m_tracks.back().reserve(chunkSize, m_info.noteType);
+    }
+
+    void consumeEvent(const mfiEvent &ev) final {
+        m_tracks.back().consumeEvent(ev);
+    }
+
+    // Copies every SysEx payload into one song-owned allocation, so the song
+    // no longer depends on the input buffer it was parsed from.
+    void detachPayloads() {
+        size_t totalSize = 0;
+        for (const mfiTrack &track : m_tracks) {
+            for (const mfiSysExEvent &sysex : track.sysexEvents()) {
+                totalSize += sysex.size;
+            }
+        }
+
+        std::vector<uint8_t> arena(totalSize);
+        uint8_t *cursor = arena.data();
+        for (mfiTrack &track : m_tracks) {
+            for (mfiSysExEvent &sysex : track.sysexEvents()) {
+                if (sysex.size == 0) continue;
+                memcpy(cursor, sysex.data, sysex.size);
+                sysex.data = cursor;
+                cursor += sysex.size;
+            }
+        }
+        m_payloadArena = std::move(arena);
+    }
+};
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "mfi/mfiSong.h"
+
+#include <cstddef>
+#include <cstdint>
+
+// Counters and stage timings for one conversion. Filled in by
+// mfiConvertToMidi when the caller passes a pointer to one; conversions
+// without stats don't pay for any of it.
+struct mfiStats {
+    uint64_t bytesRead;
+    uint32_t numTracks;
+    uint64_t numNoteEvents;
+    uint64_t numTypeBEvents;
+    uint64_t numSysExEvents;
+    uint64_t sysexBytes;
+    uint32_t numUnknownTypeBEvents;
+    uint32_t peakPendingNoteOffs;
+
+    // wall time in seconds
+    double headerParseTime;
+    double trackParseTime;
+    double midiWriteTime;
+};
+
+// adds the event counters of a parsed song to stats
+void mfiCountSongEvents(const mfiSong &song, mfiStats *stats);
+
+// Counts the events of a file as it is parsed, without keeping them; the
+// counters come out the same as mfiCountSongEvents gives for the parsed
+// song. Checking a file this way costs no allocation.
+class mfiEventCounter final : public mfiEventSink {
+    mfiStats *m_stats;
+
+public:
+    explicit mfiEventCounter(mfiStats *stats)
+        : m_stats(stats) {
+    }
+
+    void consumeTrackStart([[maybe_unused]] uint32_t chunkSize) override {
+        m_stats->numTracks++;
+    }
+
+    void consumeEvent(const mfiEvent &ev) override {
+        if (ev.eventType == MFI_EVENT_TYPE_NOTE) {
+            m_stats->numNoteEvents++;
+        } else if (ev.eventType == MFI_EVENT_TYPE_B) {
+            m_stats->numTypeBEvents++;
+        } else {
+            m_stats->numSysExEvents++;
+            m_stats->sysexBytes += ev.sysex.size;
+        }
+    }
+};
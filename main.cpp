@@ -1,625 +1,665 @@
+#include "mfi/mfi.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <csignal>
 #include <cstdint>
 #include <cstdio>
-#include <queue>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <thread>
 #include <vector>
 
-enum mfiContentType : uint8_t {
-    MFI_CT_MELODY = 1,
-    MFI_CT_SONG   = 2,
-};
-
-enum mfiMelodyType : uint8_t {
-    MFI_MELODY_TYPE_COMPLETE = 1,
-    MFI_MELODY_TYPE_PART     = 2,
-};
-
-enum mfiNoteType : uint16_t {
-    MFI_NOTE_TYPE_SHORT = 0,
-    MFI_NOTE_TYPE_LONG  = 1,
-};
-
-enum mfiEventType : uint8_t {
-    MFI_EVENT_TYPE_NOTE,
-    MFI_EVENT_TYPE_B,
-    MFI_EVENT_TYPE_SYSEX,
-};
-
-struct mfiNoteEvent {
-    uint8_t channel;
-    uint8_t key;
-    uint8_t gateTime;
-    uint8_t velocity;
-    uint8_t octaveShift;
-};
-
-struct mfiTypeBEvent {
-    uint8_t eventClass;
-    uint8_t eventId;
-    uint8_t data;
-};
-
-struct mfiSysExEvent {
-    uint8_t eventClass;
-    uint8_t eventId;
-    uint16_t size;
-    void *data;
-};
-
-struct mfiEvent {
-    mfiEventType eventType;
-    uint8_t deltaTime;
-    union {
-        mfiNoteEvent note;
-        mfiTypeBEvent typeB;
-        mfiSysExEvent sysex;
-    };
-};
+// set by -s: convert through mfiConvertToMidi and print one JSON line of
+// mfiStats per file on stdout, or on stderr when the SMF goes to stdout
+static bool g_printStats = false;
+
+static void appendJsonString(std::string *out, const char *str) {
+    out->push_back('"');
+    for (; *str; str++) {
+        unsigned char c = (unsigned char)*str;
+        if (c == '"' || c == '\\') {
+            out->push_back('\\');
+            out->push_back(c);
+        } else if (c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out->append(escape);
+        } else {
+            out->push_back(c);
+        }
+    }
+    out->push_back('"');
+}
 
-class mfiTrack {
-    uint32_t m_absoluteTicks;
+static void printStatsJson(FILE *fp, const char *inputPath, bool ok, const mfiStats &stats) {
+    std::string line = "{\"file\":";
+    appendJsonString(&line, inputPath);
+
+    char fields[512];
+    snprintf(fields, sizeof(fields),
+        ",\"ok\":%s,\"bytesRead\":%llu,\"tracks\":%u,\"noteEvents\":%llu,\"typeBEvents\":%llu,"
+        "\"sysexEvents\":%llu,\"sysexBytes\":%llu,\"unknownTypeBEvents\":%u,\"peakPendingNoteOffs\":%u,"
+        "\"headerParseTime\":%.9f,\"trackParseTime\":%.9f,\"midiWriteTime\":%.9f}\n",
+        ok ? "true" : "false",
+        (unsigned long long)stats.bytesRead,
+        stats.numTracks,
+        (unsigned long long)stats.numNoteEvents,
+        (unsigned long long)stats.numTypeBEvents,
+        (unsigned long long)stats.numSysExEvents,
+        (unsigned long long)stats.sysexBytes,
+        stats.numUnknownTypeBEvents,
+        stats.peakPendingNoteOffs,
+        stats.headerParseTime,
+        stats.trackParseTime,
+        stats.midiWriteTime);
+    line += fields;
+
+    // one call, so lines from batch workers don't interleave
+    fputs(line.c_str(), fp);
+}
 
-public:
-    std::vector<mfiEvent> m_events;
+// Writes a finished SMF in one go. Used when the output is stdout, so a
+// failed conversion never leaves half a file in the pipe.
+static bool writeOutput(const char *outputPath, const void *data, size_t size) {
+    if (!mfiWriteFile(outputPath, data, size)) {
+        MFI_LOG(MFI_LOG_ERROR, "failed to write %s\n", outputPath);
+        if (!mfiIsStdioPath(outputPath)) remove(outputPath);
+        return false;
+    }
+    return true;
+}
 
-    mfiTrack() : m_absoluteTicks(0) {}
+static bool convertWithStats(const mfiMappedFile &file, const char *inputPath, const char *outputPath) {
+    std::vector<uint8_t> smf;
+    mfiStats stats;
+    bool ok = mfiConvertToMidi(file.data(), file.size(), &smf, &stats);
+    if (!ok) {
+        MFI_LOG(MFI_LOG_ERROR, "failed to parse %s\n", inputPath);
+    } else {
+        ok = writeOutput(outputPath, smf.data(), smf.size());
+    }
 
-    void consumeEvent(const mfiEvent &ev) {
-        m_absoluteTicks += ev.deltaTime;
+    // stdout may be carrying the SMF itself
+    printStatsJson(mfiIsStdioPath(outputPath) ? stderr : stdout, inputPath, ok, stats);
+    return ok;
+}
 
-        mfiEvent eventCopy = ev;
-        if (ev.eventType == MFI_EVENT_TYPE_SYSEX) {
-            // copy the data
-            eventCopy.sysex.data = malloc(eventCopy.sysex.size);
-            memcpy(eventCopy.sysex.data, ev.sysex.data, ev.sysex.size);
-        }
+// set by -w: write each ADPCM chunk as <output>.<n>.wav
+static bool g_extractAdpcm = false;
 
-        m_events.push_back(eventCopy);
-
-        if (ev.eventType == MFI_EVENT_TYPE_NOTE) {
-            printf("%-10u: note %02x\n", m_absoluteTicks, ev.note.key);
-        } else if (ev.eventType == MFI_EVENT_TYPE_B) {
-            printf("%-10u: type B message (class %x) %02x: %02x\n",
-                m_absoluteTicks,
-                ev.typeB.eventClass,
-                ev.typeB.eventId,
-                ev.typeB.data);
-        } else if (ev.eventType == MFI_EVENT_TYPE_SYSEX) {
-            printf("%-10u: sysex message (class %x) %02x: size %08x\n",
-                m_absoluteTicks,
-                ev.sysex.eventClass,
-                ev.sysex.eventId,
-                ev.sysex.size);
-        }
+static bool decodeAdpcmChunk(mfiBufferReader *rd, const mfiFileIndex &index, size_t i, const char *inputPath, std::vector<int16_t> *pcm) {
+    const mfiAdpcmChunk &chunk = index.adpcmChunks[i];
+    rd->seek(chunk.offset);
+    const uint8_t *data = rd->readView(chunk.size);
+    if (!data) {
+        MFI_LOG(MFI_LOG_ERROR, "%s: ADPCM chunk %zu is truncated\n", inputPath, i);
+        return false;
     }
-};
 
-class mfiSong {
-public:
-    std::vector<mfiTrack> m_tracks;
+    pcm->resize(2 * (size_t)chunk.size);
+    mfiAdpcmDecoder decoder;
+    decoder.decode(data, chunk.size, pcm->data());
+    return true;
+}
 
-    mfiTrack *consumeTrackStart() {
-        return &m_tracks.emplace_back();
+static bool extractAdpcm(const mfiMappedFile &file, const char *inputPath, const char *outputPath) {
+    mfiBufferReader rd(file.data(), file.size());
+    mfiMediaFile mff(&rd);
+    mfiFileIndex index;
+    if (!mff.readIndex(&index)) {
+        MFI_LOG(MFI_LOG_ERROR, "failed to parse %s\n", inputPath);
+        return false;
     }
-};
 
-class mfiFileReader {
-    FILE *m_fp;
+    std::vector<int16_t> pcm;
+    for (size_t i = 0; i < index.adpcmChunks.size(); i++) {
+        if (!decodeAdpcmChunk(&rd, index, i, inputPath, &pcm)) return false;
 
-public:
-    explicit mfiFileReader(const char *filename)
-        : m_fp(nullptr) {
-        m_fp = fopen(filename, "rb");
-    }
+        std::filesystem::path wavPath = outputPath;
+        wavPath.replace_extension("." + std::to_string(i) + ".wav");
 
-    ~mfiFileReader() {
-        fclose(m_fp);
+        mfiFileWriter wfile(wavPath.string().c_str());
+        if (!wfile.isOpen()) {
+            MFI_LOG(MFI_LOG_ERROR, "cannot open %s for writing\n", wavPath.string().c_str());
+            return false;
+        }
+        mfiWriteWav(&wfile, pcm.data(), pcm.size(), MFI_ADPCM_SAMPLE_RATE);
+        if (!wfile.flush()) {
+            MFI_LOG(MFI_LOG_ERROR, "failed to write %s\n", wavPath.string().c_str());
+            return false;
+        }
     }
+    return true;
+}
 
-    size_t tell() {
-        return (size_t)ftell(m_fp);
-    }
+// set by -c: converted files are kept in this directory, keyed by a hash of
+// their contents, and identical inputs are served from there
+static mfiConversionCache *g_cache = nullptr;
 
-    void skip(size_t size) {
-        fseek(m_fp, (long)size, SEEK_CUR);
+// opens the input, which may be stdin, exactly once for all the outputs
+static bool openInput(mfiMappedFile *file, const char *inputPath, const char *outputPath) {
+    if (!file->isOpen()) {
+        MFI_LOG(MFI_LOG_ERROR, "cannot open %s\n", inputPath);
+        return false;
     }
+    return !g_extractAdpcm || extractAdpcm(*file, inputPath, outputPath);
+}
 
-    uint32_t readUint32() {
-        uint32_t data;
-        read(&data, sizeof(uint32_t));
-        data = ((data >> 24) & 0xFF) |
-               ((data << 8) & 0xFF0000) |
-               ((data >> 8) & 0xFF00) |
-               ((data << 24) & 0xFF000000);
-        return data;
-    }
+// set by -m: the inputs are Standard MIDI Files, converted to MFi
+static bool g_toMfi = false;
 
-    uint16_t readUint16() {
-        uint16_t data;
-        read(&data, sizeof(uint16_t));
-        data = data >> 8 | data << 8;
-        return data;
+static bool convertMidiFile(const char *inputPath, const char *outputPath) {
+    mfiMappedFile file(inputPath);
+    if (!file.isOpen()) {
+        MFI_LOG(MFI_LOG_ERROR, "cannot open %s\n", inputPath);
+        return false;
     }
 
-    uint16_t readUint16LE() {
-        uint16_t data;
-        read(&data, sizeof(uint16_t));
-        return data;
+    mfiBufferReader rd(file.data(), file.size());
+    mfiMidiReader reader(&rd);
+    mfiMfiEncoder encoder;
+    if (!reader.readFile(&encoder)) {
+        MFI_LOG(MFI_LOG_ERROR, "failed to parse %s\n", inputPath);
+        return false;
     }
 
-    uint8_t readUint8() {
-        uint8_t data;
-        read(&data, sizeof(uint8_t));
-        return data;
+    mfiBufferWriter wr;
+    if (!encoder.finish(&wr)) {
+        MFI_LOG(MFI_LOG_ERROR, "%s doesn't fit in an MFi file\n", inputPath);
+        return false;
+    }
+    if (uint32_t numDropped = encoder.numDroppedEvents()) {
+        MFI_LOG(MFI_LOG_INFO, "%s: %u events with no MFi equivalent skipped\n", inputPath, numDropped);
     }
+    if (uint32_t numSplit = encoder.numSplitNotes()) {
+        MFI_LOG(MFI_LOG_INFO, "%s: %u notes longer than 255 ticks split\n", inputPath, numSplit);
+    }
+    if (uint32_t numTransposed = encoder.numTransposedNotes()) {
+        MFI_LOG(MFI_LOG_WARN, "%s: %u notes out of range moved by octaves\n", inputPath, numTransposed);
+    }
+    return writeOutput(outputPath, wr.data(), wr.size());
+}
 
-    void read(void *data, size_t size) {
-        fread(data, 1, size, m_fp);
+static bool convertFile(const char *inputPath, const char *outputPath) {
+    if (g_toMfi) {
+        return convertMidiFile(inputPath, outputPath);
     }
-};
 
-class mfiFileWriter {
-    FILE *m_fp;
+    mfiMappedFile file(inputPath);
+    if (!openInput(&file, inputPath, outputPath)) return false;
 
-public:
-    explicit mfiFileWriter(const char *filename)
-        : m_fp(nullptr) {
-        m_fp = fopen(filename, "wb");
+    if (g_printStats) {
+        return convertWithStats(file, inputPath, outputPath);
     }
 
-    ~mfiFileWriter() {
-        fclose(m_fp);
+    if (g_cache || mfiIsStdioPath(outputPath)) {
+        mfiConverter converter;
+        converter.setCache(g_cache);
+        if (!converter.convert(file.data(), file.size())) {
+            MFI_LOG(MFI_LOG_ERROR, "failed to parse %s\n", inputPath);
+            return false;
+        }
+        return writeOutput(outputPath, converter.data(), converter.size());
     }
 
-    size_t tell() {
-        return (size_t)ftell(m_fp);
-    }
+    bool ok;
+    {
+        mfiFileWriter wfile(outputPath);
+        if (!wfile.isOpen()) {
+            MFI_LOG(MFI_LOG_ERROR, "cannot open %s for writing\n", outputPath);
+            return false;
+        }
 
-    void seek(size_t size) {
-        fseek(m_fp, (long)size, SEEK_SET);
-    }
+        mfiBufferReader rd(file.data(), file.size());
+        mfiMediaFile mff(&rd);
+        mfiMidiStreamWriter midiWriter(&wfile);
+        ok = mff.readFile(&midiWriter);
+        if (!ok) {
+            MFI_LOG(MFI_LOG_ERROR, "failed to parse %s\n", inputPath);
+        } else if (!midiWriter.ok() || !wfile.flush()) {
+            MFI_LOG(MFI_LOG_ERROR, "failed to write %s\n", outputPath);
+            ok = false;
+        }
 
-    void writeUint32(uint32_t value) {
-        uint32_t data = ((value >> 24) & 0xFF) |
-                        ((value << 8) & 0xFF0000) |
-                        ((value >> 8) & 0xFF00) |
-                        ((value << 24) & 0xFF000000);
-        write(&data, sizeof(uint32_t));
+        if (uint32_t numUnknown = midiWriter.midiWriter().numUnknownTypeBEvents()) {
+            MFI_LOG(MFI_LOG_INFO, "%s: %u unknown type B events skipped\n", inputPath, numUnknown);
+        }
     }
 
-    void writeUint16(uint16_t value) {
-        uint16_t data = value >> 8 | value << 8;
-        write(&data, sizeof(uint16_t));
-    }
+    // don't leave a truncated SMF behind
+    if (!ok) remove(outputPath);
+    return ok;
+}
 
-    void writeUint8(uint8_t value) {
-        write(&value, sizeof(uint8_t));
-    }
+// -j with a single file: the song is parsed in full, then its tracks are
+// encoded on numThreads threads
+static bool convertFileParallel(const char *inputPath, const char *outputPath, unsigned numThreads) {
+    mfiMappedFile file(inputPath);
+    if (!openInput(&file, inputPath, outputPath)) return false;
 
-    void write(void *data, size_t size) {
-        fwrite(data, 1, size, m_fp);
+    mfiBufferReader rd(file.data(), file.size());
+    mfiMediaFile mff(&rd);
+    mfiSong song;
+    if (!mff.readFile(&song)) {
+        MFI_LOG(MFI_LOG_ERROR, "failed to parse %s\n", inputPath);
+        return false;
     }
-};
 
-class mfiMediaFile {
-    mfiFileReader *m_rd;
-    mfiNoteType m_noteType;
+    // encoding can't fail, so the SMF is built in memory and written once
+    mfiBufferWriter wr;
+    mfiParallelMidiWriter midiWriter(&wr, numThreads);
+    midiWriter.writeSong(&song);
 
-public:
-    explicit mfiMediaFile(mfiFileReader *file)
-        : m_rd(file),
-          m_noteType(MFI_NOTE_TYPE_SHORT) {
+    if (uint32_t numUnknown = midiWriter.numUnknownTypeBEvents()) {
+        MFI_LOG(MFI_LOG_INFO, "%s: %u unknown type B events skipped\n", inputPath, numUnknown);
     }
+    return writeOutput(outputPath, wr.data(), wr.size());
+}
+
+// -r: the song is rendered to 16-bit stereo PCM on numThreads threads and
+// written as a WAV file. The ADPCM chunks are mixed in one after another
+// from the start; the events that would trigger them aren't decoded.
+static bool renderFile(const char *inputPath, const char *outputPath, unsigned numThreads) {
+    mfiMappedFile file(inputPath);
+    if (!openInput(&file, inputPath, outputPath)) return false;
 
-    void readFile(mfiSong *song) {
-        uint32_t magic = m_rd->readUint32();
-        if (magic != 0x6D656C6F) { // 'melo'
-            fprintf(stderr, "melo header missing\n");
-            return;
+    mfiBufferReader rd(file.data(), file.size());
+    mfiMediaFile mff(&rd);
+    mfiSong song;
+    if (!mff.readFile(&song)) {
+        MFI_LOG(MFI_LOG_ERROR, "failed to parse %s\n", inputPath);
+        return false;
+    }
+
+    mfiRenderer renderer(MFI_RENDER_SAMPLE_RATE, numThreads);
+
+    mfiBufferReader indexRd(file.data(), file.size());
+    mfiMediaFile indexMff(&indexRd);
+    mfiFileIndex index;
+    if (indexMff.readIndex(&index)) {
+        std::vector<int16_t> adpcm;
+        double startSeconds = 0.0;
+        for (size_t i = 0; i < index.adpcmChunks.size(); i++) {
+            if (!decodeAdpcmChunk(&indexRd, index, i, inputPath, &adpcm)) return false;
+            renderer.addClip(adpcm.data(), adpcm.size(), MFI_ADPCM_SAMPLE_RATE, startSeconds);
+            startSeconds += (double)adpcm.size() / MFI_ADPCM_SAMPLE_RATE;
         }
+    }
 
-        uint32_t fileLength = m_rd->readUint32();
-        size_t fileStart    = m_rd->tell();
+    std::vector<int16_t> pcm;
+    renderer.render(song, &pcm);
+    MFI_LOG(MFI_LOG_INFO, "%s: %zu notes, %.3f s\n", inputPath, renderer.numVoices(), pcm.size() / 2.0 / renderer.sampleRate());
 
-        uint16_t headerLength = m_rd->readUint16();
-        size_t headerStart    = m_rd->tell();
+    mfiBufferWriter wr;
+    mfiWriteWav(&wr, pcm.data(), pcm.size(), renderer.sampleRate(), 2);
+    return writeOutput(outputPath, wr.data(), wr.size());
+}
 
-        uint8_t contentType = m_rd->readUint8();
-        if (contentType == MFI_CT_MELODY) {
-            uint8_t melodyType = m_rd->readUint8();
-        } else if (contentType == MFI_CT_SONG) {
-            uint8_t songType = m_rd->readUint8();
+// `*` and `?` wildcards, as used by the batch glob source
+static bool matchWildcard(const char *pattern, const char *str) {
+    const char *starPattern = nullptr;
+    const char *starStr     = nullptr;
+    while (*str) {
+        if (*pattern == '*') {
+            starPattern = ++pattern;
+            starStr     = str;
+        } else if (*pattern == '?' || *pattern == *str) {
+            pattern++;
+            str++;
+        } else if (starPattern) {
+            pattern = starPattern;
+            str     = ++starStr;
+        } else {
+            return false;
         }
+    }
+    while (*pattern == '*') pattern++;
+    return *pattern == '\0';
+}
 
-        uint8_t numTrackChunks  = m_rd->readUint8();
-        uint16_t numAdpcmChunks = 0;
+// *.mld, or *.mid and *.midi with -m
+static bool hasInputExtension(const std::filesystem::path &path) {
+    std::string ext = path.extension().string();
+    for (char &c : ext) c = (char)tolower((unsigned char)c);
+    if (g_toMfi) return ext == ".mid" || ext == ".midi";
+    return ext == ".mld";
+}
 
-        while (m_rd->tell() - headerStart < headerLength) {
-            uint32_t chunkFourCC = m_rd->readUint32();
-            uint32_t chunkSize   = m_rd->readUint16();
-            size_t chunkStart    = m_rd->tell();
+static std::string batchOutputPath(const std::filesystem::path &outputDir, std::filesystem::path relativePath) {
+    relativePath.replace_extension(g_toMfi ? ".mld" : ".mid");
+    return (outputDir / relativePath).string();
+}
 
-            printf("SubChunk with FOURCC `%c%c%c%c`\n",
-                (chunkFourCC >> 24) & 0xFF,
-                (chunkFourCC >> 16) & 0xFF,
-                (chunkFourCC >> 8) & 0xFF,
-                (chunkFourCC >> 0) & 0xFF);
+// source is a directory (searched recursively for input files, the tree is mirrored
+// into outputDir), a glob over the files of one directory, or `@manifest`:
+// a text file listing one input per line, optionally followed by a tab and
+// an explicit output path (`@-` reads the list from stdin)
+static bool collectBatchJobs(const char *source, const std::filesystem::path &outputDir, std::vector<mfiBatchJob> *jobs) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+
+    if (source[0] == '@') {
+        FILE *fp = mfiIsStdioPath(source + 1) ? stdin : fopen(source + 1, "r");
+        if (!fp) {
+            MFI_LOG(MFI_LOG_ERROR, "cannot open manifest %s\n", source + 1);
+            return false;
+        }
 
-            if (chunkFourCC == 0x6E6F7465) { // 'note'
-                if (chunkSize != 2) {
-                    fprintf(stderr, "wrong note subchunk size\n");
-                    return;
-                }
-                m_noteType = static_cast<mfiNoteType>(m_rd->readUint16());
-            } else if (chunkFourCC == 0x61696E66) { // 'ainf'
-                if (chunkSize != 2) {
-                    fprintf(stderr, "wrong ADPCM info chunk size\n");
-                    return;
-                }
-                numAdpcmChunks = m_rd->readUint16LE();
+        char line[4096];
+        while (fgets(line, sizeof(line), fp)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] == '\0' || line[0] == '#') continue;
+
+            char *tab = strchr(line, '\t');
+            if (tab) {
+                *tab = '\0';
+                jobs->push_back({ line, tab + 1 });
             } else {
-                m_rd->skip(chunkSize);
+                jobs->push_back({ line, batchOutputPath(outputDir, fs::path(line).filename()) });
             }
         }
+        if (fp != stdin) fclose(fp);
+        return true;
+    }
 
-        for (size_t i = 0; i < numAdpcmChunks; i++) {
-            uint32_t chunkFourCC = m_rd->readUint32();
-            uint32_t chunkSize   = m_rd->readUint32();
-
-            printf("AdpcmChunk with FOURCC `%c%c%c%c`\n",
-                (chunkFourCC >> 24) & 0xFF,
-                (chunkFourCC >> 16) & 0xFF,
-                (chunkFourCC >> 8) & 0xFF,
-                (chunkFourCC >> 0) & 0xFF);
-
-            m_rd->skip(chunkSize);
+    fs::path sourcePath(source);
+    if (fs::is_directory(sourcePath, ec)) {
+        for (fs::recursive_directory_iterator it(sourcePath, ec), end; !ec && it != end; it.increment(ec)) {
+            if (!it->is_regular_file(ec) || !hasInputExtension(it->path())) continue;
+            jobs->push_back({ it->path().string(), batchOutputPath(outputDir, it->path().lexically_relative(sourcePath)) });
         }
-
-        printf("num track chunks: %d\n", numTrackChunks);
-
-        while (m_rd->tell() - fileStart < fileLength) {
-            readTrack(song);
+    } else {
+        std::string pattern = sourcePath.filename().string();
+        fs::path dir        = sourcePath.parent_path();
+        if (dir.empty()) dir = ".";
+
+        for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+            if (!it->is_regular_file(ec) || !matchWildcard(pattern.c_str(), it->path().filename().string().c_str())) continue;
+            jobs->push_back({ it->path().string(), batchOutputPath(outputDir, it->path().filename()) });
         }
     }
 
-private:
-    void readTrack(mfiSong *song) {
-        uint32_t chunkFourCC = m_rd->readUint32();
-        uint32_t chunkSize   = m_rd->readUint32();
-
-        if (chunkFourCC != 0x74726163) {
-            fprintf(stderr,
-                "invalid FOURCC `%c%c%c%c`\n",
-                (chunkFourCC >> 24) & 0xFF,
-                (chunkFourCC >> 16) & 0xFF,
-                (chunkFourCC >> 8) & 0xFF,
-                (chunkFourCC >> 0) & 0xFF);
-            return;
-        }
+    if (ec) {
+        MFI_LOG(MFI_LOG_ERROR, "cannot list %s: %s\n", source, ec.message().c_str());
+        return false;
+    }
+    return true;
+}
 
-        mfiTrack *track = song->consumeTrackStart();
-
-        while (true) {
-            uint8_t deltaTime     = m_rd->readUint8();
-            uint8_t noteStatus    = m_rd->readUint8();
-            uint8_t channelNumber = (noteStatus & 0xC0) >> 6;
-            uint8_t keyNumber     = noteStatus & 0x3F;
-            if (keyNumber == 0x3F) {
-                uint8_t firstByte = m_rd->readUint8();
-                if ((firstByte & 0xF0) == 0xF0) {
-                    uint16_t size = m_rd->readUint16();
-
-                    void *data = malloc(size);
-                    // printf("sysex (class %x) %02x - 0x%04x bytes\n", channelNumber, firstByte, size);
-                    m_rd->read(data, size);
-
-                    mfiEvent ev{};
-                    ev.eventType        = MFI_EVENT_TYPE_SYSEX;
-                    ev.deltaTime        = deltaTime;
-                    ev.sysex.eventClass = channelNumber;
-                    ev.sysex.eventId    = firstByte;
-                    ev.sysex.size       = size;
-                    ev.sysex.data       = data;
-
-                    track->consumeEvent(ev);
-
-                    free(data);
-                } else if ((firstByte & 0x80) == 0x80) {
-                    uint8_t data = m_rd->readUint8();
-
-                    mfiEvent ev{};
-                    ev.eventType        = MFI_EVENT_TYPE_B;
-                    ev.deltaTime        = deltaTime;
-                    ev.typeB.eventClass = channelNumber;
-                    ev.typeB.eventId    = firstByte;
-                    ev.typeB.data       = data;
-
-                    track->consumeEvent(ev);
-
-                    if (channelNumber == 3 && firstByte == 0xDF) {
-                        break; // end of stream
-                    }
-                } else {
-                    printf("b %08llx, ch %02x: %02x\n", m_rd->tell(), channelNumber, firstByte);
-                    fprintf(stderr, "unsupported midi event\n");
-                    return;
+// Runs the jobs on numThreads workers. The job list is known up front, so
+// workers simply claim the next unconverted index from a shared atomic
+// cursor: whoever finishes early picks up the remaining work.
+static int runBatch(const std::vector<mfiBatchJob> &jobs, unsigned numThreads) {
+    std::atomic<size_t> nextJob{ 0 };
+    std::atomic<size_t> numFailed{ 0 };
+
+    auto worker = [&]() {
+        // plain conversions reuse one context per worker; -s and -w need the full paths
+        mfiConverter converter;
+        converter.setCache(g_cache);
+        bool reuse = !g_printStats && !g_extractAdpcm && !g_toMfi;
+
+        size_t index;
+        while ((index = nextJob.fetch_add(1, std::memory_order_relaxed)) < jobs.size()) {
+            const mfiBatchJob &job = jobs[index];
+
+            std::error_code ec;
+            std::filesystem::path parent = std::filesystem::path(job.outputPath).parent_path();
+            if (!parent.empty()) std::filesystem::create_directories(parent, ec);
+
+            bool ok;
+            if (reuse) {
+                ok = converter.convertFile(job.inputPath.c_str(), job.outputPath.c_str());
+                if (uint32_t numUnknown = converter.numUnknownTypeBEvents()) {
+                    MFI_LOG(MFI_LOG_INFO, "%s: %u unknown type B events skipped\n", job.inputPath.c_str(), numUnknown);
                 }
             } else {
-                uint8_t gateTime    = m_rd->readUint8();
-                uint8_t velocity    = 63;
-                uint8_t octaveShift = 0;
-                if (m_noteType == MFI_NOTE_TYPE_LONG) {
-                    uint8_t vos = m_rd->readUint8();
-                    octaveShift = vos & 0x3;
-                    velocity    = (vos & 0xFC) >> 2;
-                }
-
-                mfiEvent ev{};
-                ev.eventType        = MFI_EVENT_TYPE_NOTE;
-                ev.deltaTime        = deltaTime;
-                ev.note.channel     = channelNumber;
-                ev.note.key         = keyNumber;
-                ev.note.gateTime    = gateTime;
-                ev.note.velocity    = velocity;
-                ev.note.octaveShift = octaveShift;
-
-                track->consumeEvent(ev);
+                ok = convertFile(job.inputPath.c_str(), job.outputPath.c_str());
+            }
+            if (!ok) {
+                numFailed.fetch_add(1, std::memory_order_relaxed);
             }
         }
-    }
-};
+    };
 
-class mfiMidiWriter {
-    mfiFileWriter *m_wr;
-    uint32_t m_absoluteTime;
-    uint32_t m_cumulativeDeltaTime;
-    uint8_t m_midiBanks[16];
+    auto startTime = std::chrono::steady_clock::now();
 
-    struct ActiveNoteEvent {
-        uint8_t channel;
-        uint8_t key;
-        uint32_t absoluteGateTime;
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < numThreads; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
 
-        bool operator<(const ActiveNoteEvent &other) const {
-            return absoluteGateTime < other.absoluteGateTime;
-        }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    fprintf(stderr, "converted %zu files (%zu failed) in %.3f s, %.1f files/s on %u threads\n",
+        jobs.size() - numFailed,
+        (size_t)numFailed,
+        seconds,
+        seconds > 0 ? jobs.size() / seconds : 0.0,
+        numThreads);
 
-        bool operator>(const ActiveNoteEvent &other) const {
-            return absoluteGateTime > other.absoluteGateTime;
-        }
-    };
-    std::priority_queue<ActiveNoteEvent, std::vector<ActiveNoteEvent>, std::greater<>> m_activeNoteEvents;
-
-public:
-    explicit mfiMidiWriter(mfiFileWriter *wr)
-        : m_wr(wr),
-          m_absoluteTime(0),
-          m_cumulativeDeltaTime(0),
-          m_midiBanks{} {
-    }
-
-    void writeHeader(const mfiSong *song) {
-        m_wr->writeUint32(0x4D546864); // MThd
-        m_wr->writeUint32(6);
-        m_wr->writeUint16(1);
-        m_wr->writeUint16(song->m_tracks.size());
-
-        uint16_t timebase = 48;
-        for (const mfiEvent &ev : song->m_tracks[0].m_events) {
-            if (ev.eventType == MFI_EVENT_TYPE_B && ev.typeB.eventClass == 3 && (ev.typeB.eventId & 0xF0) == 0xC0) {
-                timebase = convertTimebase(ev.typeB.eventId & 0xF);
-                break;
-            }
-        }
-        m_wr->writeUint16(timebase);
-    }
-
-    void writeTrack(const mfiTrack *track, uint8_t channelOffset) {
-        m_wr->writeUint32(0x4D54726B); // MTrk
-
-        size_t sizeOffset = m_wr->tell();
-        m_wr->writeUint32(0xDEADBEEF); // size will be written here later
-
-        m_absoluteTime        = 0;
-        m_cumulativeDeltaTime = 0;
-        std::fill(std::begin(m_midiBanks), std::end(m_midiBanks), 0);
-        for (const mfiEvent &ev : track->m_events) {
-            m_absoluteTime += ev.deltaTime;
-            m_cumulativeDeltaTime += ev.deltaTime;
-
-            processNoteOffs();
-
-            if (ev.eventType == MFI_EVENT_TYPE_NOTE) {
-                writeDeltaTime();
-                m_wr->writeUint8((channelOffset + ev.note.channel) | 0x90); // note on
-                uint8_t key = ev.note.key + 45;
-                switch (ev.note.octaveShift) {
-                case 1:
-                    key += 12;
-                    break;
-                case 2:
-                    key -= 24;
-                    break;
-                case 3:
-                    key -= 12;
-                    break;
-                default: break;
-                }
-                m_wr->writeUint8(key);
-                m_wr->writeUint8(ev.note.velocity * 2);
-
-                m_activeNoteEvents.push({
-                    static_cast<uint8_t>(channelOffset + ev.note.channel),
-                    key,
-                    m_absoluteTime + ev.note.gateTime,
-                });
-            } else if (ev.eventType == MFI_EVENT_TYPE_B) {
-                if (ev.typeB.eventClass == 3) {
-                    if (ev.typeB.eventId == 0xB0) {
-                        // master volume
-                        writeDeltaTime();
-                        m_wr->writeUint8(0xF0);
-                        writeVarInt(7);
-                        m_wr->writeUint32(0x7F7F0401);
-                        m_wr->writeUint8(0);
-                        m_wr->writeUint8(ev.typeB.data);
-                        m_wr->writeUint8(0xF7);
-                    } else if ((ev.typeB.eventId & 0xF0) == 0xC0) {
-                        // tempo/timebase
-                        // TODO: set default tempo to 125 BPM
-                        writeDeltaTime();
-                        m_wr->writeUint8(0xFF);
-                        m_wr->writeUint8(0x51);
-                        m_wr->writeUint32(0x03000000 | 60'000'000 / ev.typeB.data);
-                    } else if (ev.typeB.eventId == 0xDF) {
-                        // end of track
-                        writeDeltaTime();
-                        m_wr->writeUint8(0xFF);
-                        m_wr->writeUint8(0x2F);
-                        m_wr->writeUint8(0x00);
-                    } else if (ev.typeB.eventId == 0xE0) {
-                        // program select
-                        uint8_t channel = (ev.typeB.data & 0xC0) >> 6;
-
-                        writeDeltaTime();
-                        m_wr->writeUint8(0xC0 | (channelOffset + channel)); // program change
-
-                        uint8_t programNumber = ev.typeB.data & 0x3F;
-                        if (m_midiBanks[channelOffset + channel] == 3) {
-                            programNumber += 64;
-                        }
-
-                        m_wr->writeUint8(programNumber); // program number
-                    } else if (ev.typeB.eventId == 0xE1) {
-                        // bank select
-                        uint8_t channel = (ev.typeB.data & 0xC0) >> 6;
-
-                        uint8_t bank                         = ev.typeB.data & 0x3F;
-                        m_midiBanks[channelOffset + channel] = ev.typeB.data & 0x3F;
-
-                        if (bank == 2 || bank == 3) {
-                            bank = 0; // remap to General MIDI
-                        } else if (bank == 0x3F) {
-                            bank = 0; // oops! no drum kit for you.
-                        }
-
-                        writeCCEvent(channelOffset + channel, 0, bank);
-                    } else if (ev.typeB.eventId == 0xE2) {
-                        // volume
-                        uint8_t channel = (ev.typeB.data & 0xC0) >> 6;
-                        uint8_t volume  = (ev.typeB.data & 0x3F);
-                        writeCCEvent(channelOffset + channel, 7, volume * 2);
-                    } else if (ev.typeB.eventId == 0xE3) {
-                        // panning
-                        uint8_t channel = (ev.typeB.data & 0xC0) >> 6;
-                        writeCCEvent(channelOffset + channel, 10, (ev.typeB.data & 0x3F) * 2);
-                    } else if (ev.typeB.eventId == 0xE4) {
-                        // pitch bend wheel
-                        uint8_t channel = (ev.typeB.data & 0xC0) >> 6;
-                        uint32_t value  = (ev.typeB.data & 0x3F) << 8u;
-
-                        writeDeltaTime();
-                        m_wr->writeUint8(0xE0 | channel);
-                        m_wr->writeUint8((value >> 7) & 0x7F);
-                        m_wr->writeUint8(value & 0x7F);
-                    } else if (ev.typeB.eventId == 0xEA) {
-                        // mod wheel
-                        uint8_t channel = (ev.typeB.data & 0xC0) >> 6;
-                        writeCCEvent(channelOffset + channel, 1, (ev.typeB.data & 0x3F) * 2);
-                    } else {
-                        printf("Unknown Type B Class 3 Event %02x\n", ev.typeB.eventId);
-                    }
-                } else {
-                    printf("Unknown Type B Class %x Event %02x\n", ev.typeB.eventClass, ev.typeB.eventId);
-                }
-            }
-        }
+    return numFailed ? 1 : 0;
+}
 
-        processNoteOffs();
+// -p: reads and writes go through mfiBatchPipeline, with queueDepth files
+// in flight while numThreads workers convert
+static int runPipelinedBatch(const std::vector<mfiBatchJob> &jobs, unsigned numThreads, unsigned queueDepth) {
+    mfiBatchPipeline pipeline(numThreads, queueDepth);
+    pipeline.setCache(g_cache);
+
+    auto startTime   = std::chrono::steady_clock::now();
+    size_t numFailed = pipeline.run(jobs);
+    double seconds   = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+    fprintf(stderr, "converted %zu files (%zu failed) in %.3f s, %.1f files/s on %u threads, %u in flight (%s)\n",
+        jobs.size() - numFailed,
+        numFailed,
+        seconds,
+        seconds > 0 ? jobs.size() / seconds : 0.0,
+        numThreads,
+        queueDepth,
+        pipeline.backendName());
+
+    return numFailed ? 1 : 0;
+}
 
-        size_t endOffset = m_wr->tell();
-        m_wr->seek(sizeOffset);
-        m_wr->writeUint32(endOffset - sizeOffset - 4);
-        m_wr->seek(endOffset);
+// -a: converts every MFi file in one tar, zip or raw melo pack into a
+// pack of SMF files
+static int convertPack(const char *inputPath, const char *outputPath, unsigned numThreads) {
+    mfiMappedFile file(inputPath);
+    if (!file.isOpen()) {
+        MFI_LOG(MFI_LOG_ERROR, "cannot open %s\n", inputPath);
+        return 1;
     }
 
-private:
-    void writeCCEvent(uint8_t channel, uint8_t cc, uint8_t value) {
-        writeDeltaTime();
-        m_wr->writeUint8(0xB0 | channel);
-        m_wr->writeUint8(cc);
-        m_wr->writeUint8(value);
+    auto startTime = std::chrono::steady_clock::now();
+    mfiPackStats stats;
+    bool ok;
+    if (mfiIsStdioPath(outputPath)) {
+        mfiBufferWriter wr;
+        ok = mfiConvertPack(file.data(), file.size(), &wr, numThreads, &stats) && mfiWriteFile(outputPath, wr.data(), wr.size());
+    } else {
+        mfiFileWriter wfile(outputPath);
+        if (!wfile.isOpen()) {
+            MFI_LOG(MFI_LOG_ERROR, "cannot open %s for writing\n", outputPath);
+            return 1;
+        }
+        ok = mfiConvertPack(file.data(), file.size(), &wfile, numThreads, &stats);
+    }
+    if (!ok) {
+        MFI_LOG(MFI_LOG_ERROR, "failed to convert pack %s\n", inputPath);
+        if (!mfiIsStdioPath(outputPath)) remove(outputPath);
+        return 1;
     }
 
-    void processNoteOffs() {
-        while (!m_activeNoteEvents.empty()) {
-            const ActiveNoteEvent &act = m_activeNoteEvents.top();
-            if (m_absoluteTime < act.absoluteGateTime) break;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    fprintf(stderr, "converted %zu files (%zu failed) in %.3f s, %.1f files/s on %u threads\n",
+        stats.numEntries - stats.numFailed,
+        stats.numFailed,
+        seconds,
+        seconds > 0 ? stats.numEntries / seconds : 0.0,
+        numThreads);
 
-            uint32_t newCumulativeDeltaTime = m_absoluteTime - act.absoluteGateTime;
-            m_cumulativeDeltaTime -= newCumulativeDeltaTime;
+    return stats.numFailed ? 1 : 0;
+}
 
-            writeDeltaTime();
-            m_wr->writeUint8(act.channel | 0x80); // note off
-            m_wr->writeUint8(act.key);
-            m_wr->writeUint8(64); // TODO: should we use the note on velocity?
+static mfiServer *g_server = nullptr;
 
-            m_cumulativeDeltaTime = newCumulativeDeltaTime;
+static void stopServer(int) {
+    g_server->stop();
+}
+
+static int runServer(const char *address, unsigned numThreads, unsigned queueDepth) {
+    mfiServer server(numThreads, queueDepth ? queueDepth : 4 * numThreads);
+    server.setCache(g_cache);
+    if (!server.listen(address)) return 1;
+    fprintf(stderr, "listening on port %u with %u threads\n", server.port(), numThreads);
+
+    g_server = &server;
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    bool ok = server.run();
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    g_server = nullptr;
+    return ok ? 0 : 1;
+}
 
-            m_activeNoteEvents.pop();
+static void printUsage() {
+    fprintf(stderr,
+        "Usage: MFiReader [-q|-v|-vv] [-s] [-w] [-c cachedir] [-j threads] <file.mld> <file.mid>\n"
+        "       MFiReader [-q|-v|-vv] [-s] [-w] [-c cachedir] [-j threads] [-p depth] -b <dir|glob|@manifest> <outdir>\n"
+        "       MFiReader [-q|-v|-vv] [-j threads] -a <pack> <outpack>\n"
+        "       MFiReader [-q|-v|-vv] [-w] [-j threads] -r <file.mld> <file.wav>\n"
+        "       MFiReader [-q|-v|-vv] [-j threads] -m [-b] <file.mid|dir|glob|@manifest> <file.mld|outdir>\n"
+        "       MFiReader [-q|-v|-vv] [-c cachedir] [-j threads] [-p depth] -d <[host:]port>\n"
+        "  -   as <file.mld> or <file.mid>: read stdin or write stdout\n"
+        "  -s  print conversion stats as one JSON line per file (on stderr if writing stdout)\n"
+        "  -w  also decode the ADPCM chunks to <file>.<n>.wav\n"
+        "  -c  reuse earlier conversions of identical files kept in cachedir (not with -s)\n"
+        "  -j  batch: files converted at once; single file: tracks encoded at once\n"
+        "  -a  convert a tar, zip (stored) or raw melo pack; writes tar, or raw for raw input\n"
+        "  -p  batch: overlap reads and writes with conversion, up to depth files in flight\n"
+        "  -r  render the song to a stereo WAV file with built-in instruments instead\n"
+        "  -m  convert Standard MIDI Files (*.mid, *.midi in batches) to MFi instead\n"
+        "  -d  serve conversions over TCP (frames or HTTP, see mfiServer.h) until interrupted;\n"
+        "      -j sets the workers, -p the requests in flight (default 4 per worker)\n");
+}
+
+int main(int argc, char **argv) {
+    const char *paths[2];
+    int numPaths         = 0;
+    bool batch           = false;
+    bool pack            = false;
+    bool render          = false;
+    bool threadsGiven    = false;
+    unsigned numThreads  = std::max(1u, std::thread::hardware_concurrency());
+    unsigned queueDepth  = 0;
+    const char *cacheDir = nullptr;
+    const char *address  = nullptr;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "-q") == 0) {
+            g_mfiLogLevel = MFI_LOG_ERROR;
+        } else if (strcmp(arg, "-v") == 0) {
+            g_mfiLogLevel = MFI_LOG_INFO;
+        } else if (strcmp(arg, "-vv") == 0) {
+            g_mfiLogLevel = MFI_LOG_TRACE;
+        } else if (strcmp(arg, "-w") == 0) {
+            g_extractAdpcm = true;
+        } else if (strcmp(arg, "-s") == 0) {
+            g_printStats = true;
+        } else if (strcmp(arg, "-c") == 0 && i + 1 < argc) {
+            cacheDir = argv[++i];
+        } else if (strcmp(arg, "-p") == 0 && i + 1 < argc) {
+            queueDepth = (unsigned)std::max(1, atoi(argv[++i]));
+        } else if (strcmp(arg, "-b") == 0) {
+            batch = true;
+        } else if (strcmp(arg, "-a") == 0) {
+            pack = true;
+        } else if (strcmp(arg, "-r") == 0) {
+            render = true;
+        } else if (strcmp(arg, "-m") == 0) {
+            g_toMfi = true;
+        } else if (strcmp(arg, "-d") == 0 && i + 1 < argc) {
+            address = argv[++i];
+        } else if (strcmp(arg, "-j") == 0 && i + 1 < argc) {
+            numThreads   = std::max(1, atoi(argv[++i]));
+            threadsGiven = true;
+        } else if (numPaths < 2) {
+            paths[numPaths++] = arg;
+        } else {
+            numPaths = 0;
+            break;
         }
     }
 
-    void writeDeltaTime() {
-        writeVarInt(m_cumulativeDeltaTime);
-        m_cumulativeDeltaTime = 0;
+    if (numPaths != (address ? 0 : 2)) {
+        printUsage();
+        return 1;
     }
 
-    void writeVarInt(uint32_t value) {
-        uint32_t buffer = value & 0x7F;
+    std::unique_ptr<mfiDiskCache> cache;
+    if (cacheDir) {
+        cache   = std::make_unique<mfiDiskCache>(cacheDir);
+        g_cache = cache.get();
+    }
 
-        while (value >>= 7) {
-            buffer <<= 8;
-            buffer |= value & 0x7F | 0x80;
-        }
+    if (address && (batch || pack || render || g_toMfi || g_printStats || g_extractAdpcm)) {
+        MFI_LOG(MFI_LOG_ERROR, "-d can't be combined with -b, -a, -r, -m, -s or -w\n");
+        return 1;
+    }
 
-        while (true) {
-            m_wr->writeUint8(buffer);
-            if (buffer & 0x80) {
-                buffer >>= 8;
-            } else {
-                break;
-            }
-        }
+    if (address) {
+        return runServer(address, numThreads, queueDepth);
     }
 
-    static uint32_t convertTimebase(uint8_t value) {
-        if (value >= 8) {
-            return 15 << (value - 8);
-        }
-        return 6 << value;
+    if (g_toMfi && (render || pack || g_printStats || g_extractAdpcm || cacheDir)) {
+        MFI_LOG(MFI_LOG_ERROR, "-m can't be combined with -r, -a, -s, -w or -c\n");
+        return 1;
     }
-};
 
-int main(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: MFiReader <file.mld> <file.mid>\n");
+    if (render && (pack || batch)) {
+        MFI_LOG(MFI_LOG_ERROR, "-r renders a single file\n");
         return 1;
     }
 
-    mfiFileReader file(argv[1]);
-    mfiMediaFile mff(&file);
+    if (pack) {
+        return convertPack(paths[0], paths[1], numThreads);
+    }
 
-    mfiSong song;
-    mff.readFile(&song);
+    if (batch) {
+        std::vector<mfiBatchJob> jobs;
+        if (!collectBatchJobs(paths[0], paths[1], &jobs)) return 1;
+        if (queueDepth && (g_printStats || g_extractAdpcm || g_toMfi)) {
+            MFI_LOG(MFI_LOG_WARN, "-p can't be combined with -s, -w or -m, converting without it\n");
+        } else if (queueDepth) {
+            return runPipelinedBatch(jobs, numThreads, queueDepth);
+        }
+        return runBatch(jobs, numThreads);
+    }
+
+    if (g_extractAdpcm && mfiIsStdioPath(paths[1])) {
+        MFI_LOG(MFI_LOG_ERROR, "-w names the WAV files after the output, which can't be -\n");
+        return 1;
+    }
+
+    if (render) {
+        return renderFile(paths[0], paths[1], numThreads) ? 0 : 1;
+    }
 
-    mfiFileWriter wfile(argv[2]);
-    mfiMidiWriter midiWriter(&wfile);
-    midiWriter.writeHeader(&song);
-    uint8_t channelOffset = 0;
-    for (mfiTrack &track : song.m_tracks) {
-        midiWriter.writeTrack(&track, channelOffset);
-        channelOffset += 4;
+    if (threadsGiven && numThreads > 1 && !g_printStats && !g_cache && !g_toMfi) {
+        return convertFileParallel(paths[0], paths[1], numThreads) ? 0 : 1;
     }
 
-    return 0;
+    return convertFile(paths[0], paths[1]) ? 0 : 1;
 }
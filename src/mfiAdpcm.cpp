@@ -0,0 +1,65 @@
+#include "mfi/mfiAdpcm.h"
+
+#include <algorithm>
+
+// delta multiplier (in eighths of a step) and step scale (in 1/256) per nibble
+static const int32_t s_adpcmDiffs[16]  = { 1, 3, 5, 7, 9, 11, 13, 15, -1, -3, -5, -7, -9, -11, -13, -15 };
+static const int32_t s_adpcmScales[16] = { 230, 230, 230, 230, 307, 409, 512, 614, 230, 230, 230, 230, 307, 409, 512, 614 };
+
+void mfiAdpcmDecoder::decode(const uint8_t *data, size_t size, int16_t *pcm) {
+    // Nibbles are unpacked a block at a time in a loop the compiler can
+    // vectorize. Each sample depends on the previous one, so the second loop
+    // can't be; it is kept free of branches, the clamps become min/max.
+    constexpr size_t BLOCK_SIZE = 512;
+    uint8_t nibbles[2 * BLOCK_SIZE];
+
+    int32_t predictor = m_predictor;
+    int32_t step      = m_step;
+    while (size > 0) {
+        size_t blockSize = std::min(size, BLOCK_SIZE);
+        for (size_t i = 0; i < blockSize; i++) {
+            nibbles[2 * i]     = data[i] & 0x0F;
+            nibbles[2 * i + 1] = data[i] >> 4;
+        }
+
+        for (size_t i = 0; i < 2 * blockSize; i++) {
+            uint8_t nibble = nibbles[i];
+            predictor      = std::clamp(predictor + step * s_adpcmDiffs[nibble] / 8, -32768, 32767);
+            step           = std::clamp((step * s_adpcmScales[nibble]) >> 8, 127, 24576);
+            pcm[i]         = (int16_t)predictor;
+        }
+
+        data += blockSize;
+        pcm += 2 * blockSize;
+        size -= blockSize;
+    }
+    m_predictor = predictor;
+    m_step      = step;
+}
+
+void mfiWriteWav(mfiBufferWriter *wr, const int16_t *pcm, size_t numSamples, uint32_t sampleRate, uint16_t numChannels) {
+    uint32_t dataSize = (uint32_t)(numSamples * sizeof(int16_t));
+
+    wr->writeUint32(0x52494646); // RIFF
+    wr->writeUint32LE(36 + dataSize);
+    wr->writeUint32(0x57415645); // WAVE
+
+    wr->writeUint32(0x666D7420); // 'fmt '
+    wr->writeUint32LE(16);
+    wr->writeUint16LE(1); // PCM
+    wr->writeUint16LE(numChannels);
+    wr->writeUint32LE(sampleRate);
+    wr->writeUint32LE(sampleRate * numChannels * sizeof(int16_t));
+    wr->writeUint16LE(numChannels * sizeof(int16_t));
+    wr->writeUint16LE(16);
+
+    wr->writeUint32(0x64617461); // data
+    wr->writeUint32LE(dataSize);
+    if (MFI_LITTLE_ENDIAN) {
+        wr->write(pcm, dataSize);
+    } else {
+        for (size_t i = 0; i < numSamples; i++) {
+            wr->writeUint16LE((uint16_t)pcm[i]);
+        }
+    }
+}
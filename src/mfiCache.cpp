@@ -0,0 +1,251 @@
+#include "mfi/mfiCache.h"
+
+#include "mfi/mfiBytes.h"
+#include "mfi/mfiLog.h"
+
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <filesystem>
+#include <system_error>
+#include <thread>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+static constexpr uint64_t XXH_PRIME1 = 0x9E3779B185EBCA87ull;
+static constexpr uint64_t XXH_PRIME2 = 0xC2B2AE3D27D4EB4Full;
+static constexpr uint64_t XXH_PRIME3 = 0x165667B19E3779F9ull;
+static constexpr uint64_t XXH_PRIME4 = 0x85EBCA77C2B2AE63ull;
+static constexpr uint64_t XXH_PRIME5 = 0x27D4EB2F165667C5ull;
+
+static uint64_t rotl64(uint64_t value, int count) {
+    return value << count | value >> (64 - count);
+}
+
+static uint64_t loadLE64(const uint8_t *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    if (!MFI_LITTLE_ENDIAN) value = (uint64_t)mfiByteSwap32((uint32_t)value) << 32 | mfiByteSwap32((uint32_t)(value >> 32));
+    return value;
+}
+
+static uint32_t loadLE32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    if (!MFI_LITTLE_ENDIAN) value = mfiByteSwap32(value);
+    return value;
+}
+
+static uint64_t xxhRound(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME1;
+}
+
+static uint64_t xxhMergeRound(uint64_t acc, uint64_t value) {
+    acc ^= xxhRound(0, value);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+uint64_t mfiHash64(const void *data, size_t size, uint64_t seed) {
+    const uint8_t *p   = static_cast<const uint8_t *>(data);
+    const uint8_t *end = p + size;
+    uint64_t h;
+
+    if (size >= 32) {
+        uint64_t v1 = seed + XXH_PRIME1 + XXH_PRIME2;
+        uint64_t v2 = seed + XXH_PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME1;
+
+        // four independent lanes over each 32-byte stripe
+        const uint8_t *limit = end - 32;
+        do {
+            v1 = xxhRound(v1, loadLE64(p));
+            v2 = xxhRound(v2, loadLE64(p + 8));
+            v3 = xxhRound(v3, loadLE64(p + 16));
+            v4 = xxhRound(v4, loadLE64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxhMergeRound(h, v1);
+        h = xxhMergeRound(h, v2);
+        h = xxhMergeRound(h, v3);
+        h = xxhMergeRound(h, v4);
+    } else {
+        h = seed + XXH_PRIME5;
+    }
+
+    h += (uint64_t)size;
+
+    for (; end - p >= 8; p += 8) {
+        h ^= xxhRound(0, loadLE64(p));
+        h = rotl64(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (end - p >= 4) {
+        h ^= (uint64_t)loadLE32(p) * XXH_PRIME1;
+        h = rotl64(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_PRIME5;
+        h = rotl64(h, 11) * XXH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+mfiCacheKey mfiMakeCacheKey(const void *data, size_t size, uint64_t options) {
+    mfiCacheKey key;
+    key.contentHash = mfiHash64(data, size, 0);
+    key.inputSize   = size;
+    key.options     = options ^ MFI_CACHE_FORMAT_VERSION * XXH_PRIME1;
+    return key;
+}
+
+bool mfiMemoryCache::lookup(const mfiCacheKey &key, mfiBufferWriter *out) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto found = m_index.find(key);
+    if (found == m_index.end()) return false;
+
+    m_entries.splice(m_entries.begin(), m_entries, found->second);
+    const std::vector<uint8_t> &smf = found->second->smf;
+    out->write(smf.data(), smf.size());
+    return true;
+}
+
+void mfiMemoryCache::store(const mfiCacheKey &key, const uint8_t *smf, size_t size) {
+    if (size > m_maxBytes) return;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto found = m_index.find(key);
+    if (found != m_index.end()) {
+        // another thread converted the same file meanwhile
+        m_entries.splice(m_entries.begin(), m_entries, found->second);
+        return;
+    }
+
+    while (m_bytes + size > m_maxBytes) {
+        const Entry &oldest = m_entries.back();
+        m_bytes -= oldest.smf.size();
+        m_index.erase(oldest.key);
+        m_entries.pop_back();
+    }
+
+    m_entries.push_front(Entry{key, std::vector<uint8_t>(smf, smf + size)});
+    m_index.emplace(key, m_entries.begin());
+    m_bytes += size;
+}
+
+// An entry file starts with a header, all big-endian: 'MFiC', the key's
+// three fields, and the size and XXH64 of the SMF after it. Only an entry
+// whose header names the key that was asked for and the rest of the file is
+// served, so a truncated, corrupted or foreign file under an entry's name is
+// a miss.
+static constexpr uint32_t MFI_DISK_CACHE_MAGIC     = 0x4D466943; // 'MFiC'
+static constexpr size_t MFI_DISK_CACHE_HEADER_SIZE = 44;
+
+static void writeUint64(mfiBufferWriter *wr, uint64_t value) {
+    wr->writeUint32((uint32_t)(value >> 32));
+    wr->writeUint32((uint32_t)value);
+}
+
+static uint64_t loadBE64(const uint8_t *p) {
+    return (uint64_t)mfiLoadBE32(p) << 32 | mfiLoadBE32(p + 4);
+}
+
+static unsigned long currentProcessId() {
+#ifdef _WIN32
+    return (unsigned long)_getpid();
+#else
+    return (unsigned long)getpid();
+#endif
+}
+
+mfiDiskCache::mfiDiskCache(const char *directory)
+    : m_directory(directory) {
+    std::error_code ec;
+    std::filesystem::create_directories(m_directory, ec);
+    if (ec) {
+        MFI_LOG(MFI_LOG_WARN, "cannot create cache directory %s\n", directory);
+    }
+}
+
+std::string mfiDiskCache::entryPath(const mfiCacheKey &key) const {
+    char name[64];
+    snprintf(name, sizeof(name), "/%016" PRIx64 "%016" PRIx64 "-%" PRIu64 ".mid",
+             key.contentHash, key.options, key.inputSize);
+    return m_directory + name;
+}
+
+bool mfiDiskCache::lookup(const mfiCacheKey &key, mfiBufferWriter *out) {
+    std::string path = entryPath(key);
+    mfiMappedFile file(path.c_str());
+    if (!file.isOpen()) return false;
+
+    const uint8_t *header = file.data();
+    size_t smfSize        = file.size() - MFI_DISK_CACHE_HEADER_SIZE;
+    bool valid            = file.size() >= MFI_DISK_CACHE_HEADER_SIZE && mfiLoadBE32(header) == MFI_DISK_CACHE_MAGIC;
+    if (valid) valid = loadBE64(header + 4) == key.contentHash && loadBE64(header + 12) == key.inputSize && loadBE64(header + 20) == key.options;
+    if (valid) valid = loadBE64(header + 28) == smfSize;
+    if (!valid) {
+        MFI_LOG(MFI_LOG_WARN, "ignoring cache entry %s, which doesn't hold the entry it is named for\n", path.c_str());
+        return false;
+    }
+    if (mfiHash64(header + MFI_DISK_CACHE_HEADER_SIZE, smfSize, 0) != loadBE64(header + 36)) {
+        MFI_LOG(MFI_LOG_WARN, "ignoring cache entry %s, whose SMF doesn't match its checksum\n", path.c_str());
+        return false;
+    }
+
+    out->write(header + MFI_DISK_CACHE_HEADER_SIZE, smfSize);
+    return true;
+}
+
+void mfiDiskCache::store(const mfiCacheKey &key, const uint8_t *smf, size_t size) {
+    static std::atomic<uint32_t> s_tempCounter{0};
+
+    // unique among all threads of all processes sharing the directory
+    std::string path = entryPath(key);
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), ".%lu.%zx.%u.tmp",
+             currentProcessId(), std::hash<std::thread::id>()(std::this_thread::get_id()), s_tempCounter++);
+    std::string tempPath = path + suffix;
+
+    bool written = false;
+    {
+        mfiFileWriter wr(tempPath.c_str());
+        if (wr.isOpen()) {
+            wr.writeUint32(MFI_DISK_CACHE_MAGIC);
+            writeUint64(&wr, key.contentHash);
+            writeUint64(&wr, key.inputSize);
+            writeUint64(&wr, key.options);
+            writeUint64(&wr, size);
+            writeUint64(&wr, mfiHash64(smf, size, 0));
+            wr.writeDirect(smf, size);
+            written = wr.flush();
+        }
+    }
+    if (!written) {
+        MFI_LOG(MFI_LOG_WARN, "cannot write cache entry %s\n", tempPath.c_str());
+        remove(tempPath.c_str());
+        return;
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tempPath, path, ec);
+    if (ec) {
+        remove(tempPath.c_str());
+    }
+}
@@ -0,0 +1,101 @@
+#include "mfi/mfi.h"
+
+#include <chrono>
+
+// an mfiSong that notes when the parser is done with the file header
+class mfiTimedSong : public mfiSong {
+public:
+    std::chrono::steady_clock::time_point m_headerDone;
+
+    void consumeSongStart(const mfiSongInfo &info) override {
+        m_headerDone = std::chrono::steady_clock::now();
+        mfiSong::consumeSongStart(info);
+    }
+};
+
+static double secondsBetween(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+    return std::chrono::duration<double>(end - start).count();
+}
+
+// The streaming path interleaves parsing and encoding event by event, so
+// to time the stages separately the song is parsed in full first. The
+// output is the same either way.
+static bool convertWithStats(const void *data, size_t size, std::vector<uint8_t> *smf, mfiStats *stats) {
+    *stats = mfiStats{};
+
+    auto parseStart = std::chrono::steady_clock::now();
+    mfiBufferReader rd(data, size);
+    mfiMediaFile mff(&rd);
+    mfiTimedSong song;
+    song.m_headerDone = parseStart;
+    bool ok           = mff.readFile(&song);
+    auto parseEnd     = std::chrono::steady_clock::now();
+
+    stats->bytesRead       = rd.tell();
+    stats->headerParseTime = secondsBetween(parseStart, song.m_headerDone);
+    stats->trackParseTime  = secondsBetween(song.m_headerDone, parseEnd);
+    mfiCountSongEvents(song, stats);
+    if (!ok) return false;
+
+    mfiBufferWriter wr;
+    mfiMidiWriter midiWriter(&wr);
+    midiWriter.writeHeader(&song);
+    uint8_t channelOffset = 0;
+    for (const mfiTrack &track : song.m_tracks) {
+        midiWriter.writeTrack(&track, channelOffset);
+        channelOffset += 4;
+    }
+    wr.takeBuffer(smf);
+
+    stats->midiWriteTime         = secondsBetween(parseEnd, std::chrono::steady_clock::now());
+    stats->numUnknownTypeBEvents = midiWriter.numUnknownTypeBEvents();
+    stats->peakPendingNoteOffs   = (uint32_t)midiWriter.peakPendingNoteOffs();
+    return true;
+}
+
+bool mfiConvertToMidi(const void *data, size_t size, std::vector<uint8_t> *smf, mfiStats *stats) {
+    if (stats) {
+        return convertWithStats(data, size, smf, stats);
+    }
+
+    mfiBufferReader rd(data, size);
+    mfiBufferWriter wr;
+
+    mfiMediaFile mff(&rd);
+    mfiMidiStreamWriter midiWriter(&wr);
+    if (!mff.readFile(&midiWriter)) {
+        return false;
+    }
+
+    wr.takeBuffer(smf);
+    return true;
+}
+
+bool mfiConvertToMidiCached(const void *data, size_t size, std::vector<uint8_t> *smf, mfiConversionCache *cache) {
+    mfiCacheKey key = mfiMakeCacheKey(data, size, 0);
+    mfiBufferWriter wr;
+    if (cache->lookup(key, &wr)) {
+        wr.takeBuffer(smf);
+        return true;
+    }
+
+    if (!mfiConvertToMidi(data, size, smf)) return false;
+    cache->store(key, smf->data(), smf->size());
+    return true;
+}
+
+bool mfiConvertToMfi(const void *data, size_t size, std::vector<uint8_t> *mfi) {
+    mfiBufferReader rd(data, size);
+    mfiMidiReader reader(&rd);
+    mfiMfiEncoder encoder;
+    if (!reader.readFile(&encoder)) {
+        return false;
+    }
+
+    mfiBufferWriter wr;
+    if (!encoder.finish(&wr)) {
+        return false;
+    }
+    wr.takeBuffer(mfi);
+    return true;
+}
@@ -0,0 +1,46 @@
+#include "mfi/mfiConverter.h"
+
+#include "mfi/mfiLog.h"
+#include "mfi/mfiMediaFile.h"
+
+#include <cstdio>
+
+bool mfiConverter::convert(const void *data, size_t size) {
+    m_output.clear();
+    m_streamWriter.reset();
+
+    mfiCacheKey key;
+    if (m_cache) {
+        key = mfiMakeCacheKey(data, size, 0);
+        if (m_cache->lookup(key, &m_output)) return true;
+    }
+
+    mfiBufferReader rd(data, size);
+    mfiMediaFile mff(&rd);
+    if (!mff.readFile(&m_streamWriter)) return false;
+
+    if (m_cache) {
+        m_cache->store(key, m_output.data(), m_output.size());
+    }
+    return true;
+}
+
+bool mfiConverter::convertFile(const char *inputPath, const char *outputPath) {
+    mfiMappedFile file(inputPath);
+    if (!file.isOpen()) {
+        MFI_LOG(MFI_LOG_ERROR, "cannot open %s\n", inputPath);
+        return false;
+    }
+
+    if (!convert(file.data(), file.size())) {
+        MFI_LOG(MFI_LOG_ERROR, "failed to parse %s\n", inputPath);
+        return false;
+    }
+
+    if (!mfiWriteFile(outputPath, m_output.data(), m_output.size())) {
+        MFI_LOG(MFI_LOG_ERROR, "failed to write %s\n", outputPath);
+        if (!mfiIsStdioPath(outputPath)) remove(outputPath);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,130 @@
+#include "mfi/mfiIO.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+mfiMappedFile::mfiMappedFile(const char *filename)
+    : m_data(nullptr),
+      m_size(0),
+      m_open(false),
+      m_mapped(false) {
+    if (mfiIsStdioPath(filename)) {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        m_open = readStream(stdin);
+        return;
+    }
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return;
+
+    LARGE_INTEGER fileSize;
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping) {
+            m_data = static_cast<const uint8_t *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            CloseHandle(mapping); // the view keeps the mapping alive
+            if (m_data) {
+                m_size   = (size_t)fileSize.QuadPart;
+                m_mapped = true;
+            }
+        }
+    }
+    CloseHandle(file);
+    m_open = m_mapped || readWhole(filename);
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            m_data   = static_cast<const uint8_t *>(data);
+            m_size   = (size_t)st.st_size;
+            m_mapped = true;
+        }
+    }
+    close(fd);
+    m_open = m_mapped || readWhole(filename);
+#endif
+}
+
+mfiMappedFile::~mfiMappedFile() {
+    if (!m_mapped) return;
+#ifdef _WIN32
+    UnmapViewOfFile(m_data);
+#else
+    munmap(const_cast<uint8_t *>(m_data), m_size);
+#endif
+}
+
+bool mfiMappedFile::readWhole(const char *filename) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return false;
+
+    bool ok = readStream(fp);
+    fclose(fp);
+    return ok;
+}
+
+bool mfiMappedFile::readStream(FILE *fp) {
+    uint8_t chunk[65536];
+    size_t count;
+    while ((count = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        m_buffer.insert(m_buffer.end(), chunk, chunk + count);
+    }
+
+    m_data = m_buffer.data();
+    m_size = m_buffer.size();
+    return !ferror(fp);
+}
+
+bool mfiWriteFile(const char *filename, const void *data, size_t size) {
+    bool toStdout = mfiIsStdioPath(filename);
+#ifdef _WIN32
+    HANDLE file = toStdout ? GetStdHandle(STD_OUTPUT_HANDLE) : CreateFileA(filename, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE || file == nullptr) return false;
+
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    bool ok          = true;
+    while (ok && size > 0) {
+        DWORD count = 0;
+        ok          = WriteFile(file, p, (DWORD)std::min<size_t>(size, 1u << 30), &count, nullptr) && count > 0;
+        p += count;
+        size -= count;
+    }
+    if (toStdout) return ok;
+    return CloseHandle(file) && ok;
+#else
+    int fd = toStdout ? STDOUT_FILENO : open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) return false;
+
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    bool ok          = true;
+    while (ok && size > 0) {
+        ssize_t count = write(fd, p, size);
+        if (count < 0 && errno == EINTR) continue;
+        ok = count > 0;
+        if (ok) {
+            p += count;
+            size -= (size_t)count;
+        }
+    }
+    if (toStdout) return ok;
+    return close(fd) == 0 && ok;
+#endif
+}
@@ -0,0 +1,13 @@
+#include "mfi/mfiLog.h"
+
+#include <cstdarg>
+#include <cstdio>
+
+int g_mfiLogLevel = MFI_LOG_WARN;
+
+void mfiLogPrint(int level, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(level <= MFI_LOG_WARN ? stderr : stdout, format, args);
+    va_end(args);
+}
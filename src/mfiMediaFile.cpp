@@ -0,0 +1,388 @@
+#include "mfi/mfiMediaFile.h"
+
+#include "mfi/mfiLog.h"
+#include "mfi/mfiMidiWriter.h"
+#include "mfi/mfiStats.h"
+
+#include <cstdio>
+#include <string>
+
+bool mfiMediaFile::readFile(mfiEventSink *sink) {
+    return readFileAs(sink);
+}
+
+bool mfiMediaFile::readFile(mfiSong *song) {
+    return readFileAs(song);
+}
+
+bool mfiMediaFile::readFile(mfiMidiStreamWriter *writer) {
+    return readFileAs(writer);
+}
+
+bool mfiMediaFile::readFile(mfiEventCounter *counter) {
+    return readFileAs(counter);
+}
+
+template <typename Sink>
+bool mfiMediaFile::readFileAs(Sink *sink) {
+    mfiSongInfo info{};
+    size_t fileStart;
+    uint32_t fileLength;
+    m_error = MFI_PARSE_OK;
+    if (!readHeader(&info, &fileStart, &fileLength, nullptr)) return false;
+
+    info.numTracks = scanTracks(fileStart, fileLength, nullptr);
+    sink->consumeSongStart(info);
+
+    while (!m_rd->overrun() && m_rd->tell() - fileStart < fileLength) {
+        if (!readTrack(sink)) return false;
+    }
+
+    if (m_rd->overrun()) {
+        MFI_LOG(MFI_LOG_ERROR, "unexpected end of file\n");
+        return fail(MFI_PARSE_TRUNCATED);
+    }
+    return true;
+}
+
+bool mfiMediaFile::readIndex(mfiFileIndex *index) {
+    m_error     = MFI_PARSE_OK;
+    index->info = mfiSongInfo{};
+    index->adpcmChunks.clear();
+    index->tracks.clear();
+
+    size_t fileStart;
+    uint32_t fileLength;
+    if (!readHeader(&index->info, &fileStart, &fileLength, &index->adpcmChunks)) return false;
+
+    index->info.numTracks = scanTracks(fileStart, fileLength, &index->tracks);
+    return true;
+}
+
+bool mfiMediaFile::readTrack(const mfiFileIndex &index, size_t track, mfiEventSink *sink) {
+    m_error    = MFI_PARSE_OK;
+    m_noteType = index.info.noteType;
+    m_rd->seek(index.tracks[track].offset - 8);
+    return readTrack(sink);
+}
+
+bool mfiMediaFile::scanTrack(const mfiFileIndex &index, size_t track, mfiTrackLayout *layout) {
+    m_error = MFI_PARSE_OK;
+
+    const mfiTrackChunk &chunk = index.tracks[track];
+    m_rd->seek(chunk.offset);
+    const uint8_t *chunkData = m_rd->readView(chunk.size);
+    if (!chunkData) {
+        MFI_LOG(MFI_LOG_ERROR, "track chunk at %08llx runs past the end of the file\n", (unsigned long long)chunk.offset);
+        return fail(MFI_PARSE_TRUNCATED);
+    }
+
+    mfiParseError error = mfiScanTrackEvents(chunkData, chunk.size, index.info.noteType, layout);
+    if (error != MFI_PARSE_OK) {
+        MFI_LOG(MFI_LOG_ERROR, "track chunk at %08llx has a malformed event\n", (unsigned long long)chunk.offset);
+        return fail(error);
+    }
+    return true;
+}
+
+bool mfiMediaFile::readFileHeader(mfiFileHeader *header) {
+    m_error = MFI_PARSE_OK;
+    *header = mfiFileHeader{};
+
+    size_t fileStart;
+    if (!readHeaderChunks(&header->info, &fileStart, &header->fileLength, header)) return false;
+
+    if (m_rd->overrun()) {
+        MFI_LOG(MFI_LOG_ERROR, "unexpected end of file\n");
+        return fail(MFI_PARSE_TRUNCATED);
+    }
+
+    for (const mfiHeaderChunk &chunk : header->chunks) {
+        switch (chunk.fourCC) {
+        case 0x7469746C: header->title = chunk.data; break;      // 'titl'
+        case 0x636F7079: header->copyright = chunk.data; break;  // 'copy'
+        case 0x76657273: header->version = chunk.data; break;    // 'vers'
+        case 0x64617465: header->date = chunk.data; break;       // 'date'
+        case 0x736F7263: header->source = chunk.data; break;     // 'sorc'
+        case 0x70726F74: header->protection = chunk.data; break; // 'prot'
+        }
+    }
+    return true;
+}
+
+bool mfiMediaFile::readHeader(mfiSongInfo *info, size_t *fileStart, uint32_t *fileLength, std::vector<mfiAdpcmChunk> *adpcmChunks) {
+    if (!readHeaderChunks(info, fileStart, fileLength, nullptr)) return false;
+
+    for (size_t i = 0; i < info->numAdpcmChunks && !m_rd->overrun(); i++) {
+        uint32_t chunkFourCC = m_rd->readUint32();
+        uint32_t chunkSize   = m_rd->readUint32();
+
+        MFI_LOG(MFI_LOG_INFO, "AdpcmChunk with FOURCC `%c%c%c%c`\n",
+            (chunkFourCC >> 24) & 0xFF,
+            (chunkFourCC >> 16) & 0xFF,
+            (chunkFourCC >> 8) & 0xFF,
+            (chunkFourCC >> 0) & 0xFF);
+
+        if (adpcmChunks) adpcmChunks->push_back({ chunkFourCC, m_rd->tell(), chunkSize });
+        m_rd->skip(chunkSize);
+    }
+
+    MFI_LOG(MFI_LOG_INFO, "num track chunks: %d\n", info->numTrackChunks);
+
+    if (m_rd->overrun()) {
+        MFI_LOG(MFI_LOG_ERROR, "unexpected end of file\n");
+        return fail(MFI_PARSE_TRUNCATED);
+    }
+    return true;
+}
+
+bool mfiMediaFile::readHeaderChunks(mfiSongInfo *info, size_t *fileStart, uint32_t *fileLength, mfiFileHeader *header) {
+    uint32_t magic = m_rd->readUint32();
+    if (magic != 0x6D656C6F) { // 'melo'
+        MFI_LOG(MFI_LOG_ERROR, "melo header missing\n");
+        return fail(MFI_PARSE_BAD_MAGIC);
+    }
+
+    *fileLength = m_rd->readUint32();
+    *fileStart  = m_rd->tell();
+
+    uint16_t headerLength = m_rd->readUint16();
+    size_t headerStart    = m_rd->tell();
+
+    uint8_t contentType = m_rd->readUint8();
+    if (contentType == MFI_CT_MELODY) {
+        uint8_t melodyType = m_rd->readUint8();
+        if (header) header->subType = melodyType;
+    } else if (contentType == MFI_CT_SONG) {
+        uint8_t songType = m_rd->readUint8();
+        if (header) header->subType = songType;
+    }
+    if (header) header->contentType = contentType;
+
+    uint8_t numTrackChunks  = m_rd->readUint8();
+    uint16_t numAdpcmChunks = 0;
+
+    while (!m_rd->overrun() && m_rd->tell() - headerStart < headerLength) {
+        uint32_t chunkFourCC = m_rd->readUint32();
+        uint32_t chunkSize   = m_rd->readUint16();
+        size_t chunkStart    = m_rd->tell();
+
+        MFI_LOG(MFI_LOG_INFO, "SubChunk with FOURCC `%c%c%c%c`\n",
+            (chunkFourCC >> 24) & 0xFF,
+            (chunkFourCC >> 16) & 0xFF,
+            (chunkFourCC >> 8) & 0xFF,
+            (chunkFourCC >> 0) & 0xFF);
+
+        if (header) {
+            const uint8_t *data = m_rd->readView(chunkSize);
+            if (!data) break;
+            header->chunks.push_back({ chunkFourCC, std::string(reinterpret_cast<const char *>(data), chunkSize) });
+            m_rd->seek(chunkStart);
+        }
+
+        if (chunkFourCC == 0x6E6F7465) { // 'note'
+            if (chunkSize != 2) {
+                MFI_LOG(MFI_LOG_ERROR, "wrong note subchunk size\n");
+                return fail(MFI_PARSE_BAD_HEADER);
+            }
+            m_noteType = static_cast<mfiNoteType>(m_rd->readUint16());
+        } else if (chunkFourCC == 0x61696E66) { // 'ainf'
+            if (chunkSize != 2) {
+                MFI_LOG(MFI_LOG_ERROR, "wrong ADPCM info chunk size\n");
+                return fail(MFI_PARSE_BAD_HEADER);
+            }
+            numAdpcmChunks = m_rd->readUint16LE();
+        } else {
+            m_rd->skip(chunkSize);
+        }
+    }
+
+    info->noteType       = m_noteType;
+    info->numTrackChunks = numTrackChunks;
+    info->numAdpcmChunks = numAdpcmChunks;
+    return true;
+}
+
+uint16_t mfiMediaFile::scanTracks(size_t fileStart, uint32_t fileLength, std::vector<mfiTrackChunk> *tracks) {
+    size_t tracksStart = m_rd->tell();
+
+    uint16_t numTracks = 0;
+    while (!m_rd->overrun() && m_rd->tell() - fileStart < fileLength) {
+        uint32_t chunkFourCC = m_rd->readUint32();
+        uint32_t chunkSize   = m_rd->readUint32();
+        if (m_rd->overrun() || chunkFourCC != 0x74726163) break; // 'trac'
+
+        numTracks++;
+        if (tracks) tracks->push_back({ m_rd->tell(), chunkSize });
+        m_rd->skip(chunkSize);
+    }
+
+    m_rd->seek(tracksStart);
+    return numTracks;
+}
+
+template <typename Sink>
+bool mfiMediaFile::readTrack(Sink *sink) {
+    uint32_t chunkFourCC = m_rd->readUint32();
+    uint32_t chunkSize   = m_rd->readUint32();
+    if (m_rd->overrun()) {
+        MFI_LOG(MFI_LOG_ERROR, "unexpected end of file\n");
+        return fail(MFI_PARSE_TRUNCATED);
+    }
+
+    if (chunkFourCC != 0x74726163) {
+        MFI_LOG(MFI_LOG_ERROR,
+            "invalid FOURCC `%c%c%c%c`\n",
+            (chunkFourCC >> 24) & 0xFF,
+            (chunkFourCC >> 16) & 0xFF,
+            (chunkFourCC >> 8) & 0xFF,
+            (chunkFourCC >> 0) & 0xFF);
+        return fail(MFI_PARSE_BAD_CHUNK);
+    }
+
+    size_t chunkOffset       = m_rd->tell();
+    const uint8_t *chunkData = m_rd->readView(chunkSize);
+    if (!chunkData) {
+        MFI_LOG(MFI_LOG_ERROR, "track chunk at %08llx runs past the end of the file\n", (unsigned long long)chunkOffset);
+        return fail(MFI_PARSE_TRUNCATED);
+    }
+
+    // The events are decoded from the chunk alone, so a track can't read
+    // into whatever follows it, and each pass of the loop either consumes
+    // bytes or fails. Bytes after the end-of-track event are skipped.
+    mfiBufferReader rd(chunkData, chunkSize);
+    sink->consumeTrackStart(chunkSize);
+    if (m_noteType == MFI_NOTE_TYPE_LONG) {
+        return readTrackEvents<MFI_NOTE_TYPE_LONG>(&rd, chunkOffset, sink);
+    }
+    return readTrackEvents<MFI_NOTE_TYPE_SHORT>(&rd, chunkOffset, sink);
+}
+
+template <mfiNoteType NoteType, typename Sink>
+bool mfiMediaFile::readTrackEvents(mfiBufferReader *rd, size_t chunkOffset, Sink *sink) {
+    uint32_t absoluteTicks = 0;
+
+    while (true) {
+        if (rd->remaining() == 0) {
+            MFI_LOG(MFI_LOG_ERROR, "track chunk at %08llx has no end-of-track event\n", (unsigned long long)chunkOffset);
+            return fail(MFI_PARSE_NO_END_OF_TRACK);
+        }
+
+        uint8_t deltaTime     = rd->readUint8();
+        uint8_t noteStatus    = rd->readUint8();
+        uint8_t channelNumber = (noteStatus & 0xC0) >> 6;
+        uint8_t keyNumber     = noteStatus & 0x3F;
+        if (keyNumber == 0x3F) {
+            uint8_t firstByte = rd->readUint8();
+            if ((firstByte & 0xF0) == 0xF0) {
+                uint16_t size = rd->readUint16();
+
+                const uint8_t *data = rd->readView(size);
+                if (!data || rd->overrun()) return failTruncatedEvent(chunkOffset);
+
+                mfiEvent ev{};
+                ev.eventType        = MFI_EVENT_TYPE_SYSEX;
+                ev.deltaTime        = deltaTime;
+                ev.sysex.eventClass = channelNumber;
+                ev.sysex.eventId    = firstByte;
+                ev.sysex.size       = size;
+                ev.sysex.data       = data;
+
+                emitEvent(sink, ev, &absoluteTicks);
+            } else if ((firstByte & 0x80) == 0x80) {
+                uint8_t data = rd->readUint8();
+                if (rd->overrun()) return failTruncatedEvent(chunkOffset);
+
+                mfiEvent ev{};
+                ev.eventType        = MFI_EVENT_TYPE_B;
+                ev.deltaTime        = deltaTime;
+                ev.typeB.eventClass = channelNumber;
+                ev.typeB.eventId    = firstByte;
+                ev.typeB.data       = data;
+
+                emitEvent(sink, ev, &absoluteTicks);
+
+                if (channelNumber == 3 && firstByte == 0xDF) {
+                    sink->consumeTrackEnd();
+                    return true; // end of stream
+                }
+            } else {
+                MFI_LOG(MFI_LOG_ERROR, "unsupported midi event at %08llx, ch %02x: %02x\n",
+                    (unsigned long long)(chunkOffset + rd->tell()),
+                    channelNumber,
+                    firstByte);
+                return fail(MFI_PARSE_BAD_EVENT);
+            }
+        } else {
+            uint8_t gateTime    = rd->readUint8();
+            uint8_t velocity    = 63;
+            uint8_t octaveShift = 0;
+            if (NoteType == MFI_NOTE_TYPE_LONG) {
+                uint8_t vos = rd->readUint8();
+                octaveShift = vos & 0x3;
+                velocity    = (vos & 0xFC) >> 2;
+            }
+            if (rd->overrun()) return failTruncatedEvent(chunkOffset);
+
+            mfiEvent ev{};
+            ev.eventType        = MFI_EVENT_TYPE_NOTE;
+            ev.deltaTime        = deltaTime;
+            ev.note.channel     = channelNumber;
+            ev.note.key         = keyNumber;
+            ev.note.gateTime    = gateTime;
+            ev.note.velocity    = velocity;
+            ev.note.octaveShift = octaveShift;
+
+            emitEvent(sink, ev, &absoluteTicks);
+        }
+    }
+}
+
+bool mfiMediaFile::failTruncatedEvent(size_t chunkOffset) {
+    MFI_LOG(MFI_LOG_ERROR, "last event of the track chunk at %08llx is cut off\n", (unsigned long long)chunkOffset);
+    return fail(MFI_PARSE_TRUNCATED);
+}
+
+template <typename Sink>
+void mfiMediaFile::emitEvent(Sink *sink, const mfiEvent &ev, uint32_t *absoluteTicks) {
+    *absoluteTicks += ev.deltaTime;
+
+    if (ev.eventType == MFI_EVENT_TYPE_NOTE) {
+        MFI_LOG(MFI_LOG_TRACE, "%-10u: note %02x\n", *absoluteTicks, ev.note.key);
+    } else if (ev.eventType == MFI_EVENT_TYPE_B) {
+        MFI_LOG(MFI_LOG_TRACE, "%-10u: type B message (class %x) %02x: %02x\n",
+            *absoluteTicks,
+            ev.typeB.eventClass,
+            ev.typeB.eventId,
+            ev.typeB.data);
+    } else if (ev.eventType == MFI_EVENT_TYPE_SYSEX) {
+        MFI_LOG(MFI_LOG_TRACE, "%-10u: sysex message (class %x) %02x: size %08x\n",
+            *absoluteTicks,
+            ev.sysex.eventClass,
+            ev.sysex.eventId,
+            ev.sysex.size);
+    }
+
+    sink->consumeEvent(ev);
+}
+
+bool mfiReadFileHeader(const char *filename, mfiFileHeader *header) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        MFI_LOG(MFI_LOG_ERROR, "cannot open %s\n", filename);
+        return false;
+    }
+    setvbuf(fp, nullptr, _IONBF, 0); // only read what is asked for
+
+    // 'melo', file length, header length
+    std::vector<uint8_t> buffer(10);
+    size_t size = fread(buffer.data(), 1, 10, fp);
+    if (size == 10) {
+        buffer.resize(10 + mfiLoadBE16(buffer.data() + 8));
+        size += fread(buffer.data() + 10, 1, buffer.size() - 10, fp);
+    }
+    fclose(fp);
+
+    mfiBufferReader rd(buffer.data(), size);
+    return mfiMediaFile(&rd).readFileHeader(header);
+}
@@ -0,0 +1,128 @@
+#include "mfi/mfiMediaFileWriter.h"
+
+#include "mfi/mfiLog.h"
+
+#include <cinttypes>
+
+bool mfiMediaFileWriter::writeFile(const mfiFileHeader &header, const std::vector<mfiChunkData> &adpcmChunks, const std::vector<mfiChunkData> &tracks) {
+    bool hasSubType = header.contentType == MFI_CT_MELODY || header.contentType == MFI_CT_SONG;
+
+    if (tracks.size() > UINT8_MAX) {
+        MFI_LOG(MFI_LOG_ERROR, "%zu tracks don't fit the 8-bit track count\n", tracks.size());
+        return false;
+    }
+    if (adpcmChunks.size() > UINT16_MAX) {
+        MFI_LOG(MFI_LOG_ERROR, "%zu ADPCM chunks don't fit the 16-bit ADPCM count\n", adpcmChunks.size());
+        return false;
+    }
+
+    // everything is sized up front, so the file length needs no patching
+    // and the chunk payloads can be written directly; a size too large for
+    // its field fails the file before a byte of it is written
+    uint64_t headerLength = 2 + hasSubType;
+    bool hasNote          = false;
+    bool hasAdpcmInfo     = false;
+    for (const mfiHeaderChunk &chunk : header.chunks) {
+        if (chunk.fourCC == 0x6E6F7465) { // 'note'
+            hasNote = true;
+            headerLength += 6 + 2;
+        } else if (chunk.fourCC == 0x61696E66) { // 'ainf'
+            hasAdpcmInfo = true;
+            headerLength += 6 + 2;
+        } else if (chunk.data.size() > UINT16_MAX) {
+            MFI_LOG(MFI_LOG_ERROR, "header sub-chunk of %zu bytes doesn't fit its 16-bit size\n", chunk.data.size());
+            return false;
+        } else {
+            headerLength += 6 + chunk.data.size();
+        }
+    }
+    // without them a reader takes short notes and no ADPCM, so they are
+    // only added when the file needs them
+    bool addNote      = !hasNote && header.info.noteType != MFI_NOTE_TYPE_SHORT;
+    bool addAdpcmInfo = !hasAdpcmInfo && !adpcmChunks.empty();
+    headerLength += (addNote + addAdpcmInfo) * (6 + 2);
+    if (headerLength > UINT16_MAX) {
+        MFI_LOG(MFI_LOG_ERROR, "header of %" PRIu64 " bytes doesn't fit its 16-bit length\n", headerLength);
+        return false;
+    }
+    uint64_t fileLength = 2 + headerLength;
+    for (const mfiChunkData &chunk : adpcmChunks) {
+        fileLength += 8 + (uint64_t)chunk.size;
+    }
+    for (const mfiChunkData &chunk : tracks) {
+        fileLength += 8 + (uint64_t)chunk.size;
+    }
+    if (fileLength > UINT32_MAX) {
+        MFI_LOG(MFI_LOG_ERROR, "file of %" PRIu64 " bytes doesn't fit its 32-bit length\n", fileLength);
+        return false;
+    }
+
+    m_wr->writeUint32(0x6D656C6F); // 'melo'
+    m_wr->writeUint32((uint32_t)fileLength);
+    m_wr->writeUint16((uint16_t)headerLength);
+    m_wr->writeUint8(header.contentType);
+    if (hasSubType) m_wr->writeUint8(header.subType);
+    m_wr->writeUint8((uint8_t)tracks.size());
+
+    for (const mfiHeaderChunk &chunk : header.chunks) {
+        m_wr->writeUint32(chunk.fourCC);
+        if (chunk.fourCC == 0x6E6F7465) { // 'note'
+            m_wr->writeUint16(2);
+            m_wr->writeUint16(header.info.noteType);
+        } else if (chunk.fourCC == 0x61696E66) { // 'ainf'
+            m_wr->writeUint16(2);
+            m_wr->writeUint16LE((uint16_t)adpcmChunks.size());
+        } else {
+            m_wr->writeUint16((uint16_t)chunk.data.size());
+            m_wr->write(chunk.data.data(), chunk.data.size());
+        }
+    }
+    if (addNote) {
+        m_wr->writeUint32(0x6E6F7465); // 'note'
+        m_wr->writeUint16(2);
+        m_wr->writeUint16(header.info.noteType);
+    }
+    if (addAdpcmInfo) {
+        m_wr->writeUint32(0x61696E66); // 'ainf'
+        m_wr->writeUint16(2);
+        m_wr->writeUint16LE((uint16_t)adpcmChunks.size());
+    }
+
+    for (const mfiChunkData &chunk : adpcmChunks) {
+        m_wr->writeUint32(chunk.fourCC);
+        m_wr->writeUint32(chunk.size);
+        m_wr->writeDirect(chunk.data, chunk.size);
+    }
+    for (const mfiChunkData &chunk : tracks) {
+        m_wr->writeUint32(chunk.fourCC);
+        m_wr->writeUint32(chunk.size);
+        m_wr->writeDirect(chunk.data, chunk.size);
+    }
+    return true;
+}
+
+void mfiMediaFileWriter::encodeTrack(const mfiTrack &track, mfiNoteType noteType, mfiBufferWriter *out) {
+    for (const mfiEvent &ev : track) {
+        out->writeUint8(ev.deltaTime);
+        switch (ev.eventType) {
+        case MFI_EVENT_TYPE_NOTE:
+            out->writeUint8(ev.note.channel << 6 | ev.note.key);
+            out->writeUint8(ev.note.gateTime);
+            if (noteType == MFI_NOTE_TYPE_LONG) {
+                out->writeUint8(ev.note.velocity << 2 | ev.note.octaveShift);
+            }
+            break;
+        case MFI_EVENT_TYPE_B:
+            out->writeUint8(ev.typeB.eventClass << 6 | 0x3F);
+            out->writeUint8(ev.typeB.eventId);
+            out->writeUint8(ev.typeB.data);
+            break;
+        case MFI_EVENT_TYPE_SYSEX:
+            out->writeUint8(ev.sysex.eventClass << 6 | 0x3F);
+            out->writeUint8(ev.sysex.eventId);
+            out->writeUint16(ev.sysex.size);
+            out->write(ev.sysex.data, ev.sysex.size);
+            break;
+        }
+    }
+}
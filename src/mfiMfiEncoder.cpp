@@ -0,0 +1,327 @@
+#include "mfi/mfiMfiEncoder.h"
+
+#include "mfi/mfiLog.h"
+#include "mfi/mfiMediaFileWriter.h"
+#include "mfi/mfiMidiWriter.h"
+
+#include <algorithm>
+#include <cstring>
+
+// pads delta times past 255 ticks; mfiMidiWriter skips it
+static constexpr uint32_t NOP_EVENT = 0xFFFFDE00; // delta 255, class 3, 0xDE, no data
+
+// the most of a track name or copyright that is kept, so that both of them
+// fit the 16-bit header length alongside the fields, `vers` and `note`
+static constexpr size_t MAX_TEXT_SIZE = (UINT16_MAX - 3 - (6 + 4) - (6 + 2) - 2 * 6) / 2;
+
+static void assignText(std::string *text, const mfiMidiEvent &ev, const char *what) {
+    size_t size = ev.size;
+    if (size > MAX_TEXT_SIZE) {
+        MFI_LOG(MFI_LOG_WARN, "%s of %zu bytes cut to %zu\n", what, size, MAX_TEXT_SIZE);
+        size = MAX_TEXT_SIZE;
+    }
+    text->assign(reinterpret_cast<const char *>(ev.data), size);
+}
+
+void mfiMfiEncoder::reset() {
+    for (size_t i = 0; i < NUM_TRACKS; i++) {
+        m_events[i].clear();
+        m_unsorted[i] = false;
+        m_endTicks[i] = 0;
+    }
+    std::fill(std::begin(m_banks), std::end(m_banks), 0);
+    std::fill(std::begin(m_midiBanks), std::end(m_midiBanks), 0);
+    m_pendingNotes.clear();
+    m_division      = 48;
+    m_timebase      = 48;
+    m_timebaseCode  = timebaseCode(48);
+    m_midiTrack     = 0;
+    m_touchedTracks = 0;
+    m_usedTracks    = 0;
+    m_title.clear();
+    m_copyright.clear();
+    m_numDroppedEvents   = 0;
+    m_numSplitNotes      = 0;
+    m_numTransposedNotes = 0;
+}
+
+uint8_t mfiMfiEncoder::timebaseCode(uint16_t division) {
+    uint8_t best = 0;
+    for (uint8_t code = 1; code < 16; code++) {
+        int distance     = abs((int)mfiMidiWriter::convertTimebase(code) - division);
+        int bestDistance = abs((int)mfiMidiWriter::convertTimebase(best) - division);
+        if (distance < bestDistance) best = code;
+    }
+    return best;
+}
+
+void mfiMfiEncoder::consumeMidiHeader([[maybe_unused]] uint16_t format, [[maybe_unused]] uint16_t numTracks, uint16_t division) {
+    m_division     = division;
+    m_timebaseCode = timebaseCode(division);
+    m_timebase     = mfiMidiWriter::convertTimebase(m_timebaseCode);
+}
+
+void mfiMfiEncoder::consumeMidiTrackStart(uint16_t track) {
+    m_midiTrack     = track;
+    m_touchedTracks = 0;
+}
+
+void mfiMfiEncoder::consumeMidiEvent(const mfiMidiEvent &ev) {
+    uint32_t tick = scaleTick(ev.tick);
+
+    if (ev.eventType == MFI_MIDI_EVENT_CHANNEL) {
+        uint8_t channel = ev.status & 0x0F;
+        uint8_t track   = channel >> 2;
+        uint8_t bits    = (channel & 3) << 6;
+        switch (ev.status & 0xF0) {
+        case 0x80:
+            noteOff(channel, ev.data1, tick);
+            return;
+        case 0x90:
+            if (ev.data2) {
+                noteOn(channel, ev.data1, ev.data2, tick);
+            } else {
+                noteOff(channel, ev.data1, tick);
+            }
+            return;
+        case 0xB0:
+            if (ev.data1 == 0) {
+                m_midiBanks[channel] = ev.data2 & 0x3F; // goes out with the next program change
+            } else if (ev.data1 == 7) {
+                addTypeB(track, tick, 0xE2, bits | ev.data2 >> 1);
+            } else if (ev.data1 == 10) {
+                addTypeB(track, tick, 0xE3, bits | ev.data2 >> 1);
+            } else if (ev.data1 == 1) {
+                addTypeB(track, tick, 0xEA, bits | ev.data2 >> 1);
+            } else {
+                m_numDroppedEvents++;
+            }
+            return;
+        case 0xC0:
+            programChange(channel, ev.data1, tick);
+            return;
+        case 0xE0: {
+            // mfiMidiWriter sends data << 8, so round to the nearest step of 256
+            uint32_t value = (uint32_t)ev.data2 << 7 | ev.data1;
+            addTypeB(track, tick, 0xE4, bits | std::min<uint32_t>((value + 128) >> 8, 0x3F));
+            return;
+        }
+        default:
+            m_numDroppedEvents++;
+            return;
+        }
+    }
+
+    if (ev.eventType == MFI_MIDI_EVENT_META) {
+        if (ev.status == 0x51 && ev.size == 3) {
+            uint32_t usPerQuarter = (uint32_t)ev.data[0] << 16 | ev.data[1] << 8 | ev.data[2];
+            if (usPerQuarter) {
+                uint32_t bpm = (60'000'000 + usPerQuarter / 2) / usPerQuarter;
+                addTypeB(globalTrack(), tick, 0xC0 | m_timebaseCode, (uint8_t)std::clamp<uint32_t>(bpm, 1, 255));
+                return;
+            }
+        } else if (ev.status == 0x03 && m_midiTrack == 0 && m_title.empty()) {
+            assignText(&m_title, ev, "track name");
+            return;
+        } else if (ev.status == 0x02 && m_copyright.empty()) {
+            assignText(&m_copyright, ev, "copyright");
+            return;
+        }
+        m_numDroppedEvents++;
+        return;
+    }
+
+    // GM master volume, as mfiMidiWriter writes it
+    static const uint8_t masterVolume[5] = { 0x7F, 0x7F, 0x04, 0x01, 0x00 };
+    if (ev.status == 0xF0 && ev.size == 7 && memcmp(ev.data, masterVolume, 5) == 0 && ev.data[6] == 0xF7) {
+        addTypeB(globalTrack(), tick, 0xB0, ev.data[5]);
+        return;
+    }
+    m_numDroppedEvents++;
+}
+
+void mfiMfiEncoder::consumeMidiTrackEnd(uint32_t tick) {
+    tick = scaleTick(tick);
+
+    // notes the track never released end with it
+    size_t numKept = 0;
+    for (size_t i = 0; i < m_pendingNotes.size(); i++) {
+        const PendingNote &note = m_pendingNotes[i];
+        if (note.midiTrack == m_midiTrack) {
+            setGateTime(note, std::max(tick, note.tick));
+        } else {
+            m_pendingNotes[numKept++] = note;
+        }
+    }
+    m_pendingNotes.resize(numKept);
+
+    // an empty track still has an end, so the first tracks come back even without events
+    if (m_midiTrack < NUM_TRACKS) m_touchedTracks |= 1 << m_midiTrack;
+    for (size_t i = 0; i < NUM_TRACKS; i++) {
+        if (m_touchedTracks & 1 << i) m_endTicks[i] = std::max(m_endTicks[i], tick);
+    }
+    m_usedTracks |= m_touchedTracks;
+}
+
+void mfiMfiEncoder::addEvent(uint8_t track, uint32_t tick, uint8_t b0, uint8_t b1, uint8_t b2) {
+    std::vector<TimedEvent> &events = m_events[track];
+    if (!events.empty() && tick < events.back().tick) m_unsorted[track] = true;
+    events.push_back({ tick, { b0, b1, b2 } });
+    m_endTicks[track] = std::max(m_endTicks[track], tick);
+    m_touchedTracks |= 1 << track;
+}
+
+void mfiMfiEncoder::noteOn(uint8_t channel, uint8_t key, uint8_t velocity, uint32_t tick) {
+    // keys 45-107 need no shift; the octave shifts reach from 21 up to 119
+    int mfiKey          = key - 45;
+    uint8_t octaveShift = 0;
+    if (mfiKey > 62) {
+        mfiKey -= 12;
+        octaveShift = 1;
+    } else if (mfiKey < -12) {
+        mfiKey += 24;
+        octaveShift = 2;
+    } else if (mfiKey < 0) {
+        mfiKey += 12;
+        octaveShift = 3;
+    }
+    if (mfiKey < 0 || mfiKey > 62) {
+        while (mfiKey < 0) mfiKey += 12;
+        while (mfiKey > 62) mfiKey -= 12;
+        m_numTransposedNotes++;
+    }
+
+    uint8_t track = channel >> 2;
+    uint8_t vos   = std::max(1, velocity >> 1) << 2 | octaveShift;
+    m_pendingNotes.push_back({ channel, key, m_midiTrack, track, tick, m_events[track].size() });
+    addEvent(track, tick, (channel & 3) << 6 | mfiKey, 0, vos);
+}
+
+void mfiMfiEncoder::noteOff(uint8_t channel, uint8_t key, uint32_t tick) {
+    // the oldest of overlapping notes on the same key goes first
+    for (size_t i = 0; i < m_pendingNotes.size(); i++) {
+        const PendingNote &note = m_pendingNotes[i];
+        if (note.midiChannel == channel && note.midiKey == key) {
+            setGateTime(note, tick);
+            m_pendingNotes.erase(m_pendingNotes.begin() + i);
+            return;
+        }
+    }
+}
+
+void mfiMfiEncoder::setGateTime(const PendingNote &note, uint32_t tick) {
+    uint32_t gateTime = tick - note.tick;
+
+    TimedEvent &ev = m_events[note.track][note.index];
+    ev.bytes[1]    = (uint8_t)std::min<uint32_t>(gateTime, 255);
+    uint8_t status = ev.bytes[0];
+    uint8_t vos    = ev.bytes[2];
+
+    // the rest of a long note, restruck every 255 ticks
+    if (gateTime > 255) m_numSplitNotes++;
+    for (uint32_t offset = 255; offset < gateTime; offset += 255) {
+        addEvent(note.track, note.tick + offset, status, (uint8_t)std::min<uint32_t>(gateTime - offset, 255), vos);
+    }
+    m_endTicks[note.track] = std::max(m_endTicks[note.track], tick);
+}
+
+void mfiMfiEncoder::programChange(uint8_t channel, uint8_t program, uint32_t tick) {
+    // Banks only matter to the programs selected on them. mfiMidiWriter
+    // adds 64 to programs on bank 3 and sends that bank as 0, so a program
+    // from 64 up selects bank 3 whatever CC 0 said, and the bank event only
+    // goes out when the MFi bank changes. Converting the output back again
+    // then gives the same file.
+    uint8_t track = channel >> 2;
+    uint8_t bits  = (channel & 3) << 6;
+    uint8_t bank  = m_midiBanks[channel];
+    if (program >= 64) {
+        bank = 3;
+    } else if (bank == 3) {
+        bank = 0;
+    }
+    if (bank != m_banks[channel]) {
+        m_banks[channel] = bank;
+        addTypeB(track, tick, 0xE1, bits | bank);
+    }
+    addTypeB(track, tick, 0xE0, bits | (program & 0x3F));
+}
+
+bool mfiMfiEncoder::finish(mfiBufferWriter *out) {
+    m_pendingNotes.clear();
+
+    size_t numTracks = 1;
+    for (size_t i = 0; i < NUM_TRACKS; i++) {
+        if (m_usedTracks & 1 << i) numTracks = i + 1;
+    }
+
+    // the MFi timebase comes from the first tempo event of track 0
+    std::vector<TimedEvent> &first = m_events[0];
+    bool hasTimebase               = std::any_of(first.begin(), first.end(), [](const TimedEvent &ev) {
+        return ev.bytes[0] == 0xFF && (ev.bytes[1] & 0xF0) == 0xC0;
+    });
+    if (!hasTimebase && m_timebase != 48) {
+        first.insert(first.begin(), { 0, { 0xFF, (uint8_t)(0xC0 | m_timebaseCode), 120 } });
+    }
+
+    // every event and padding NOP is 4 bytes, so the chunks are sized before anything is written
+    size_t trackSizes[NUM_TRACKS] = {};
+    size_t totalSize              = 0;
+    for (size_t i = 0; i < numTracks; i++) {
+        std::vector<TimedEvent> &events = m_events[i];
+        if (m_unsorted[i]) {
+            std::stable_sort(events.begin(), events.end(), [](const TimedEvent &a, const TimedEvent &b) {
+                return a.tick < b.tick;
+            });
+        }
+
+        size_t numEvents = events.size() + 1;
+        uint32_t tick    = 0;
+        for (const TimedEvent &ev : events) {
+            if (ev.tick - tick > 255) numEvents += (ev.tick - tick - 1) / 255;
+            tick = ev.tick;
+        }
+        if (m_endTicks[i] - tick > 255) numEvents += (m_endTicks[i] - tick - 1) / 255;
+
+        trackSizes[i] = 4 * numEvents;
+        totalSize += trackSizes[i];
+    }
+
+    m_trackBuffer.clear();
+    m_trackBuffer.reserve(totalSize);
+    for (size_t i = 0; i < numTracks; i++) {
+        uint32_t tick = 0;
+        for (const TimedEvent &ev : m_events[i]) {
+            uint32_t delta = ev.tick - tick;
+            for (; delta > 255; delta -= 255) {
+                m_trackBuffer.writeUint32(NOP_EVENT);
+            }
+            m_trackBuffer.writeUint32(delta << 24 | (uint32_t)ev.bytes[0] << 16 | ev.bytes[1] << 8 | ev.bytes[2]);
+            tick = ev.tick;
+        }
+
+        uint32_t delta = m_endTicks[i] - tick;
+        for (; delta > 255; delta -= 255) {
+            m_trackBuffer.writeUint32(NOP_EVENT);
+        }
+        m_trackBuffer.writeUint32(delta << 24 | 0xFFDF00); // end of track
+    }
+
+    mfiFileHeader header{};
+    header.contentType   = MFI_CT_MELODY;
+    header.subType       = MFI_MELODY_TYPE_COMPLETE;
+    header.info.noteType = MFI_NOTE_TYPE_LONG; // writeFile adds its `note` chunk
+    if (!m_title.empty()) header.chunks.push_back({ 0x7469746C, m_title });         // 'titl'
+    if (!m_copyright.empty()) header.chunks.push_back({ 0x636F7079, m_copyright }); // 'copy'
+    header.chunks.push_back({ 0x76657273, "0400" });                                // 'vers'
+
+    std::vector<mfiChunkData> tracks;
+    size_t offset = 0;
+    for (size_t i = 0; i < numTracks; i++) {
+        tracks.push_back({ 0x74726163, m_trackBuffer.data() + offset, (uint32_t)trackSizes[i] }); // 'trac'
+        offset += trackSizes[i];
+    }
+
+    size_t headerSize = 64 + m_title.size() + m_copyright.size();
+    out->reserve(headerSize + 8 * numTracks + totalSize);
+    return mfiMediaFileWriter(out).writeFile(header, {}, tracks);
+}
@@ -0,0 +1,129 @@
+#include "mfi/mfiMidiReader.h"
+
+#include "mfi/mfiLog.h"
+
+// a variable-length quantity of at most 4 bytes; sets the reader overrun if it is cut off or longer
+static uint32_t readVarInt(mfiBufferReader *rd) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        uint8_t byte = rd->readUint8();
+        value        = value << 7 | (byte & 0x7F);
+        if (!(byte & 0x80)) return value;
+    }
+    rd->skip(rd->remaining() + 1);
+    return 0;
+}
+
+bool mfiMidiReader::readFile(mfiMidiEventSink *sink) {
+    m_error = MFI_PARSE_OK;
+
+    uint32_t magic      = m_rd->readUint32();
+    uint32_t headerSize = m_rd->readUint32();
+    if (magic != 0x4D546864 || headerSize < 6) { // 'MThd'
+        MFI_LOG(MFI_LOG_ERROR, "MThd header missing\n");
+        return fail(MFI_PARSE_BAD_MAGIC);
+    }
+
+    uint16_t format    = m_rd->readUint16();
+    uint16_t numTracks = m_rd->readUint16();
+    uint16_t division  = m_rd->readUint16();
+    m_rd->skip(headerSize - 6);
+    if (m_rd->overrun()) {
+        MFI_LOG(MFI_LOG_ERROR, "unexpected end of file\n");
+        return fail(MFI_PARSE_TRUNCATED);
+    }
+    if (division & 0x8000 || division == 0) {
+        MFI_LOG(MFI_LOG_ERROR, "unsupported division %04x\n", division);
+        return fail(MFI_PARSE_BAD_HEADER);
+    }
+    sink->consumeMidiHeader(format, numTracks, division);
+
+    uint16_t track = 0;
+    while (m_rd->remaining() >= 8) {
+        uint32_t chunkFourCC = m_rd->readUint32();
+        uint32_t chunkSize   = m_rd->readUint32();
+
+        size_t chunkOffset       = m_rd->tell();
+        const uint8_t *chunkData = m_rd->readView(chunkSize);
+        if (!chunkData) {
+            MFI_LOG(MFI_LOG_ERROR, "chunk at %08llx runs past the end of the file\n", (unsigned long long)chunkOffset);
+            return fail(MFI_PARSE_TRUNCATED);
+        }
+        if (chunkFourCC != 0x4D54726B) continue; // 'MTrk'
+
+        mfiBufferReader rd(chunkData, chunkSize);
+        sink->consumeMidiTrackStart(track++);
+        if (!readTrackEvents(&rd, chunkOffset, sink)) return false;
+    }
+    return true;
+}
+
+bool mfiMidiReader::readTrackEvents(mfiBufferReader *rd, size_t chunkOffset, mfiMidiEventSink *sink) {
+    uint32_t tick         = 0;
+    uint8_t runningStatus = 0;
+
+    while (rd->remaining()) {
+        tick += readVarInt(rd);
+
+        mfiMidiEvent ev{};
+        ev.status = rd->readUint8();
+        if (rd->overrun()) break;
+        if (!(ev.status & 0x80)) {
+            // a data byte: running status, and this is the first data byte
+            if (!runningStatus) {
+                MFI_LOG(MFI_LOG_ERROR, "data byte without a status at %08llx\n", (unsigned long long)(chunkOffset + rd->tell()));
+                return fail(MFI_PARSE_BAD_EVENT);
+            }
+            ev.data1  = ev.status;
+            ev.status = runningStatus;
+        } else if (ev.status < 0xF0) {
+            runningStatus = ev.status;
+            ev.data1      = rd->readUint8();
+        }
+        ev.tick = tick;
+
+        if (ev.status < 0xF0) {
+            uint8_t type = ev.status & 0xF0;
+            if (type != 0xC0 && type != 0xD0) ev.data2 = rd->readUint8();
+            if (rd->overrun()) break;
+            if ((ev.data1 | ev.data2) & 0x80) {
+                MFI_LOG(MFI_LOG_ERROR, "bad data byte at %08llx\n", (unsigned long long)(chunkOffset + rd->tell()));
+                return fail(MFI_PARSE_BAD_EVENT);
+            }
+            ev.eventType = MFI_MIDI_EVENT_CHANNEL;
+            sink->consumeMidiEvent(ev);
+            continue;
+        }
+
+        // meta and SysEx events cancel running status
+        runningStatus = 0;
+        if (ev.status == 0xFF) {
+            ev.eventType = MFI_MIDI_EVENT_META;
+            ev.status    = rd->readUint8();
+        } else if (ev.status == 0xF0 || ev.status == 0xF7) {
+            ev.eventType = MFI_MIDI_EVENT_SYSEX;
+        } else {
+            MFI_LOG(MFI_LOG_ERROR, "unsupported status %02x at %08llx\n", ev.status, (unsigned long long)(chunkOffset + rd->tell()));
+            return fail(MFI_PARSE_BAD_EVENT);
+        }
+        ev.size = readVarInt(rd);
+        ev.data = rd->readView(ev.size);
+        if (!ev.data || rd->overrun()) break;
+
+        if (ev.eventType == MFI_MIDI_EVENT_META && ev.status == 0x2F) {
+            sink->consumeMidiTrackEnd(tick);
+            return true; // bytes after the end of the track are skipped
+        }
+        sink->consumeMidiEvent(ev);
+    }
+
+    if (rd->overrun()) {
+        MFI_LOG(MFI_LOG_ERROR, "last event of the track chunk at %08llx is cut off\n", (unsigned long long)chunkOffset);
+        return fail(MFI_PARSE_TRUNCATED);
+    }
+
+    // plenty of files in the wild leave it out; the track ends with its last event
+    MFI_LOG(MFI_LOG_WARN, "track chunk at %08llx has no end-of-track event\n", (unsigned long long)chunkOffset);
+    sink->consumeMidiTrackEnd(tick);
+    return true;
+}
@@ -0,0 +1,177 @@
+#include "mfi/mfiMidiWriter.h"
+
+const mfiMidiWriter::TypeBHandlerTable mfiMidiWriter::s_typeBHandlers = mfiMidiWriter::makeTypeBHandlerTable();
+
+void mfiMidiWriter::writeHeader(const mfiSong *song) {
+    writeHeader(song->m_tracks.size(), songTimebase(song));
+}
+
+uint16_t mfiMidiWriter::songTimebase(const mfiSong *song) {
+    if (!song->m_tracks.empty()) {
+        for (const mfiEvent &ev : song->m_tracks[0]) {
+            if (isTimebaseEvent(ev)) {
+                return convertTimebase(ev.typeB.eventId & 0xF);
+            }
+        }
+    }
+    return 48;
+}
+
+void mfiMidiWriter::beginTrack(uint8_t channelOffset) {
+    m_wr->writeUint32(0x4D54726B); // MTrk
+
+    m_trackSizeOffset = m_wr->tell();
+    m_wr->writeUint32(0xDEADBEEF); // size will be written here later
+
+    m_channelOffset       = channelOffset;
+    m_absoluteTime        = 0;
+    m_cumulativeDeltaTime = 0;
+    std::fill(std::begin(m_midiBanks), std::end(m_midiBanks), 0);
+}
+
+void mfiMidiWriter::endTrack() {
+    processNoteOffs();
+
+    m_wr->patchUint32(m_trackSizeOffset, m_wr->tell() - m_trackSizeOffset - 4);
+}
+
+void mfiMidiWriter::writeEvent(const mfiEvent &ev) {
+    m_absoluteTime += ev.deltaTime;
+    m_cumulativeDeltaTime += ev.deltaTime;
+
+    processNoteOffs();
+
+    if (ev.eventType == MFI_EVENT_TYPE_NOTE) {
+        uint8_t key = ev.note.key + 45;
+        switch (ev.note.octaveShift) {
+        case 1:
+            key += 12;
+            break;
+        case 2:
+            key -= 24;
+            break;
+        case 3:
+            key -= 12;
+            break;
+        default: break;
+        }
+
+        writeDeltaTime();
+        uint8_t channel = midiChannel(ev.note.channel);
+        m_wr->writeMessage3(channel | 0x90, key, ev.note.velocity * 2); // note on
+
+        m_activeNoteEvents.push({
+            channel,
+            key,
+            m_absoluteTime + ev.note.gateTime,
+        });
+    } else if (ev.eventType == MFI_EVENT_TYPE_B) {
+        TypeBHandler handler = ev.typeB.eventClass == 3 ? s_typeBHandlers.handlers[ev.typeB.eventId] : nullptr;
+        if (handler) {
+            (this->*handler)(ev.typeB.data);
+        } else {
+            m_numUnknownTypeBEvents++;
+        }
+    }
+}
+
+void mfiMidiWriter::writeMasterVolume(uint8_t data) {
+    writeDeltaTime();
+    m_wr->writeUint8(0xF0);
+    writeVarInt(7);
+    m_wr->writeUint32(0x7F7F0401);
+    m_wr->writeUint8(0);
+    m_wr->writeUint8(data);
+    m_wr->writeUint8(0xF7);
+}
+
+void mfiMidiWriter::writeTempo(uint8_t data) {
+    // TODO: set default tempo to 125 BPM
+    if (data == 0) return; // no tempo; its delta time goes to the next event
+
+    writeDeltaTime();
+    m_wr->writeUint8(0xFF);
+    m_wr->writeUint8(0x51);
+    m_wr->writeUint32(0x03000000 | 60'000'000 / data);
+}
+
+void mfiMidiWriter::writeEndOfTrack([[maybe_unused]] uint8_t data) {
+    writeDeltaTime();
+    m_wr->writeUint8(0xFF);
+    m_wr->writeUint8(0x2F);
+    m_wr->writeUint8(0x00);
+}
+
+void mfiMidiWriter::writeProgramSelect(uint8_t data) {
+    uint8_t channel = midiChannel((data & 0xC0) >> 6);
+
+    writeDeltaTime();
+    m_wr->writeUint8(0xC0 | channel); // program change
+
+    uint8_t programNumber = data & 0x3F;
+    if (m_midiBanks[channel] == 3) {
+        programNumber += 64;
+    }
+
+    m_wr->writeUint8(programNumber); // program number
+}
+
+void mfiMidiWriter::writeBankSelect(uint8_t data) {
+    uint8_t channel = midiChannel((data & 0xC0) >> 6);
+
+    uint8_t bank         = data & 0x3F;
+    m_midiBanks[channel] = data & 0x3F;
+
+    if (bank == 2 || bank == 3) {
+        bank = 0; // remap to General MIDI
+    } else if (bank == 0x3F) {
+        bank = 0; // oops! no drum kit for you.
+    }
+
+    writeCCEvent(channel, 0, bank);
+}
+
+void mfiMidiWriter::writeVolume(uint8_t data) {
+    uint8_t channel = midiChannel((data & 0xC0) >> 6);
+    uint8_t volume  = (data & 0x3F);
+    writeCCEvent(channel, 7, volume * 2);
+}
+
+void mfiMidiWriter::writePanning(uint8_t data) {
+    uint8_t channel = midiChannel((data & 0xC0) >> 6);
+    writeCCEvent(channel, 10, (data & 0x3F) * 2);
+}
+
+void mfiMidiWriter::writePitchBend(uint8_t data) {
+    uint8_t channel = (data & 0xC0) >> 6;
+    uint32_t value  = (data & 0x3F) << 8u;
+
+    writeDeltaTime();
+    m_wr->writeMessage3(0xE0 | channel, (value >> 7) & 0x7F, value & 0x7F);
+}
+
+void mfiMidiWriter::writeModWheel(uint8_t data) {
+    uint8_t channel = midiChannel((data & 0xC0) >> 6);
+    writeCCEvent(channel, 1, (data & 0x3F) * 2);
+}
+
+void mfiMidiWriter::writeCCEvent(uint8_t channel, uint8_t cc, uint8_t value) {
+    writeDeltaTime();
+    m_wr->writeMessage3(0xB0 | channel, cc, value);
+}
+
+void mfiMidiWriter::processNoteOffs() {
+    while (const mfiActiveNote *due = m_activeNoteEvents.peekDue(m_absoluteTime)) {
+        const mfiActiveNote &act = *due;
+
+        uint32_t newCumulativeDeltaTime = m_absoluteTime - act.absoluteGateTime;
+        m_cumulativeDeltaTime -= newCumulativeDeltaTime;
+
+        writeDeltaTime();
+        m_wr->writeMessage3(act.channel | 0x80, act.key, 64); // note off; TODO: should we use the note on velocity?
+
+        m_cumulativeDeltaTime = newCumulativeDeltaTime;
+
+        m_activeNoteEvents.pop();
+    }
+}
@@ -0,0 +1,346 @@
+#include "mfi/mfiPack.h"
+
+#include "mfi/mfiConverter.h"
+#include "mfi/mfiLog.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <thread>
+
+// entries converted in parallel before their output is written in order;
+// bounds how much converted data is held at once
+static constexpr size_t MFI_PACK_BATCH = 1024;
+
+static constexpr size_t MFI_TAR_BLOCK = 512;
+
+static bool hasMeloMagic(const uint8_t *data, size_t size) {
+    return size >= 4 && memcmp(data, "melo", 4) == 0;
+}
+
+// offset of the first melo magic at or after pos, or size if there is none
+static size_t findMelo(const uint8_t *data, size_t size, size_t pos) {
+    while (size - pos >= 4) {
+        const void *m = memchr(data + pos, 'm', size - pos - 3);
+        if (!m) break;
+        pos = static_cast<const uint8_t *>(m) - data;
+        if (memcmp(data + pos, "melo", 4) == 0) return pos;
+        pos++;
+    }
+    return size;
+}
+
+static bool scanRaw(const uint8_t *data, size_t size, std::vector<mfiPackEntry> *entries) {
+    size_t pos = 0;
+    while (size - pos >= 8) {
+        if (!hasMeloMagic(data + pos, size - pos)) {
+            // padding or garbage between records: resume at the next magic
+            size_t next = findMelo(data, size, pos + 1);
+            if (next == size) break;
+            MFI_LOG(MFI_LOG_WARN, "pack: skipped %zu bytes at offset %zu\n", next - pos, pos);
+            pos = next;
+            continue;
+        }
+
+        // the length field counts everything after itself
+        size_t recordSize = 8 + (size_t)mfiLoadBE32(data + pos + 4);
+        if (recordSize > size - pos) {
+            // left in, so the conversion reports it as truncated
+            recordSize = size - pos;
+        }
+        entries->push_back({ std::string(), pos, recordSize });
+        pos += recordSize;
+    }
+    return true;
+}
+
+// numeric tar header field: octal text, or base-256 if the top bit is set
+static uint64_t parseTarNumber(const uint8_t *field, size_t size) {
+    uint64_t value = 0;
+    if (field[0] & 0x80) {
+        value = field[0] & 0x7F;
+        for (size_t i = 1; i < size; i++) value = value << 8 | field[i];
+        return value;
+    }
+
+    size_t i = 0;
+    while (i < size && field[i] == ' ') i++;
+    for (; i < size && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = value << 3 | (uint64_t)(field[i] - '0');
+    }
+    return value;
+}
+
+static std::string tarString(const uint8_t *field, size_t size) {
+    const uint8_t *end = static_cast<const uint8_t *>(memchr(field, 0, size));
+    return std::string(reinterpret_cast<const char *>(field), end ? end - field : size);
+}
+
+// the path record of a pax extended header, if there is one
+static std::string paxPath(const uint8_t *data, size_t size) {
+    size_t pos = 0;
+    while (pos < size) {
+        // "<length> <key>=<value>\n", length counting the whole record
+        size_t length = 0;
+        size_t i      = pos;
+        while (i < size && isdigit(data[i])) length = length * 10 + (data[i++] - '0');
+        if (length == 0 || length > size - pos || i >= size || data[i] != ' ') break;
+
+        const char *record = reinterpret_cast<const char *>(data + i + 1);
+        size_t recordSize  = pos + length - (i + 1);
+        if (recordSize > 5 && memcmp(record, "path=", 5) == 0) {
+            return std::string(record + 5, recordSize - 6);
+        }
+        pos += length;
+    }
+    return std::string();
+}
+
+static bool scanTar(const uint8_t *data, size_t size, std::vector<mfiPackEntry> *entries) {
+    std::string longName;
+    size_t pos = 0;
+    while (size - pos >= MFI_TAR_BLOCK) {
+        const uint8_t *header = data + pos;
+        if (header[0] == 0) break; // end-of-archive block
+
+        uint64_t entrySize = parseTarNumber(header + 124, 12);
+        size_t dataOffset  = pos + MFI_TAR_BLOCK;
+        if (entrySize > size - dataOffset) {
+            MFI_LOG(MFI_LOG_WARN, "pack: tar entry at offset %zu is truncated\n", pos);
+            break;
+        }
+
+        const uint8_t *entryData = data + dataOffset;
+        char type                = (char)header[156];
+        if (type == 'L') {
+            // GNU long name for the next entry
+            longName = tarString(entryData, (size_t)entrySize);
+        } else if (type == 'x') {
+            longName = paxPath(entryData, (size_t)entrySize);
+        } else if (type == '0' || type == '\0' || type == '7') {
+            std::string name;
+            if (!longName.empty()) {
+                name.swap(longName);
+            } else {
+                std::string prefix = tarString(header + 345, 155);
+                name               = tarString(header, 100);
+                if (!prefix.empty()) name = prefix + "/" + name;
+            }
+            if (hasMeloMagic(entryData, (size_t)entrySize)) {
+                entries->push_back({ name, dataOffset, (size_t)entrySize });
+            }
+        } else {
+            longName.clear();
+        }
+
+        pos = dataOffset + (size_t)((entrySize + MFI_TAR_BLOCK - 1) / MFI_TAR_BLOCK * MFI_TAR_BLOCK);
+        if (pos > size) break;
+    }
+    return true;
+}
+
+static bool scanZip(const uint8_t *data, size_t size, std::vector<mfiPackEntry> *entries) {
+    // the end of central directory record, followed by at most a 64 KiB comment
+    const size_t eocdSize = 22;
+    if (size < eocdSize) return false;
+    size_t eocd    = size - eocdSize;
+    size_t minEocd = eocd > 0xFFFF ? eocd - 0xFFFF : 0;
+    while (mfiLoadLE32(data + eocd) != 0x06054B50) {
+        if (eocd == minEocd) {
+            MFI_LOG(MFI_LOG_ERROR, "pack: zip central directory not found\n");
+            return false;
+        }
+        eocd--;
+    }
+
+    size_t numEntries = mfiLoadLE16(data + eocd + 10);
+    size_t pos        = mfiLoadLE32(data + eocd + 16);
+    for (size_t i = 0; i < numEntries; i++) {
+        if (pos > size || size - pos < 46 || mfiLoadLE32(data + pos) != 0x02014B50) {
+            MFI_LOG(MFI_LOG_ERROR, "pack: zip central directory is damaged\n");
+            return false;
+        }
+
+        const uint8_t *central = data + pos;
+        uint16_t method        = mfiLoadLE16(central + 10);
+        uint32_t entrySize     = mfiLoadLE32(central + 20);
+        size_t nameLength      = mfiLoadLE16(central + 28);
+        size_t localOffset     = mfiLoadLE32(central + 42);
+        size_t recordSize      = 46 + nameLength + mfiLoadLE16(central + 30) + mfiLoadLE16(central + 32);
+        if (size - pos < recordSize) {
+            MFI_LOG(MFI_LOG_ERROR, "pack: zip central directory is damaged\n");
+            return false;
+        }
+        std::string name(reinterpret_cast<const char *>(central + 46), nameLength);
+        pos += recordSize;
+
+        if (name.empty() || name.back() == '/') continue;
+        if (method != 0 || entrySize == 0xFFFFFFFF) {
+            MFI_LOG(MFI_LOG_WARN, "pack: %s is compressed or zip64, skipped\n", name.c_str());
+            continue;
+        }
+
+        if (localOffset > size || size - localOffset < 30 || mfiLoadLE32(data + localOffset) != 0x04034B50) {
+            MFI_LOG(MFI_LOG_WARN, "pack: %s has no local header, skipped\n", name.c_str());
+            continue;
+        }
+        size_t dataOffset = localOffset + 30 + mfiLoadLE16(data + localOffset + 26) + mfiLoadLE16(data + localOffset + 28);
+        if (dataOffset > size || size - dataOffset < entrySize) {
+            MFI_LOG(MFI_LOG_WARN, "pack: %s is truncated, skipped\n", name.c_str());
+            continue;
+        }
+
+        if (hasMeloMagic(data + dataOffset, entrySize)) {
+            entries->push_back({ name, dataOffset, entrySize });
+        }
+    }
+    return true;
+}
+
+bool mfiScanPack(const uint8_t *data, size_t size, mfiPackFormat *format, std::vector<mfiPackEntry> *entries) {
+    entries->clear();
+
+    if (size >= MFI_TAR_BLOCK && memcmp(data + 257, "ustar", 5) == 0) {
+        *format = MFI_PACK_TAR;
+        return scanTar(data, size, entries);
+    }
+    if (size >= 4 && mfiLoadLE32(data) == 0x04034B50) {
+        *format = MFI_PACK_ZIP;
+        return scanZip(data, size, entries);
+    }
+
+    *format = MFI_PACK_RAW;
+    if (!hasMeloMagic(data, size)) {
+        MFI_LOG(MFI_LOG_ERROR, "pack: not a tar or zip archive, and no melo record at the start\n");
+        return false;
+    }
+    return scanRaw(data, size, entries);
+}
+
+// name.mld becomes name.mid; anything else gets .mid appended
+static std::string smfName(const std::string &name) {
+    size_t length = name.size();
+    if (length >= 4 && name[length - 4] == '.' && tolower((unsigned char)name[length - 3]) == 'm' &&
+        tolower((unsigned char)name[length - 2]) == 'l' && tolower((unsigned char)name[length - 1]) == 'd') {
+        return name.substr(0, length - 4) + ".mid";
+    }
+    return name + ".mid";
+}
+
+bool mfiPackWriter::writeEntry(const std::string &name, const uint8_t *smf, size_t size) {
+    if (m_format == MFI_PACK_RAW) {
+        m_wr->writeDirect(smf, size);
+        return true;
+    }
+
+    // ustar splits long paths at a slash into a 155-byte prefix and a 100-byte name
+    size_t split = 0;
+    if (name.size() > 100) {
+        split = name.find('/', name.size() - 101);
+        if (split == std::string::npos || split == 0 || split > 155) return false;
+    }
+
+    uint8_t header[MFI_TAR_BLOCK] = {};
+    if (split) {
+        memcpy(header + 345, name.data(), split);
+        memcpy(header, name.data() + split + 1, name.size() - split - 1);
+    } else {
+        memcpy(header, name.data(), name.size());
+    }
+    memcpy(header + 100, "0000644", 7);
+    memcpy(header + 108, "0000000", 7);
+    memcpy(header + 116, "0000000", 7);
+    snprintf(reinterpret_cast<char *>(header + 124), 12, "%011llo", (unsigned long long)size);
+    memcpy(header + 136, "00000000000", 11);
+    memset(header + 148, ' ', 8);
+    header[156] = '0';
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+
+    unsigned checksum = 0;
+    for (uint8_t byte : header) checksum += byte;
+    snprintf(reinterpret_cast<char *>(header + 148), 8, "%06o", checksum);
+
+    m_wr->write(header, sizeof(header));
+    m_wr->writeDirect(smf, size);
+
+    static const uint8_t s_padding[MFI_TAR_BLOCK] = {};
+    if (size_t tail = size % MFI_TAR_BLOCK) {
+        m_wr->write(s_padding, MFI_TAR_BLOCK - tail);
+    }
+    return true;
+}
+
+void mfiPackWriter::finish() {
+    if (m_format == MFI_PACK_RAW) return;
+
+    static const uint8_t s_endBlocks[2 * MFI_TAR_BLOCK] = {};
+    m_wr->write(s_endBlocks, sizeof(s_endBlocks));
+}
+
+bool mfiConvertPack(const void *data, size_t size, mfiBufferWriter *out, unsigned numThreads, mfiPackStats *stats) {
+    *stats = mfiPackStats{};
+
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    mfiPackFormat format;
+    std::vector<mfiPackEntry> entries;
+    if (!mfiScanPack(bytes, size, &format, &entries)) return false;
+    stats->numEntries = entries.size();
+
+    numThreads = std::max(1u, numThreads);
+    std::unique_ptr<mfiConverter[]> converters(new mfiConverter[numThreads]);
+
+    // outputs are swapped with the converters' buffers, so both sides keep their storage
+    size_t batchSize = std::min(MFI_PACK_BATCH, entries.size());
+    std::vector<std::vector<uint8_t>> outputs(batchSize);
+    std::vector<uint8_t> converted(batchSize);
+
+    mfiPackWriter writer(out, format);
+    for (size_t batchStart = 0; batchStart < entries.size(); batchStart += batchSize) {
+        size_t batchEnd = std::min(batchStart + batchSize, entries.size());
+
+        std::atomic<size_t> nextEntry{ batchStart };
+        auto worker = [&](mfiConverter *converter) {
+            size_t index;
+            while ((index = nextEntry.fetch_add(1, std::memory_order_relaxed)) < batchEnd) {
+                const mfiPackEntry &entry = entries[index];
+                bool ok                   = converter->convert(bytes + entry.offset, entry.size);
+                if (ok) converter->takeOutput(&outputs[index - batchStart]);
+                converted[index - batchStart] = ok;
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (unsigned i = 1; i < std::min<size_t>(numThreads, batchEnd - batchStart); i++) {
+            threads.emplace_back(worker, &converters[i]);
+        }
+        worker(&converters[0]);
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+
+        for (size_t i = batchStart; i < batchEnd; i++) {
+            const mfiPackEntry &entry = entries[i];
+            if (!converted[i - batchStart]) {
+                MFI_LOG(MFI_LOG_ERROR, "pack: failed to parse %s at offset %zu\n", entry.name.empty() ? "record" : entry.name.c_str(), entry.offset);
+                stats->numFailed++;
+                continue;
+            }
+
+            const std::vector<uint8_t> &smf = outputs[i - batchStart];
+            if (!writer.writeEntry(smfName(entry.name), smf.data(), smf.size())) {
+                MFI_LOG(MFI_LOG_ERROR, "pack: name too long for tar: %s\n", entry.name.c_str());
+                stats->numFailed++;
+            }
+        }
+
+        // the file writer sent the SMF data directly; this writes the headers
+        if (!out->flush()) return false;
+    }
+
+    writer.finish();
+    return out->flush();
+}
@@ -0,0 +1,56 @@
+#include "mfi/mfiMidiWriter.h"
+
+#include <atomic>
+#include <thread>
+
+void mfiParallelMidiWriter::writeSong(const mfiSong *song) {
+    mfiMidiWriter(m_wr).writeHeader(song);
+
+    const std::vector<mfiTrack> &tracks = song->m_tracks;
+    size_t numTracks                    = tracks.size();
+    if (numTracks == 0) return;
+
+    std::vector<mfiBufferWriter> buffers(numTracks);
+    std::vector<mfiMidiWriter> writers;
+    writers.reserve(numTracks);
+    for (mfiBufferWriter &buffer : buffers) {
+        writers.emplace_back(&buffer);
+    }
+
+    std::atomic<size_t> nextTrack{ 0 };
+    auto worker = [&]() {
+        size_t index;
+        while ((index = nextTrack.fetch_add(1, std::memory_order_relaxed)) < numTracks) {
+            writers[index].writeTrack(&tracks[index], (uint8_t)(index * 4));
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min<size_t>(m_numThreads, numTracks); i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    // the first track that leaves note-offs pending encodes the rest in order
+    size_t numEncoded = numTracks;
+    for (size_t i = 0; i + 1 < numTracks; i++) {
+        if (writers[i].hasPendingNoteOffs()) {
+            numEncoded = i + 1;
+            break;
+        }
+    }
+    for (size_t i = numEncoded; i < numTracks; i++) {
+        writers[numEncoded - 1].writeTrack(&tracks[i], (uint8_t)(i * 4));
+    }
+
+    m_numUnknownTypeBEvents = 0;
+    m_peakPendingNoteOffs   = 0;
+    for (size_t i = 0; i < numEncoded; i++) {
+        m_wr->write(buffers[i].data(), buffers[i].size());
+        m_numUnknownTypeBEvents += writers[i].numUnknownTypeBEvents();
+        m_peakPendingNoteOffs = std::max(m_peakPendingNoteOffs, writers[i].peakPendingNoteOffs());
+    }
+}
@@ -0,0 +1,634 @@
+#include "mfi/mfiPipeline.h"
+
+#include "mfi/mfiConverter.h"
+#include "mfi/mfiLog.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+#if defined(__linux__) && !defined(MFI_NO_IO_URING) && __has_include(<linux/io_uring.h>)
+#define MFI_HAVE_IO_URING 1
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#else
+#define MFI_HAVE_IO_URING 0
+#endif
+
+// the buffer a slot starts reading into; it grows as needed and is kept
+static constexpr size_t MFI_PIPELINE_READ_SIZE = 64 * 1024;
+
+enum mfiSlotStage : uint8_t {
+    MFI_SLOT_READING,
+    MFI_SLOT_CONVERTING,
+    MFI_SLOT_WRITING,
+};
+
+// one file in flight
+struct mfiPipelineSlot {
+    const mfiBatchJob *job = nullptr;
+    mfiSlotStage stage     = MFI_SLOT_READING;
+    bool ok                = true;
+
+    std::vector<uint8_t> input; // input.size() is the capacity, inputSize the bytes read
+    size_t inputSize = 0;
+    std::vector<uint8_t> output;
+    size_t outputDone = 0;
+
+    // io_uring only: the open file and which system call is outstanding
+    int fd       = -1;
+    uint8_t step = 0;
+};
+
+// Moves whole files between disk and slot buffers. Reads and writes are
+// started by the pipeline thread; finished slots, and slots the workers
+// are done converting, come back out of wait().
+class mfiPipelineIO {
+protected:
+    std::mutex m_mutex;
+    std::vector<mfiPipelineSlot *> m_posted;
+
+public:
+    virtual ~mfiPipelineIO() = default;
+
+    virtual const char *name() const = 0;
+
+    virtual void startRead(mfiPipelineSlot *slot)  = 0;
+    virtual void startWrite(mfiPipelineSlot *slot) = 0;
+
+    // blocks until at least one slot is finished with its stage; false if
+    // the I/O machinery itself broke down
+    virtual bool wait(std::vector<mfiPipelineSlot *> *finished) = 0;
+
+    // hands a slot back to the pipeline thread; any thread may call it
+    void post(mfiPipelineSlot *slot) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_posted.push_back(slot);
+        }
+        wake();
+    }
+
+protected:
+    virtual void wake() = 0;
+
+    // moves the posted slots to finished; m_mutex must be held
+    void takePosted(std::vector<mfiPipelineSlot *> *finished) {
+        finished->insert(finished->end(), m_posted.begin(), m_posted.end());
+        m_posted.clear();
+    }
+};
+
+// Reads slot->job->inputPath into slot->input with stdio. Used by the
+// thread fallback; the io_uring path does the same in steps.
+static bool readInput(mfiPipelineSlot *slot) {
+    FILE *fp = fopen(slot->job->inputPath.c_str(), "rb");
+    if (!fp) return false;
+
+    slot->inputSize = 0;
+    if (slot->input.size() < MFI_PIPELINE_READ_SIZE) {
+        slot->input.resize(MFI_PIPELINE_READ_SIZE);
+    }
+
+    size_t count;
+    while ((count = fread(slot->input.data() + slot->inputSize, 1, slot->input.size() - slot->inputSize, fp)) > 0) {
+        slot->inputSize += count;
+        if (slot->inputSize == slot->input.size()) {
+            slot->input.resize(2 * slot->input.size());
+        }
+    }
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+// blocking I/O on a small pool of threads, for platforms without io_uring
+class mfiThreadIO : public mfiPipelineIO {
+    std::mutex m_taskMutex;
+    std::condition_variable m_taskCv;
+    std::deque<mfiPipelineSlot *> m_tasks;
+    bool m_stop;
+
+    std::condition_variable m_postedCv; // goes with m_mutex
+    std::vector<std::thread> m_threads;
+
+public:
+    explicit mfiThreadIO(unsigned numThreads)
+        : m_stop(false) {
+        for (unsigned i = 0; i < numThreads; i++) {
+            m_threads.emplace_back([this]() { run(); });
+        }
+    }
+
+    ~mfiThreadIO() override {
+        {
+            std::lock_guard<std::mutex> lock(m_taskMutex);
+            m_stop = true;
+        }
+        m_taskCv.notify_all();
+        for (std::thread &thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    const char *name() const override {
+        return "threads";
+    }
+
+    void startRead(mfiPipelineSlot *slot) override {
+        push(slot);
+    }
+
+    void startWrite(mfiPipelineSlot *slot) override {
+        push(slot);
+    }
+
+    bool wait(std::vector<mfiPipelineSlot *> *finished) override {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_postedCv.wait(lock, [this]() { return !m_posted.empty(); });
+        takePosted(finished);
+        return true;
+    }
+
+protected:
+    void wake() override {
+        m_postedCv.notify_one();
+    }
+
+private:
+    void push(mfiPipelineSlot *slot) {
+        {
+            std::lock_guard<std::mutex> lock(m_taskMutex);
+            m_tasks.push_back(slot);
+        }
+        m_taskCv.notify_one();
+    }
+
+    void run() {
+        for (;;) {
+            mfiPipelineSlot *slot;
+            {
+                std::unique_lock<std::mutex> lock(m_taskMutex);
+                m_taskCv.wait(lock, [this]() { return m_stop || !m_tasks.empty(); });
+                if (m_tasks.empty()) return;
+                slot = m_tasks.front();
+                m_tasks.pop_front();
+            }
+
+            if (slot->stage == MFI_SLOT_READING) {
+                slot->ok = readInput(slot);
+            } else {
+                const char *path = slot->job->outputPath.c_str();
+                slot->ok         = mfiWriteFile(path, slot->output.data(), slot->output.size());
+                if (!slot->ok) remove(path);
+            }
+            post(slot);
+        }
+    }
+};
+
+#if MFI_HAVE_IO_URING
+
+// The io_uring interface through its system calls directly, so there is no
+// dependency on liburing. Only the pipeline thread touches the rings; the
+// workers wake it through an eventfd that always has a read queued.
+class mfiUringIO : public mfiPipelineIO {
+    enum : uint8_t {
+        STEP_OPEN,
+        STEP_TRANSFER,
+        STEP_CLOSE,
+    };
+
+    int m_ringFd;
+    int m_eventFd;
+    uint64_t m_eventValue;
+
+    void *m_sqRing;
+    size_t m_sqRingSize;
+    void *m_cqRing;
+    size_t m_cqRingSize;
+    io_uring_sqe *m_sqes;
+    size_t m_sqesSize;
+
+    unsigned *m_sqTail;
+    unsigned m_sqMask;
+    unsigned *m_sqArray;
+    unsigned *m_cqHead;
+    unsigned *m_cqTail;
+    unsigned m_cqMask;
+    io_uring_cqe *m_cqes;
+
+    unsigned m_toSubmit;
+
+public:
+    mfiUringIO()
+        : m_ringFd(-1),
+          m_eventFd(-1),
+          m_eventValue(0),
+          m_sqRing(MAP_FAILED),
+          m_sqRingSize(0),
+          m_cqRing(MAP_FAILED),
+          m_cqRingSize(0),
+          m_sqes(static_cast<io_uring_sqe *>(MAP_FAILED)),
+          m_sqesSize(0),
+          m_toSubmit(0) {
+    }
+
+    ~mfiUringIO() override {
+        if (m_sqes != MAP_FAILED) munmap(m_sqes, m_sqesSize);
+        if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing) munmap(m_cqRing, m_cqRingSize);
+        if (m_sqRing != MAP_FAILED) munmap(m_sqRing, m_sqRingSize);
+        if (m_ringFd >= 0) close(m_ringFd);
+        if (m_eventFd >= 0) close(m_eventFd);
+    }
+
+    // false if the kernel doesn't offer io_uring (or it's disabled)
+    bool init(unsigned queueDepth) {
+        // every slot has at most one request outstanding, plus the eventfd read
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        m_ringFd = (int)syscall(__NR_io_uring_setup, queueDepth + 1, &params);
+        if (m_ringFd < 0) return false;
+        if (!supportsOps()) return false;
+
+        m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single  = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+
+        m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQ_RING);
+        if (m_sqRing == MAP_FAILED) return false;
+        m_cqRing = single ? m_sqRing : mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_CQ_RING);
+        if (m_cqRing == MAP_FAILED) return false;
+
+        m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        void *sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return false;
+        m_sqes = static_cast<io_uring_sqe *>(sqes);
+
+        uint8_t *sq = static_cast<uint8_t *>(m_sqRing);
+        uint8_t *cq = static_cast<uint8_t *>(m_cqRing);
+        m_sqTail    = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        m_sqMask    = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        m_sqArray   = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        m_cqHead    = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        m_cqTail    = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        m_cqMask    = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        m_cqes      = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+        m_eventFd = eventfd(0, EFD_CLOEXEC);
+        if (m_eventFd < 0) return false;
+        armEventFd();
+        return true;
+    }
+
+    const char *name() const override {
+        return "io_uring";
+    }
+
+    void startRead(mfiPipelineSlot *slot) override {
+        slot->inputSize = 0;
+        if (slot->input.size() < MFI_PIPELINE_READ_SIZE) {
+            slot->input.resize(MFI_PIPELINE_READ_SIZE);
+        }
+
+        slot->step        = STEP_OPEN;
+        io_uring_sqe *sqe = nextSqe(IORING_OP_OPENAT, AT_FDCWD, slot);
+        sqe->addr         = (uintptr_t)slot->job->inputPath.c_str();
+        sqe->open_flags   = O_RDONLY | O_CLOEXEC;
+    }
+
+    void startWrite(mfiPipelineSlot *slot) override {
+        slot->outputDone = 0;
+
+        slot->step        = STEP_OPEN;
+        io_uring_sqe *sqe = nextSqe(IORING_OP_OPENAT, AT_FDCWD, slot);
+        sqe->addr         = (uintptr_t)slot->job->outputPath.c_str();
+        sqe->len          = 0666;
+        sqe->open_flags   = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    }
+
+    bool wait(std::vector<mfiPipelineSlot *> *finished) override {
+        size_t numFinished = finished->size();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            takePosted(finished);
+        }
+
+        while (finished->size() == numFinished) {
+            if (!enter(1)) return false;
+            reap(finished);
+        }
+        return m_toSubmit == 0 || enter(0);
+    }
+
+protected:
+    void wake() override {
+        uint64_t one = 1;
+        while (write(m_eventFd, &one, sizeof(one)) < 0 && errno == EINTR) {
+        }
+    }
+
+private:
+    // A ring can be set up on kernels that can't run the operations the
+    // pipeline submits: they only arrived in 5.6, together with the probe.
+    // Every job would fail with -EINVAL there instead of using threads.
+    bool supportsOps() {
+        static const uint8_t s_ops[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE };
+
+        // the kernel fills in ops[0..255]; it wants the buffer zeroed
+        std::vector<uint8_t> buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+        io_uring_probe *probe = reinterpret_cast<io_uring_probe *>(buffer.data());
+        if (syscall(__NR_io_uring_register, m_ringFd, IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+
+        for (uint8_t op : s_ops) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+        }
+        return true;
+    }
+
+    io_uring_sqe *nextSqe(uint8_t opcode, int fd, mfiPipelineSlot *slot) {
+        // can't fill up: each slot and the eventfd have one request at most
+        unsigned tail     = *m_sqTail;
+        unsigned index    = tail & m_sqMask;
+        io_uring_sqe *sqe = &m_sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode    = opcode;
+        sqe->fd        = fd;
+        sqe->user_data = (uintptr_t)slot;
+
+        m_sqArray[index] = index;
+        __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+        m_toSubmit++;
+        return sqe;
+    }
+
+    void armEventFd() {
+        io_uring_sqe *sqe = nextSqe(IORING_OP_READ, m_eventFd, nullptr);
+        sqe->addr         = (uintptr_t)&m_eventValue;
+        sqe->len          = sizeof(m_eventValue);
+    }
+
+    void submitTransfer(mfiPipelineSlot *slot) {
+        slot->step = STEP_TRANSFER;
+        if (slot->stage == MFI_SLOT_READING) {
+            io_uring_sqe *sqe = nextSqe(IORING_OP_READ, slot->fd, slot);
+            sqe->addr         = (uintptr_t)(slot->input.data() + slot->inputSize);
+            sqe->len          = (uint32_t)std::min<size_t>(slot->input.size() - slot->inputSize, 1u << 30);
+            sqe->off          = slot->inputSize;
+        } else {
+            io_uring_sqe *sqe = nextSqe(IORING_OP_WRITE, slot->fd, slot);
+            sqe->addr         = (uintptr_t)(slot->output.data() + slot->outputDone);
+            sqe->len          = (uint32_t)std::min<size_t>(slot->output.size() - slot->outputDone, 1u << 30);
+            sqe->off          = slot->outputDone;
+        }
+    }
+
+    void submitClose(mfiPipelineSlot *slot) {
+        slot->step = STEP_CLOSE;
+        nextSqe(IORING_OP_CLOSE, slot->fd, slot);
+    }
+
+    bool enter(unsigned minComplete) {
+        for (;;) {
+            long ret = syscall(__NR_io_uring_enter, m_ringFd, m_toSubmit, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (ret >= 0) {
+                m_toSubmit -= (unsigned)ret;
+                return true;
+            }
+            if (errno != EINTR) {
+                MFI_LOG(MFI_LOG_ERROR, "io_uring_enter failed: %s\n", strerror(errno));
+                return false;
+            }
+        }
+    }
+
+    void reap(std::vector<mfiPipelineSlot *> *finished) {
+        unsigned head = *m_cqHead;
+        unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const io_uring_cqe &cqe = m_cqes[head & m_cqMask];
+            auto *slot              = reinterpret_cast<mfiPipelineSlot *>((uintptr_t)cqe.user_data);
+            if (slot) {
+                complete(slot, cqe.res, finished);
+            } else {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                takePosted(finished);
+                armEventFd();
+            }
+        }
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    // advances a slot by one system call
+    void complete(mfiPipelineSlot *slot, int res, std::vector<mfiPipelineSlot *> *finished) {
+        bool reading = slot->stage == MFI_SLOT_READING;
+
+        switch (slot->step) {
+        case STEP_OPEN:
+            if (res < 0) {
+                slot->ok = false;
+                finished->push_back(slot);
+                return;
+            }
+            slot->fd = res;
+            submitTransfer(slot);
+            return;
+
+        case STEP_TRANSFER:
+            if (reading) {
+                if (res < 0) {
+                    if (res == -EINTR || res == -EAGAIN) {
+                        submitTransfer(slot);
+                        return;
+                    }
+                    slot->ok = false;
+                } else if (res > 0) {
+                    slot->inputSize += (size_t)res;
+                    if (slot->inputSize == slot->input.size()) {
+                        slot->input.resize(2 * slot->input.size());
+                    }
+                    submitTransfer(slot);
+                    return;
+                }
+            } else {
+                if (res > 0) {
+                    slot->outputDone += (size_t)res;
+                    if (slot->outputDone < slot->output.size()) {
+                        submitTransfer(slot);
+                        return;
+                    }
+                } else if (res == -EINTR || res == -EAGAIN) {
+                    submitTransfer(slot);
+                    return;
+                } else {
+                    slot->ok = false;
+                }
+            }
+            submitClose(slot);
+            return;
+
+        case STEP_CLOSE:
+            slot->fd = -1;
+            if (!reading) {
+                if (res < 0) slot->ok = false;
+                if (!slot->ok) unlink(slot->job->outputPath.c_str());
+            }
+            finished->push_back(slot);
+            return;
+        }
+    }
+};
+
+#endif
+
+// slots waiting for a conversion worker
+class mfiSlotQueue {
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<mfiPipelineSlot *> m_slots;
+    bool m_closed = false;
+
+public:
+    void push(mfiPipelineSlot *slot) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_slots.push_back(slot);
+        }
+        m_cv.notify_one();
+    }
+
+    // nullptr once the queue is closed and drained
+    mfiPipelineSlot *pop() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this]() { return m_closed || !m_slots.empty(); });
+        if (m_slots.empty()) return nullptr;
+        mfiPipelineSlot *slot = m_slots.front();
+        m_slots.pop_front();
+        return slot;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closed = true;
+        }
+        m_cv.notify_all();
+    }
+};
+
+size_t mfiBatchPipeline::run(const std::vector<mfiBatchJob> &jobs) {
+    if (jobs.empty()) return 0;
+
+    unsigned queueDepth = (unsigned)std::min<size_t>(std::max(1u, m_queueDepth), jobs.size());
+
+    // before the I/O backend, so nothing can still be reading into a slot once they go away
+    std::vector<mfiPipelineSlot> slots(queueDepth);
+    std::vector<mfiPipelineSlot *> freeSlots;
+    for (mfiPipelineSlot &slot : slots) {
+        freeSlots.push_back(&slot);
+    }
+
+    std::unique_ptr<mfiPipelineIO> io;
+#if MFI_HAVE_IO_URING
+    auto ring = std::make_unique<mfiUringIO>();
+    if (ring->init(queueDepth)) {
+        io = std::move(ring);
+    } else {
+        MFI_LOG(MFI_LOG_INFO, "io_uring unavailable, using I/O threads\n");
+    }
+#endif
+    if (!io) io = std::make_unique<mfiThreadIO>(std::min(queueDepth, 32u));
+    m_backendName = io->name();
+
+    mfiSlotQueue convertQueue;
+    auto worker = [&]() {
+        mfiConverter converter;
+        converter.setCache(m_cache);
+
+        while (mfiPipelineSlot *slot = convertQueue.pop()) {
+            const mfiBatchJob &job = *slot->job;
+            slot->ok               = converter.convert(slot->input.data(), slot->inputSize);
+            if (!slot->ok) {
+                MFI_LOG(MFI_LOG_ERROR, "failed to parse %s\n", job.inputPath.c_str());
+            } else {
+                std::error_code ec;
+                std::filesystem::path parent = std::filesystem::path(job.outputPath).parent_path();
+                if (!parent.empty()) std::filesystem::create_directories(parent, ec);
+                converter.takeOutput(&slot->output);
+            }
+
+            if (uint32_t numUnknown = converter.numUnknownTypeBEvents()) {
+                MFI_LOG(MFI_LOG_INFO, "%s: %u unknown type B events skipped\n", job.inputPath.c_str(), numUnknown);
+            }
+            io->post(slot);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < std::max(1u, m_numWorkers); i++) {
+        workers.emplace_back(worker);
+    }
+
+    size_t nextJob   = 0;
+    size_t numDone   = 0;
+    size_t numFailed = 0;
+    std::vector<mfiPipelineSlot *> finished;
+    while (numDone < jobs.size()) {
+        while (!freeSlots.empty() && nextJob < jobs.size()) {
+            mfiPipelineSlot *slot = freeSlots.back();
+            freeSlots.pop_back();
+            slot->job   = &jobs[nextJob++];
+            slot->stage = MFI_SLOT_READING;
+            slot->ok    = true;
+            io->startRead(slot);
+        }
+
+        finished.clear();
+        if (!io->wait(&finished)) {
+            numFailed += jobs.size() - numDone;
+            break;
+        }
+        for (mfiPipelineSlot *slot : finished) {
+            if (slot->ok && slot->stage == MFI_SLOT_READING) {
+                slot->stage = MFI_SLOT_CONVERTING;
+                convertQueue.push(slot);
+                continue;
+            }
+            if (slot->ok && slot->stage == MFI_SLOT_CONVERTING) {
+                slot->stage = MFI_SLOT_WRITING;
+                io->startWrite(slot);
+                continue;
+            }
+
+            if (!slot->ok) {
+                numFailed++;
+                if (slot->stage == MFI_SLOT_READING) {
+                    MFI_LOG(MFI_LOG_ERROR, "cannot read %s\n", slot->job->inputPath.c_str());
+                } else if (slot->stage == MFI_SLOT_WRITING) {
+                    MFI_LOG(MFI_LOG_ERROR, "failed to write %s\n", slot->job->outputPath.c_str());
+                }
+            }
+            numDone++;
+            freeSlots.push_back(slot);
+        }
+    }
+
+    convertQueue.close();
+    for (std::thread &thread : workers) {
+        thread.join();
+    }
+    return numFailed;
+}
@@ -0,0 +1,490 @@
+#include "mfi/mfiRenderer.h"
+#include "mfi/mfiLog.h"
+#include "mfi/mfiMidiWriter.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MFI_RENDER_SSE2 1
+#include <emmintrin.h>
+#else
+#define MFI_RENDER_SSE2 0
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <utility>
+
+static constexpr uint32_t BLOCK_FRAMES  = 1024;
+static constexpr uint32_t TABLE_SIZE    = 2048;
+static constexpr uint32_t NUM_FAMILIES  = 16;
+static constexpr uint32_t NUM_HARMONICS = 8;
+static constexpr float VOICE_GAIN       = 0.2f; // headroom for a few loud voices at once
+static constexpr double PI              = 3.14159265358979323846;
+
+// harmonic amplitudes of each family's wave, roughly after the instruments they stand for
+static const float s_harmonics[NUM_FAMILIES][NUM_HARMONICS] = {
+    { 1.0f, 0.5f, 0.3f, 0.2f, 0.12f, 0.08f, 0.05f, 0.03f },   // piano
+    { 1.0f, 0.0f, 0.3f, 0.0f, 0.1f, 0.0f, 0.05f, 0.0f },      // chromatic percussion
+    { 1.0f, 0.8f, 0.6f, 0.5f, 0.0f, 0.4f, 0.0f, 0.3f },       // organ
+    { 1.0f, 0.6f, 0.4f, 0.3f, 0.2f, 0.15f, 0.1f, 0.08f },     // guitar
+    { 1.0f, 0.3f, 0.1f, 0.05f, 0.0f, 0.0f, 0.0f, 0.0f },      // bass
+    { 1.0f, 0.5f, 0.33f, 0.25f, 0.2f, 0.17f, 0.14f, 0.12f },  // strings
+    { 1.0f, 0.5f, 0.33f, 0.25f, 0.2f, 0.17f, 0.14f, 0.12f },  // ensemble
+    { 1.0f, 0.7f, 0.5f, 0.4f, 0.3f, 0.25f, 0.2f, 0.15f },     // brass
+    { 1.0f, 0.0f, 0.33f, 0.0f, 0.2f, 0.0f, 0.14f, 0.0f },     // reed
+    { 1.0f, 0.15f, 0.05f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f },     // pipe
+    { 1.0f, 0.5f, 0.33f, 0.25f, 0.2f, 0.17f, 0.14f, 0.12f },  // synth lead
+    { 1.0f, 0.4f, 0.2f, 0.1f, 0.05f, 0.0f, 0.0f, 0.0f },      // synth pad
+    { 1.0f, 0.3f, 0.5f, 0.2f, 0.3f, 0.1f, 0.2f, 0.05f },      // synth effects
+    { 1.0f, 0.4f, 0.6f, 0.2f, 0.3f, 0.1f, 0.1f, 0.05f },      // ethnic
+    { 1.0f, 0.7f, 0.4f, 0.6f, 0.2f, 0.3f, 0.1f, 0.2f },       // percussive
+    { 1.0f, 0.9f, 0.8f, 0.7f, 0.6f, 0.5f, 0.4f, 0.3f },       // sound effects
+};
+
+struct mfiEnvelopeShape {
+    float attackSeconds;
+    float decaySeconds; // time constant towards the sustain level
+    float sustain;
+    float releaseSeconds;
+};
+
+static const mfiEnvelopeShape s_envelopes[NUM_FAMILIES] = {
+    { 0.002f, 0.6f, 0.0f, 0.08f },  // piano
+    { 0.001f, 0.4f, 0.0f, 0.1f },   // chromatic percussion
+    { 0.01f, 0.1f, 0.9f, 0.05f },   // organ
+    { 0.002f, 0.5f, 0.0f, 0.08f },  // guitar
+    { 0.004f, 0.5f, 0.2f, 0.05f },  // bass
+    { 0.06f, 0.3f, 0.8f, 0.2f },    // strings
+    { 0.08f, 0.3f, 0.8f, 0.25f },   // ensemble
+    { 0.03f, 0.2f, 0.7f, 0.1f },    // brass
+    { 0.02f, 0.2f, 0.8f, 0.08f },   // reed
+    { 0.03f, 0.2f, 0.8f, 0.1f },    // pipe
+    { 0.005f, 0.2f, 0.7f, 0.05f },  // synth lead
+    { 0.2f, 0.5f, 0.7f, 0.4f },     // synth pad
+    { 0.05f, 0.5f, 0.5f, 0.3f },    // synth effects
+    { 0.003f, 0.4f, 0.1f, 0.1f },   // ethnic
+    { 0.001f, 0.2f, 0.0f, 0.05f },  // percussive
+    { 0.01f, 0.5f, 0.5f, 0.2f },    // sound effects
+};
+
+// one period of each family's wave, with a copy of the first sample at the
+// end so interpolation never wraps
+struct mfiWavetables {
+    float tables[NUM_FAMILIES][TABLE_SIZE + 1];
+};
+
+static mfiWavetables makeWavetables() {
+    mfiWavetables result;
+    for (uint32_t family = 0; family < NUM_FAMILIES; family++) {
+        float *table = result.tables[family];
+        float peak   = 0.0f;
+        for (uint32_t i = 0; i < TABLE_SIZE; i++) {
+            double value = 0.0;
+            for (uint32_t h = 0; h < NUM_HARMONICS; h++) {
+                value += s_harmonics[family][h] * sin(2.0 * PI * (h + 1) * i / TABLE_SIZE);
+            }
+            table[i] = (float)value;
+            peak     = std::max(peak, std::fabs(table[i]));
+        }
+        for (uint32_t i = 0; i < TABLE_SIZE; i++) {
+            table[i] /= peak;
+        }
+        table[TABLE_SIZE] = table[0];
+    }
+    return result;
+}
+
+static const mfiWavetables &wavetables() {
+    static const mfiWavetables tables = makeWavetables();
+    return tables;
+}
+
+// an envelope shape in frames at the output rate
+struct mfiEnvelope {
+    uint32_t attackFrames;
+    float decayPerFrame;
+    float sustain;
+    uint32_t releaseFrames;
+
+    // the level r frames after the note-on, while the note is held
+    float heldLevel(uint32_t r) const {
+        if (r < attackFrames) return (float)r / attackFrames;
+        return sustain + (1.0f - sustain) * (float)pow(decayPerFrame, (double)(r - attackFrames));
+    }
+};
+
+// Tick to seconds. Tempo events of every track change the tempo of the
+// whole song, the way they do in a type 1 SMF, starting at 120 BPM.
+class mfiTempoMap {
+    struct Segment {
+        uint32_t tick;
+        double seconds;
+        double secondsPerTick;
+    };
+
+    std::vector<Segment> m_segments;
+    uint16_t m_timebase;
+
+public:
+    explicit mfiTempoMap(uint16_t timebase)
+        : m_timebase(timebase) {
+        m_segments.push_back({ 0, 0.0, 60.0 / (120.0 * timebase) });
+    }
+
+    // changes must come in tick order
+    void setTempo(uint32_t tick, uint8_t bpm) {
+        double secondsPerTick = 60.0 / ((double)bpm * m_timebase);
+        if (m_segments.back().tick == tick) {
+            m_segments.back().secondsPerTick = secondsPerTick;
+        } else {
+            m_segments.push_back({ tick, secondsAt(tick), secondsPerTick });
+        }
+    }
+
+    double secondsAt(uint32_t tick) const {
+        auto it = std::upper_bound(m_segments.begin(), m_segments.end(), tick, [](uint32_t t, const Segment &segment) {
+            return t < segment.tick;
+        });
+        const Segment &segment = *(it - 1);
+        return segment.seconds + (tick - segment.tick) * segment.secondsPerTick;
+    }
+};
+
+struct mfiChannelState {
+    uint8_t bank;
+    uint8_t program;
+    uint8_t volume;
+    uint8_t pan;
+    uint16_t pitchBend;
+};
+
+static bool isClass3Event(const mfiEvent &ev, uint8_t eventId) {
+    return ev.eventType == MFI_EVENT_TYPE_B && ev.typeB.eventClass == 3 && ev.typeB.eventId == eventId;
+}
+
+void mfiRenderer::addClip(const int16_t *pcm, size_t numSamples, uint32_t sampleRate, double startSeconds) {
+    if (numSamples == 0) return;
+
+    // linear interpolation is enough for 8 kHz speech and effects
+    mfiRenderClip clip;
+    clip.startFrame  = (uint32_t)std::min(llround(startSeconds * m_sampleRate), (long long)UINT32_MAX);
+    size_t numFrames = (size_t)((double)numSamples * m_sampleRate / sampleRate);
+    double step      = (double)sampleRate / m_sampleRate;
+    clip.samples.resize(numFrames);
+    for (size_t i = 0; i < numFrames; i++) {
+        double pos      = i * step;
+        size_t j        = (size_t)pos;
+        float frac      = (float)(pos - j);
+        float a         = pcm[std::min(j, numSamples - 1)];
+        float b         = pcm[std::min(j + 1, numSamples - 1)];
+        clip.samples[i] = (a + (b - a) * frac) / 32768.0f;
+    }
+    m_clips.push_back(std::move(clip));
+}
+
+void mfiRenderer::collectVoices(const mfiSong &song) {
+    m_voices.clear();
+
+    // tempo and master volume apply to the whole song, so they are gathered from all tracks first
+    std::vector<std::pair<uint32_t, uint8_t>> tempos;
+    std::vector<std::pair<uint32_t, uint8_t>> masterVolumes;
+    for (const mfiTrack &track : song.m_tracks) {
+        uint32_t tick = 0;
+        for (const mfiEvent &ev : track) {
+            tick += ev.deltaTime;
+            if (mfiMidiWriter::isTimebaseEvent(ev) && ev.typeB.data != 0) {
+                tempos.push_back({ tick, ev.typeB.data });
+            } else if (isClass3Event(ev, 0xB0)) {
+                masterVolumes.push_back({ tick, ev.typeB.data });
+            }
+        }
+    }
+    auto byTick = [](const std::pair<uint32_t, uint8_t> &a, const std::pair<uint32_t, uint8_t> &b) {
+        return a.first < b.first;
+    };
+    std::stable_sort(tempos.begin(), tempos.end(), byTick);
+    std::stable_sort(masterVolumes.begin(), masterVolumes.end(), byTick);
+
+    mfiTempoMap tempoMap(mfiMidiWriter::songTimebase(&song));
+    for (const auto &tempo : tempos) {
+        tempoMap.setTempo(tempo.first, tempo.second);
+    }
+
+    double maxFrames = (double)MFI_RENDER_MAX_SECONDS * m_sampleRate;
+    auto frameAt     = [&](uint32_t tick) {
+        return std::min(tempoMap.secondsAt(tick) * m_sampleRate, maxFrames);
+    };
+    auto masterVolumeAt = [&](uint32_t tick) {
+        auto it = std::upper_bound(masterVolumes.begin(), masterVolumes.end(), std::make_pair(tick, (uint8_t)0xFF));
+        return it == masterVolumes.begin() ? 127 : std::min<int>((it - 1)->second, 127);
+    };
+
+    size_t numDropped = 0;
+    for (const mfiTrack &track : song.m_tracks) {
+        // banks start over on every track, as they do in mfiMidiWriter
+        mfiChannelState channels[4];
+        std::fill(std::begin(channels), std::end(channels), mfiChannelState{ 0, 0, 100, 64, 8192 });
+
+        uint32_t tick = 0;
+        for (const mfiEvent &ev : track) {
+            tick += ev.deltaTime;
+
+            if (ev.eventType == MFI_EVENT_TYPE_B && ev.typeB.eventClass == 3) {
+                mfiChannelState &channel = channels[ev.typeB.data >> 6];
+                uint8_t value            = ev.typeB.data & 0x3F;
+                switch (ev.typeB.eventId) {
+                case 0xE0:
+                    channel.program = channel.bank == 3 ? value + 64 : value;
+                    break;
+                case 0xE1:
+                    channel.bank = value;
+                    break;
+                case 0xE2:
+                    channel.volume = value * 2;
+                    break;
+                case 0xE3:
+                    channel.pan = value * 2;
+                    break;
+                case 0xE4:
+                    channel.pitchBend = value << 8;
+                    break;
+                default: break;
+                }
+                continue;
+            }
+            if (ev.eventType != MFI_EVENT_TYPE_NOTE) continue;
+
+            int key = ev.note.key + 45;
+            switch (ev.note.octaveShift) {
+            case 1:
+                key += 12;
+                break;
+            case 2:
+                key -= 24;
+                break;
+            case 3:
+                key -= 12;
+                break;
+            default: break;
+            }
+
+            const mfiChannelState &channel = channels[ev.note.channel & 3];
+            double bend                    = (channel.pitchBend - 8192) / 4096.0; // +-2 semitones
+            double frequency               = 440.0 * pow(2.0, (key + bend - 69) / 12.0);
+            double startFrame              = frameAt(tick);
+            double endFrame                = frameAt(tick + ev.note.gateTime);
+
+            // the MIDI writer would emit these as broken or aliasing notes too
+            if (key < 0 || key > 127 || frequency >= m_sampleRate / 2.0 || startFrame >= maxFrames) {
+                numDropped++;
+                continue;
+            }
+
+            float velocity = ev.note.velocity * 2 / 127.0f;
+            float volume   = channel.volume / 127.0f;
+            float gain     = VOICE_GAIN * velocity * volume * volume * masterVolumeAt(tick) / 127.0f;
+            double angle   = channel.pan / 127.0 * PI / 2;
+
+            mfiRenderVoice voice;
+            voice.startFrame = (uint32_t)startFrame;
+            voice.endFrame   = (uint32_t)endFrame;
+            voice.phaseStep  = (float)(frequency / m_sampleRate);
+            voice.gainLeft   = gain * (float)cos(angle);
+            voice.gainRight  = gain * (float)sin(angle);
+            voice.family     = (channel.program & 0x7F) >> 3;
+            m_voices.push_back(voice);
+        }
+    }
+
+    if (numDropped) {
+        MFI_LOG(MFI_LOG_INFO, "%zu notes out of range not rendered\n", numDropped);
+    }
+}
+
+// Writes the frames of voice that fall into the block starting at
+// blockStart to out[*first..*last), the rest of out is left alone.
+static void renderVoice(const mfiRenderVoice &voice, const mfiEnvelope &env, uint32_t blockStart, float *out, uint32_t *first, uint32_t *last) {
+    const float *table = wavetables().tables[voice.family];
+
+    uint32_t voiceEnd = voice.endFrame + env.releaseFrames;
+    uint32_t begin    = std::max(voice.startFrame, blockStart);
+    uint32_t end      = std::min(voiceEnd, blockStart + BLOCK_FRAMES);
+    *first            = begin - blockStart;
+    *last             = end - blockStart;
+
+    // the phase is recomputed from the note-on, so blocks don't depend on each other
+    double startPhase = (double)voice.phaseStep * (begin - voice.startFrame);
+    float phase       = (float)(startPhase - floor(startPhase));
+    float step        = voice.phaseStep;
+    auto sample       = [&]() {
+        float pos  = phase * TABLE_SIZE;
+        uint32_t i = std::min((uint32_t)pos, TABLE_SIZE - 1);
+        float frac = pos - i;
+        phase += step;
+        if (phase >= 1.0f) phase -= 1.0f;
+        return table[i] + (table[i + 1] - table[i]) * frac;
+    };
+
+    uint32_t heldFrames = voice.endFrame - voice.startFrame;
+    uint32_t frame      = begin;
+
+    // attack
+    uint32_t attackEnd = std::min(end, voice.startFrame + std::min(env.attackFrames, heldFrames));
+    for (; frame < attackEnd; frame++) {
+        out[frame - blockStart] = sample() * ((float)(frame - voice.startFrame) / env.attackFrames);
+    }
+
+    // decay towards the sustain level, one multiply per frame
+    uint32_t heldEnd = std::min(end, voice.endFrame);
+    if (frame < heldEnd) {
+        float decay = env.heldLevel(frame - voice.startFrame) - env.sustain;
+        for (; frame < heldEnd; frame++) {
+            out[frame - blockStart] = sample() * (env.sustain + decay);
+            decay *= env.decayPerFrame;
+        }
+    }
+
+    // release from wherever the note was at its note-off
+    if (frame < end) {
+        float releaseLevel = env.heldLevel(heldFrames);
+        float releaseStep  = releaseLevel / env.releaseFrames;
+        float level        = releaseLevel - releaseStep * (frame - voice.endFrame);
+        for (; frame < end; frame++) {
+            out[frame - blockStart] = sample() * std::max(level, 0.0f);
+            level -= releaseStep;
+        }
+    }
+}
+
+// left += mono * gainLeft, right += mono * gainRight
+static void mixVoice(const float *mono, size_t n, float gainLeft, float gainRight, float *left, float *right) {
+    size_t i = 0;
+#if MFI_RENDER_SSE2
+    __m128 gl = _mm_set1_ps(gainLeft);
+    __m128 gr = _mm_set1_ps(gainRight);
+    for (; i + 4 <= n; i += 4) {
+        __m128 s = _mm_loadu_ps(mono + i);
+        _mm_storeu_ps(left + i, _mm_add_ps(_mm_loadu_ps(left + i), _mm_mul_ps(s, gl)));
+        _mm_storeu_ps(right + i, _mm_add_ps(_mm_loadu_ps(right + i), _mm_mul_ps(s, gr)));
+    }
+#endif
+    for (; i < n; i++) {
+        left[i] += mono[i] * gainLeft;
+        right[i] += mono[i] * gainRight;
+    }
+}
+
+// clamps to [-1, 1], scales and interleaves into 16-bit frames
+static void storeFrames(const float *left, const float *right, size_t n, int16_t *out) {
+    size_t i = 0;
+#if MFI_RENDER_SSE2
+    __m128 scale = _mm_set1_ps(32767.0f);
+    __m128 lo    = _mm_set1_ps(-1.0f);
+    __m128 hi    = _mm_set1_ps(1.0f);
+    for (; i + 4 <= n; i += 4) {
+        __m128i l = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(left + i), lo), hi), scale));
+        __m128i r = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(right + i), lo), hi), scale));
+        __m128i frames = _mm_packs_epi32(_mm_unpacklo_epi32(l, r), _mm_unpackhi_epi32(l, r));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * i), frames);
+    }
+#endif
+    for (; i < n; i++) {
+        out[2 * i]     = (int16_t)lrintf(std::clamp(left[i], -1.0f, 1.0f) * 32767.0f);
+        out[2 * i + 1] = (int16_t)lrintf(std::clamp(right[i], -1.0f, 1.0f) * 32767.0f);
+    }
+}
+
+void mfiRenderer::render(const mfiSong &song, std::vector<int16_t> *pcm) {
+    collectVoices(song);
+
+    mfiEnvelope envelopes[NUM_FAMILIES];
+    for (uint32_t family = 0; family < NUM_FAMILIES; family++) {
+        const mfiEnvelopeShape &shape = s_envelopes[family];
+        envelopes[family].attackFrames  = std::max(1u, (uint32_t)(shape.attackSeconds * m_sampleRate));
+        envelopes[family].decayPerFrame = (float)exp(-1.0 / (shape.decaySeconds * m_sampleRate));
+        envelopes[family].sustain       = shape.sustain;
+        envelopes[family].releaseFrames = std::max(1u, (uint32_t)(shape.releaseSeconds * m_sampleRate));
+    }
+
+    uint32_t numFrames = 0;
+    for (const mfiRenderVoice &voice : m_voices) {
+        numFrames = std::max(numFrames, voice.endFrame + envelopes[voice.family].releaseFrames);
+    }
+    for (const mfiRenderClip &clip : m_clips) {
+        numFrames = std::max<uint64_t>(numFrames, std::min<uint64_t>((uint64_t)clip.startFrame + clip.samples.size(), UINT32_MAX));
+    }
+    numFrames = std::min(numFrames, MFI_RENDER_MAX_SECONDS * m_sampleRate);
+
+    // every block's voices, as offsets into one array
+    size_t numBlocks = (numFrames + BLOCK_FRAMES - 1) / BLOCK_FRAMES;
+    std::vector<uint32_t> blockStarts(numBlocks + 1, 0);
+    auto blockRange = [&](const mfiRenderVoice &voice, size_t *firstBlock, size_t *lastBlock) {
+        uint32_t end = std::min(voice.endFrame + envelopes[voice.family].releaseFrames, numFrames);
+        *firstBlock  = voice.startFrame / BLOCK_FRAMES;
+        *lastBlock   = end > voice.startFrame ? (end - 1) / BLOCK_FRAMES + 1 : *firstBlock;
+    };
+    for (const mfiRenderVoice &voice : m_voices) {
+        size_t firstBlock, lastBlock;
+        blockRange(voice, &firstBlock, &lastBlock);
+        for (size_t block = firstBlock; block < lastBlock; block++) {
+            blockStarts[block + 1]++;
+        }
+    }
+    for (size_t block = 0; block < numBlocks; block++) {
+        blockStarts[block + 1] += blockStarts[block];
+    }
+    std::vector<uint32_t> blockVoices(blockStarts[numBlocks]);
+    std::vector<uint32_t> fill(blockStarts.begin(), blockStarts.end() - 1);
+    for (uint32_t index = 0; index < m_voices.size(); index++) {
+        size_t firstBlock, lastBlock;
+        blockRange(m_voices[index], &firstBlock, &lastBlock);
+        for (size_t block = firstBlock; block < lastBlock; block++) {
+            blockVoices[fill[block]++] = index;
+        }
+    }
+
+    pcm->resize(2 * (size_t)numFrames);
+    int16_t *out = pcm->data();
+
+    std::atomic<size_t> nextBlock{ 0 };
+    auto worker = [&]() {
+        float left[BLOCK_FRAMES];
+        float right[BLOCK_FRAMES];
+        float mono[BLOCK_FRAMES];
+
+        size_t block;
+        while ((block = nextBlock.fetch_add(1, std::memory_order_relaxed)) < numBlocks) {
+            uint32_t blockStart = (uint32_t)(block * BLOCK_FRAMES);
+            uint32_t blockSize  = std::min(BLOCK_FRAMES, numFrames - blockStart);
+            std::fill(left, left + BLOCK_FRAMES, 0.0f);
+            std::fill(right, right + BLOCK_FRAMES, 0.0f);
+
+            for (uint32_t i = blockStarts[block]; i < blockStarts[block + 1]; i++) {
+                const mfiRenderVoice &voice = m_voices[blockVoices[i]];
+                uint32_t first, last;
+                renderVoice(voice, envelopes[voice.family], blockStart, mono, &first, &last);
+                mixVoice(mono + first, last - first, voice.gainLeft, voice.gainRight, left + first, right + first);
+            }
+
+            for (const mfiRenderClip &clip : m_clips) {
+                uint64_t clipEnd = (uint64_t)clip.startFrame + clip.samples.size();
+                uint32_t begin   = std::max(clip.startFrame, blockStart);
+                uint32_t end     = (uint32_t)std::min<uint64_t>(clipEnd, blockStart + blockSize);
+                if (begin >= end) continue;
+                mixVoice(clip.samples.data() + (begin - clip.startFrame), end - begin, 0.7f, 0.7f, left + (begin - blockStart), right + (begin - blockStart));
+            }
+
+            storeFrames(left, right, blockSize, out + 2 * (size_t)blockStart);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min<size_t>(m_numThreads, numBlocks); i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
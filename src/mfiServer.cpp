@@ -0,0 +1,1231 @@
+#include "mfi/mfiServer.h"
+
+#include "mfi/mfiBytes.h"
+#include "mfi/mfiConverter.h"
+#include "mfi/mfiIO.h"
+#include "mfi/mfiLog.h"
+#include "mfi/mfiMfiEncoder.h"
+#include "mfi/mfiMidiReader.h"
+
+#include <algorithm>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET mfiSocket;
+#define MFI_INVALID_SOCKET INVALID_SOCKET
+#else
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+typedef int mfiSocket;
+#define MFI_INVALID_SOCKET (-1)
+#endif
+
+#ifdef __linux__
+#define MFI_HAVE_EPOLL 1
+#include <sys/epoll.h>
+#else
+#define MFI_HAVE_EPOLL 0
+#endif
+
+// a peer that went away must not kill the process with SIGPIPE
+#ifdef MSG_NOSIGNAL
+#define MFI_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define MFI_SEND_FLAGS 0
+#endif
+
+// requests one connection may have waiting for their response
+static constexpr size_t MFI_SERVER_MAX_PIPELINED = 64;
+
+// a connection isn't read while more response bytes than this are unsent
+static constexpr size_t MFI_SERVER_OUTPUT_HIGH_WATER = 4 * 1024 * 1024;
+
+// request line and headers of one HTTP request
+static constexpr size_t MFI_SERVER_MAX_HTTP_HEADER = 16 * 1024;
+
+// the least free space a connection's input buffer is read into
+static constexpr size_t MFI_SERVER_READ_SIZE = 64 * 1024;
+
+// jobs kept for reuse, with their buffers, beyond the ones in use
+static constexpr size_t MFI_SERVER_MAX_FREE_JOBS = 256;
+
+static constexpr size_t MFI_FRAME_HEADER_SIZE = 8;
+
+static void closeSocket(mfiSocket s) {
+#ifdef _WIN32
+    closesocket(s);
+#else
+    close(s);
+#endif
+}
+
+static int socketError() {
+#ifdef _WIN32
+    return WSAGetLastError();
+#else
+    return errno;
+#endif
+}
+
+// the call would have blocked, or was interrupted; try again when the poller says so
+static bool isTransient(int error) {
+#ifdef _WIN32
+    return error == WSAEWOULDBLOCK || error == WSAEINTR;
+#else
+    return error == EAGAIN || error == EWOULDBLOCK || error == EINTR;
+#endif
+}
+
+static std::string describeError(int error) {
+#ifdef _WIN32
+    char text[32];
+    snprintf(text, sizeof(text), "error %d", error);
+    return text;
+#else
+    return strerror(error);
+#endif
+}
+
+// also marks the descriptor close-on-exec on POSIX
+static bool setNonBlocking(mfiSocket s) {
+#ifdef _WIN32
+    u_long on = 1;
+    return ioctlsocket(s, FIONBIO, &on) == 0;
+#else
+    int flags = fcntl(s, F_GETFL);
+    return flags >= 0 && fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0 && fcntl(s, F_SETFD, FD_CLOEXEC) == 0;
+#endif
+}
+
+// bytes received, 0 at the end of the stream, negative on errors (see socketError)
+static long receiveSome(mfiSocket s, uint8_t *data, size_t size) {
+#ifdef _WIN32
+    return recv(s, reinterpret_cast<char *>(data), (int)std::min<size_t>(size, INT_MAX), 0);
+#else
+    return (long)recv(s, data, size, 0);
+#endif
+}
+
+static long sendSome(mfiSocket s, const uint8_t *data, size_t size) {
+#ifdef _WIN32
+    return send(s, reinterpret_cast<const char *>(data), (int)std::min<size_t>(size, INT_MAX), 0);
+#else
+    return (long)send(s, data, size, MFI_SEND_FLAGS);
+#endif
+}
+
+static void shutdownSend(mfiSocket s) {
+#ifdef _WIN32
+    shutdown(s, SD_SEND);
+#else
+    shutdown(s, SHUT_WR);
+#endif
+}
+
+// Both ends nonblocking: [0] for the poller, [1] to wake it. Windows can't
+// poll a pipe, so a loopback connection to ourselves stands in there.
+static bool openWakeFds(intptr_t fds[2]) {
+#ifdef _WIN32
+    mfiSocket listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == MFI_INVALID_SOCKET) return false;
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int addrLen          = sizeof(addr);
+
+    mfiSocket ends[2] = { MFI_INVALID_SOCKET, MFI_INVALID_SOCKET };
+    bool ok           = bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0 && ::listen(listener, 1) == 0;
+    if (ok) ok = getsockname(listener, reinterpret_cast<sockaddr *>(&addr), &addrLen) == 0;
+    if (ok) ok = (ends[1] = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) != MFI_INVALID_SOCKET;
+    if (ok) ok = connect(ends[1], reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0;
+    if (ok) ok = (ends[0] = accept(listener, nullptr, nullptr)) != MFI_INVALID_SOCKET;
+    if (ok) ok = setNonBlocking(ends[0]) && setNonBlocking(ends[1]);
+    closeSocket(listener);
+    if (!ok) {
+        if (ends[0] != MFI_INVALID_SOCKET) closeSocket(ends[0]);
+        if (ends[1] != MFI_INVALID_SOCKET) closeSocket(ends[1]);
+        return false;
+    }
+    fds[0] = (intptr_t)ends[0];
+    fds[1] = (intptr_t)ends[1];
+    return true;
+#else
+    int ends[2];
+    if (pipe(ends) != 0) return false;
+    if (!setNonBlocking(ends[0]) || !setNonBlocking(ends[1])) {
+        close(ends[0]);
+        close(ends[1]);
+        return false;
+    }
+    fds[0] = ends[0];
+    fds[1] = ends[1];
+    return true;
+#endif
+}
+
+static void closeWakeFd(intptr_t fd) {
+    if (fd == -1) return;
+#ifdef _WIN32
+    closesocket((mfiSocket)fd);
+#else
+    close((int)fd);
+#endif
+}
+
+// async-signal-safe; a full pipe means a wakeup is pending anyway
+static void signalWakeFd(intptr_t fd) {
+    uint8_t byte = 1;
+#ifdef _WIN32
+    send((mfiSocket)fd, reinterpret_cast<const char *>(&byte), 1, 0);
+#else
+    while (write((int)fd, &byte, 1) < 0 && errno == EINTR) {
+    }
+#endif
+}
+
+static void drainWakeFd(intptr_t fd) {
+    uint8_t bytes[64];
+#ifdef _WIN32
+    while (receiveSome((mfiSocket)fd, bytes, sizeof(bytes)) > 0) {
+    }
+#else
+    while (read((int)fd, bytes, sizeof(bytes)) > 0) {
+    }
+#endif
+}
+
+enum : uint8_t {
+    MFI_POLL_IN     = 1,
+    MFI_POLL_OUT    = 2,
+    MFI_POLL_HANGUP = 4, // failed or shut down both ways; only closing it is left
+};
+
+struct mfiPollEvent {
+    void *tag;
+    uint8_t events;
+};
+
+// Level-triggered readiness for a set of sockets, each registered with a
+// tag that comes back with its events.
+class mfiPoller {
+public:
+    virtual ~mfiPoller() = default;
+
+    virtual const char *name() const = 0;
+
+    virtual bool add(mfiSocket s, void *tag, uint8_t events)    = 0;
+    virtual void modify(mfiSocket s, void *tag, uint8_t events) = 0;
+    virtual void remove(mfiSocket s)                            = 0;
+
+    // blocks until a socket is ready or a signal arrives; false if waiting itself failed
+    virtual bool wait(std::vector<mfiPollEvent> *ready) = 0;
+};
+
+#if MFI_HAVE_EPOLL
+
+class mfiEpollPoller : public mfiPoller {
+    int m_epollFd;
+    std::vector<epoll_event> m_events;
+
+public:
+    mfiEpollPoller()
+        : m_epollFd(epoll_create1(EPOLL_CLOEXEC)),
+          m_events(256) {
+    }
+
+    ~mfiEpollPoller() override {
+        if (m_epollFd >= 0) close(m_epollFd);
+    }
+
+    bool isOpen() const {
+        return m_epollFd >= 0;
+    }
+
+    const char *name() const override {
+        return "epoll";
+    }
+
+    bool add(mfiSocket s, void *tag, uint8_t events) override {
+        return control(EPOLL_CTL_ADD, s, tag, events);
+    }
+
+    void modify(mfiSocket s, void *tag, uint8_t events) override {
+        control(EPOLL_CTL_MOD, s, tag, events);
+    }
+
+    void remove(mfiSocket s) override {
+        epoll_ctl(m_epollFd, EPOLL_CTL_DEL, s, nullptr);
+    }
+
+    bool wait(std::vector<mfiPollEvent> *ready) override {
+        int count = epoll_wait(m_epollFd, m_events.data(), (int)m_events.size(), -1);
+        if (count < 0) {
+            if (errno == EINTR) return true;
+            MFI_LOG(MFI_LOG_ERROR, "epoll_wait failed: %s\n", strerror(errno));
+            return false;
+        }
+        for (int i = 0; i < count; i++) {
+            uint32_t flags = m_events[i].events;
+            uint8_t events = 0;
+            if (flags & EPOLLIN) events |= MFI_POLL_IN;
+            if (flags & EPOLLOUT) events |= MFI_POLL_OUT;
+            if (flags & (EPOLLERR | EPOLLHUP)) events |= MFI_POLL_HANGUP;
+            ready->push_back({ m_events[i].data.ptr, events });
+        }
+        return true;
+    }
+
+private:
+    bool control(int op, mfiSocket s, void *tag, uint8_t events) {
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        if (events & MFI_POLL_IN) ev.events |= EPOLLIN;
+        if (events & MFI_POLL_OUT) ev.events |= EPOLLOUT;
+        ev.data.ptr = tag;
+        if (epoll_ctl(m_epollFd, op, s, &ev) == 0) return true;
+        MFI_LOG(MFI_LOG_ERROR, "epoll_ctl failed: %s\n", strerror(errno));
+        return false;
+    }
+};
+
+#endif
+
+// poll() or WSAPoll() over an array rebuilt in place as sockets come and go
+class mfiPollPoller : public mfiPoller {
+    std::vector<pollfd> m_fds;
+    std::vector<void *> m_tags;
+    std::unordered_map<mfiSocket, size_t> m_indexes;
+
+public:
+    const char *name() const override {
+#ifdef _WIN32
+        return "WSAPoll";
+#else
+        return "poll";
+#endif
+    }
+
+    bool add(mfiSocket s, void *tag, uint8_t events) override {
+        m_indexes[s] = m_fds.size();
+        m_fds.push_back({ s, pollEvents(events), 0 });
+        m_tags.push_back(tag);
+        return true;
+    }
+
+    void modify(mfiSocket s, void *tag, uint8_t events) override {
+        size_t index        = m_indexes.at(s);
+        m_fds[index].events = pollEvents(events);
+        m_tags[index]       = tag;
+    }
+
+    void remove(mfiSocket s) override {
+        auto it = m_indexes.find(s);
+        if (it == m_indexes.end()) return;
+        size_t index = it->second;
+        m_indexes.erase(it);
+        if (index + 1 != m_fds.size()) {
+            m_fds[index]               = m_fds.back();
+            m_tags[index]              = m_tags.back();
+            m_indexes[m_fds[index].fd] = index;
+        }
+        m_fds.pop_back();
+        m_tags.pop_back();
+    }
+
+    bool wait(std::vector<mfiPollEvent> *ready) override {
+#ifdef _WIN32
+        int count = WSAPoll(m_fds.data(), (ULONG)m_fds.size(), -1);
+#else
+        int count = poll(m_fds.data(), (nfds_t)m_fds.size(), -1);
+#endif
+        if (count < 0) {
+            int error = socketError();
+            if (isTransient(error)) return true;
+            MFI_LOG(MFI_LOG_ERROR, "poll failed: %s\n", describeError(error).c_str());
+            return false;
+        }
+        for (size_t i = 0; i < m_fds.size() && count > 0; i++) {
+            short flags = m_fds[i].revents;
+            if (!flags) continue;
+            count--;
+            uint8_t events = 0;
+            if (flags & POLLIN) events |= MFI_POLL_IN;
+            if (flags & POLLOUT) events |= MFI_POLL_OUT;
+            if (flags & (POLLERR | POLLHUP | POLLNVAL)) events |= MFI_POLL_HANGUP;
+            ready->push_back({ m_tags[i], events });
+        }
+        return true;
+    }
+
+private:
+    static short pollEvents(uint8_t events) {
+        return (short)((events & MFI_POLL_IN ? POLLIN : 0) | (events & MFI_POLL_OUT ? POLLOUT : 0));
+    }
+};
+
+static std::unique_ptr<mfiPoller> createPoller() {
+#if MFI_HAVE_EPOLL
+    auto epoll = std::make_unique<mfiEpollPoller>();
+    if (epoll->isOpen()) return epoll;
+    MFI_LOG(MFI_LOG_WARN, "epoll unavailable (%s), using poll\n", strerror(errno));
+#endif
+    return std::make_unique<mfiPollPoller>();
+}
+
+struct mfiServerConnection;
+
+// one request, from the moment it is parsed until its response is queued
+struct mfiServerJob {
+    mfiServerConnection *connection = nullptr;
+    uint8_t op                      = 0;
+    mfiServerStatus status          = MFI_SERVER_OK;
+    bool http                       = false;
+    bool closeAfter                 = false; // the connection closes once this is answered
+    bool done                       = false; // converted, or refused without converting
+    const char *httpStatus          = nullptr; // for refused HTTP requests, e.g. "404 Not Found"
+
+    std::vector<uint8_t> input;
+    std::vector<uint8_t> output;
+};
+
+enum mfiServerProtocol : uint8_t {
+    MFI_PROTOCOL_UNKNOWN, // nothing received yet
+    MFI_PROTOCOL_FRAMES,
+    MFI_PROTOCOL_HTTP,
+};
+
+struct mfiServerConnection {
+    mfiSocket socket           = MFI_INVALID_SOCKET; // invalid once closed
+    size_t index               = 0;                  // in mfiServerLoop::m_connections
+    mfiServerProtocol protocol = MFI_PROTOCOL_UNKNOWN;
+    uint8_t pollEvents         = 0;
+
+    bool needsInput   = true;  // the parser is waiting for more bytes, not held back
+    bool endOfInput   = false; // the peer shut down its sending side
+    bool closing      = false; // no more requests are taken; closes once answered
+    bool lingering    = false; // answered and shut down; draining input until the peer closes
+    bool continueSent = false; // HTTP: 100 Continue went out for the request being received
+
+    std::vector<uint8_t> input; // unparsed bytes are [inputStart, inputEnd)
+    size_t inputStart = 0;
+    size_t inputEnd   = 0;
+
+    std::vector<uint8_t> output; // unsent bytes are [outputDone, output.size())
+    size_t outputDone = 0;
+
+    // In request order. Owns the jobs, also while a worker converts one, so
+    // a closed connection lives on until its last job comes back.
+    std::deque<mfiServerJob *> jobs;
+};
+
+static bool equalsIgnoreCase(const char *a, size_t aLen, const char *b) {
+    size_t bLen = strlen(b);
+    if (aLen != bLen) return false;
+    for (size_t i = 0; i < aLen; i++) {
+        if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return false;
+    }
+    return true;
+}
+
+static bool containsIgnoreCase(const char *a, size_t aLen, const char *b) {
+    size_t bLen = strlen(b);
+    for (size_t i = 0; i + bLen <= aLen; i++) {
+        if (equalsIgnoreCase(a + i, bLen, b)) return true;
+    }
+    return false;
+}
+
+// the first CR LF in [p, end), or null
+static const char *findLineEnd(const char *p, const char *end) {
+    for (; p + 1 < end; p++) {
+        if (p[0] == '\r' && p[1] == '\n') return p;
+    }
+    return nullptr;
+}
+
+static void appendString(std::vector<uint8_t> *out, const char *str) {
+    out->insert(out->end(), str, str + strlen(str));
+}
+
+// what a worker thread keeps between requests
+struct mfiServerWorker {
+    mfiConverter converter;
+    mfiMfiEncoder encoder;
+    mfiBufferWriter mfiOutput;
+
+    void convert(mfiServerJob *job) {
+        bool ok;
+        if (job->op == MFI_SERVER_OP_TO_MIDI) {
+            ok = converter.convert(job->input.data(), job->input.size());
+            if (ok) converter.takeOutput(&job->output);
+        } else {
+            mfiBufferReader rd(job->input.data(), job->input.size());
+            encoder.reset();
+            mfiOutput.clear();
+            ok = mfiMidiReader(&rd).readFile(&encoder) && encoder.finish(&mfiOutput);
+            if (ok) mfiOutput.takeBuffer(&job->output);
+        }
+        job->status = ok ? MFI_SERVER_OK : MFI_SERVER_BAD_INPUT;
+    }
+};
+
+// Everything run() needs, torn down when it returns. Connections and jobs
+// are only touched on the loop thread, except for a job a worker holds.
+class mfiServerLoop {
+    mfiSocket m_listenSocket;
+    intptr_t m_wakeFd;
+    intptr_t m_wakeSignalFd;
+    unsigned m_maxInFlight;
+    size_t m_maxRequestSize;
+    mfiConversionCache *m_cache;
+    std::atomic<bool> *m_stopRequested;
+
+    std::unique_ptr<mfiPoller> m_poller;
+    char m_listenTag;
+    char m_wakeTag;
+    bool m_listenPaused;
+
+    std::vector<mfiServerConnection *> m_connections;
+    std::vector<mfiServerConnection *> m_closed; // waiting for their last jobs
+    std::vector<mfiServerJob *> m_freeJobs;
+    size_t m_numQueued; // jobs handed to the workers and not back yet
+
+    // the workers' side
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<mfiServerJob *> m_queue;
+    std::vector<mfiServerJob *> m_completed;
+    bool m_stopWorkers;
+    std::vector<std::thread> m_workers;
+
+    std::vector<mfiServerJob *> m_completedLocal;
+
+    size_t m_numRequests;
+    size_t m_numConnections;
+
+public:
+    mfiServerLoop(mfiSocket listenSocket, const intptr_t wakeFds[2], unsigned maxInFlight, size_t maxRequestSize,
+        mfiConversionCache *cache, std::atomic<bool> *stopRequested)
+        : m_listenSocket(listenSocket),
+          m_wakeFd(wakeFds[0]),
+          m_wakeSignalFd(wakeFds[1]),
+          m_maxInFlight(maxInFlight),
+          m_maxRequestSize(maxRequestSize),
+          m_cache(cache),
+          m_stopRequested(stopRequested),
+          m_poller(createPoller()),
+          m_listenTag(0),
+          m_wakeTag(0),
+          m_listenPaused(false),
+          m_numQueued(0),
+          m_stopWorkers(false),
+          m_numRequests(0),
+          m_numConnections(0) {
+    }
+
+    ~mfiServerLoop() {
+        stopWorkers();
+        for (mfiServerConnection *conn : m_connections) {
+            if (conn->socket != MFI_INVALID_SOCKET) {
+                m_poller->remove(conn->socket);
+                closeSocket(conn->socket);
+            }
+            for (mfiServerJob *job : conn->jobs) {
+                delete job;
+            }
+            delete conn;
+        }
+        for (mfiServerJob *job : m_freeJobs) {
+            delete job;
+        }
+        m_poller->remove(m_listenSocket);
+        m_poller->remove((mfiSocket)m_wakeFd);
+    }
+
+    const char *backendName() const {
+        return m_poller->name();
+    }
+
+    bool run(unsigned numWorkers) {
+        if (!m_poller->add(m_listenSocket, &m_listenTag, MFI_POLL_IN)) return false;
+        if (!m_poller->add((mfiSocket)m_wakeFd, &m_wakeTag, MFI_POLL_IN)) return false;
+        for (unsigned i = 0; i < numWorkers; i++) {
+            m_workers.emplace_back([this]() { work(); });
+        }
+        MFI_LOG(MFI_LOG_INFO, "serving with %s and %u workers, up to %u requests in flight\n",
+            m_poller->name(), numWorkers, m_maxInFlight);
+
+        bool ok = true;
+        std::vector<mfiPollEvent> ready;
+        while (!m_stopRequested->load()) {
+            ready.clear();
+            if (!m_poller->wait(&ready)) {
+                ok = false;
+                break;
+            }
+            for (const mfiPollEvent &ev : ready) {
+                if (ev.tag == &m_listenTag) {
+                    acceptConnections();
+                } else if (ev.tag == &m_wakeTag) {
+                    drainWakeFd(m_wakeFd);
+                    takeCompleted();
+                } else {
+                    handleEvents(static_cast<mfiServerConnection *>(ev.tag), ev.events);
+                }
+            }
+            deleteClosed();
+        }
+
+        MFI_LOG(MFI_LOG_INFO, "served %zu requests on %zu connections\n", m_numRequests, m_numConnections);
+        return ok;
+    }
+
+private:
+    void work() {
+        mfiServerWorker worker;
+        worker.converter.setCache(m_cache);
+        for (;;) {
+            mfiServerJob *job;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [this]() { return m_stopWorkers || !m_queue.empty(); });
+                if (m_stopWorkers) return;
+                job = m_queue.front();
+                m_queue.pop_front();
+            }
+
+            worker.convert(job);
+
+            bool wake;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                wake = m_completed.empty();
+                m_completed.push_back(job);
+            }
+            // one byte per batch of completions, not per job
+            if (wake) signalWakeFd(m_wakeSignalFd);
+        }
+    }
+
+    void stopWorkers() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopWorkers = true;
+        }
+        m_cv.notify_all();
+        for (std::thread &thread : m_workers) {
+            thread.join();
+        }
+        m_workers.clear();
+    }
+
+    void submit(mfiServerJob *job) {
+        m_numQueued++;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queue.push_back(job);
+        }
+        m_cv.notify_one();
+    }
+
+    void takeCompleted() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_completedLocal.swap(m_completed);
+        }
+        if (m_completedLocal.empty()) return;
+
+        bool wasFull = m_numQueued >= m_maxInFlight;
+        m_numQueued -= m_completedLocal.size();
+        for (mfiServerJob *job : m_completedLocal) {
+            job->done                 = true;
+            mfiServerConnection *conn = job->connection;
+            if (conn->socket == MFI_INVALID_SOCKET) {
+                conn->jobs.erase(std::find(conn->jobs.begin(), conn->jobs.end(), job));
+                recycleJob(job);
+            } else if (!wasFull && job == conn->jobs.front()) {
+                service(conn);
+            }
+        }
+        m_completedLocal.clear();
+
+        // every connection may have held back requests while the queue was full
+        if (wasFull) {
+            for (size_t i = 0; i < m_connections.size(); i++) {
+                if (m_connections[i]->socket != MFI_INVALID_SOCKET) service(m_connections[i]);
+            }
+        }
+    }
+
+    mfiServerJob *newJob(mfiServerConnection *conn) {
+        mfiServerJob *job;
+        if (m_freeJobs.empty()) {
+            job = new mfiServerJob;
+        } else {
+            job = m_freeJobs.back();
+            m_freeJobs.pop_back();
+        }
+        job->connection = conn;
+        job->status     = MFI_SERVER_OK;
+        job->http       = conn->protocol == MFI_PROTOCOL_HTTP;
+        job->closeAfter = false;
+        job->done       = false;
+        job->httpStatus = nullptr;
+        conn->jobs.push_back(job);
+        m_numRequests++;
+        return job;
+    }
+
+    void recycleJob(mfiServerJob *job) {
+        if (m_freeJobs.size() >= MFI_SERVER_MAX_FREE_JOBS) {
+            delete job;
+            return;
+        }
+        job->input.clear();
+        job->output.clear();
+        m_freeJobs.push_back(job);
+    }
+
+    // answers without converting and takes no more requests on the connection
+    void refuse(mfiServerConnection *conn, const char *httpStatus) {
+        mfiServerJob *job = newJob(conn);
+        job->status       = MFI_SERVER_BAD_REQUEST;
+        job->httpStatus   = httpStatus;
+        job->closeAfter   = true;
+        job->done         = true;
+        conn->closing     = true;
+        MFI_LOG(MFI_LOG_INFO, "refused a request: %s\n", job->http ? httpStatus : "bad frame header");
+    }
+
+    void acceptConnections() {
+        for (;;) {
+            mfiSocket s = accept(m_listenSocket, nullptr, nullptr);
+            if (s == MFI_INVALID_SOCKET) {
+                int error = socketError();
+                if (isTransient(error)) return;
+#ifndef _WIN32
+                if (error == ECONNABORTED) continue;
+#endif
+                // most likely out of file descriptors: wait for a connection to close
+                MFI_LOG(MFI_LOG_WARN, "accept failed: %s\n", describeError(error).c_str());
+                m_poller->modify(m_listenSocket, &m_listenTag, 0);
+                m_listenPaused = true;
+                return;
+            }
+
+            int one = 1;
+            setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&one), sizeof(one));
+            auto *conn       = new mfiServerConnection;
+            conn->socket     = s;
+            conn->index      = m_connections.size();
+            conn->pollEvents = MFI_POLL_IN;
+            if (!setNonBlocking(s) || !m_poller->add(s, conn, MFI_POLL_IN)) {
+                closeSocket(s);
+                delete conn;
+                continue;
+            }
+            m_connections.push_back(conn);
+            m_numConnections++;
+        }
+    }
+
+    void handleEvents(mfiServerConnection *conn, uint8_t events) {
+        if (conn->socket == MFI_INVALID_SOCKET) return; // closed earlier in this batch
+
+        if (events & MFI_POLL_HANGUP) {
+            closeConnection(conn);
+            return;
+        }
+        if (events & MFI_POLL_IN) {
+            if (!readInput(conn)) return;
+        }
+        service(conn);
+    }
+
+    // false if the connection was closed
+    bool readInput(mfiServerConnection *conn) {
+        if (conn->lingering) {
+            conn->inputStart = 0;
+            conn->inputEnd   = 0;
+        }
+        if (conn->input.size() - conn->inputEnd < MFI_SERVER_READ_SIZE) {
+            // move the unparsed bytes to the front, grow if that doesn't free enough
+            size_t unparsed = conn->inputEnd - conn->inputStart;
+            if (unparsed) memmove(conn->input.data(), conn->input.data() + conn->inputStart, unparsed);
+            conn->inputStart = 0;
+            conn->inputEnd   = unparsed;
+            if (conn->input.size() - unparsed < MFI_SERVER_READ_SIZE) {
+                conn->input.resize(std::max(unparsed + MFI_SERVER_READ_SIZE, 2 * conn->input.size()));
+            }
+        }
+
+        long count = receiveSome(conn->socket, conn->input.data() + conn->inputEnd, conn->input.size() - conn->inputEnd);
+        if (count > 0) {
+            if (!conn->lingering) conn->inputEnd += (size_t)count; // lingering: dropped
+            return true;
+        }
+        if (count < 0) {
+            int error = socketError();
+            if (isTransient(error)) return true;
+            MFI_LOG(MFI_LOG_INFO, "connection failed: %s\n", describeError(error).c_str());
+        }
+        if (conn->lingering || count < 0) {
+            closeConnection(conn);
+            return false;
+        }
+        conn->endOfInput = true;
+        return true;
+    }
+
+    // Takes the buffered requests the limits allow, queues finished
+    // responses, sends what it can and decides what to wait for next.
+    void service(mfiServerConnection *conn) {
+        if (!conn->lingering) {
+            parseRequests(conn);
+            queueResponses(conn);
+        }
+        if (!flushOutput(conn)) return;
+
+        bool unsent = conn->outputDone < conn->output.size();
+        if (!unsent && conn->jobs.empty() && !conn->lingering) {
+            if (conn->closing && !conn->endOfInput) {
+                // unread input would make closing reset the connection, and
+                // the client could lose the last response: drain it first
+                shutdownSend(conn->socket);
+                conn->lingering = true;
+            } else if (conn->closing || (conn->endOfInput && conn->needsInput)) {
+                closeConnection(conn);
+                return;
+            }
+        }
+
+        bool backedUp  = conn->output.size() - conn->outputDone >= MFI_SERVER_OUTPUT_HIGH_WATER;
+        bool wantRead  = conn->lingering || (!conn->closing && !conn->endOfInput && conn->needsInput && !backedUp);
+        uint8_t events = (wantRead ? MFI_POLL_IN : 0) | (unsent ? MFI_POLL_OUT : 0);
+        if (events != conn->pollEvents) {
+            m_poller->modify(conn->socket, conn, events);
+            conn->pollEvents = events;
+        }
+    }
+
+    void parseRequests(mfiServerConnection *conn) {
+        conn->needsInput = false;
+        while (!conn->closing && conn->jobs.size() < MFI_SERVER_MAX_PIPELINED && m_numQueued < m_maxInFlight) {
+            size_t available = conn->inputEnd - conn->inputStart;
+            if (conn->protocol == MFI_PROTOCOL_UNKNOWN) {
+                if (available < 2) {
+                    conn->needsInput = true;
+                    return;
+                }
+                const uint8_t *p = conn->input.data() + conn->inputStart;
+                conn->protocol   = p[0] == 'M' && p[1] == 'F' ? MFI_PROTOCOL_FRAMES : MFI_PROTOCOL_HTTP;
+            }
+
+            bool parsed = conn->protocol == MFI_PROTOCOL_FRAMES ? parseFrame(conn) : parseHttpRequest(conn);
+            if (!parsed) {
+                conn->needsInput = !conn->closing;
+                return;
+            }
+        }
+    }
+
+    // makes sure the input buffer can hold a request of size bytes from inputStart
+    void expectInput(mfiServerConnection *conn, size_t size) {
+        if (conn->input.size() - conn->inputStart < size) {
+            size_t unparsed = conn->inputEnd - conn->inputStart;
+            if (unparsed) memmove(conn->input.data(), conn->input.data() + conn->inputStart, unparsed);
+            conn->inputStart = 0;
+            conn->inputEnd   = unparsed;
+            if (conn->input.size() < size) conn->input.resize(size);
+        }
+    }
+
+    // false if the frame isn't all there yet, or the connection stopped taking requests
+    bool parseFrame(mfiServerConnection *conn) {
+        size_t available = conn->inputEnd - conn->inputStart;
+        if (available < MFI_FRAME_HEADER_SIZE) return false;
+
+        const uint8_t *p = conn->input.data() + conn->inputStart;
+        uint8_t op       = p[2];
+        uint32_t size    = mfiLoadBE32(p + 4);
+        if (p[0] != 'M' || p[1] != 'F' || (op != MFI_SERVER_OP_TO_MIDI && op != MFI_SERVER_OP_TO_MFI) || p[3] != 0 || size > m_maxRequestSize) {
+            refuse(conn, nullptr);
+            return false;
+        }
+        if (available < MFI_FRAME_HEADER_SIZE + size) {
+            expectInput(conn, MFI_FRAME_HEADER_SIZE + size);
+            return false;
+        }
+
+        mfiServerJob *job = newJob(conn);
+        job->op           = op;
+        job->input.assign(p + MFI_FRAME_HEADER_SIZE, p + MFI_FRAME_HEADER_SIZE + size);
+        conn->inputStart += MFI_FRAME_HEADER_SIZE + size;
+        submit(job);
+        return true;
+    }
+
+    // false if the request isn't all there yet, or the connection stopped taking requests
+    bool parseHttpRequest(mfiServerConnection *conn) {
+        const char *begin = reinterpret_cast<const char *>(conn->input.data() + conn->inputStart);
+        size_t available  = conn->inputEnd - conn->inputStart;
+
+        const char *headerEnd = nullptr;
+        for (const char *p = begin; (p = findLineEnd(p, begin + available)); p += 2) {
+            if (p + 4 <= begin + available && p[2] == '\r' && p[3] == '\n') {
+                headerEnd = p + 4;
+                break;
+            }
+        }
+        if (!headerEnd) {
+            if (available > MFI_SERVER_MAX_HTTP_HEADER) refuse(conn, "431 Request Header Fields Too Large");
+            return false;
+        }
+
+        // request line: method, target and version separated by single spaces
+        const char *lineEnd = findLineEnd(begin, headerEnd);
+        const char *method  = begin;
+        const char *space1  = static_cast<const char *>(memchr(method, ' ', lineEnd - method));
+        const char *target  = space1 ? space1 + 1 : lineEnd;
+        const char *space2  = space1 ? static_cast<const char *>(memchr(target, ' ', lineEnd - target)) : nullptr;
+        const char *version = space2 ? space2 + 1 : lineEnd;
+        size_t methodLen    = space1 ? space1 - method : 0;
+        size_t targetLen    = space2 ? space2 - target : 0;
+        size_t versionLen   = lineEnd - version;
+        if (!space2 || versionLen != 8 || memcmp(version, "HTTP/1.", 7) != 0) {
+            refuse(conn, "400 Bad Request");
+            return false;
+        }
+        bool keepAlive = version[7] != '0';
+
+        bool haveLength      = false;
+        bool chunked         = false;
+        bool expectContinue  = false;
+        size_t contentLength = 0;
+        for (const char *line = lineEnd + 2; line < headerEnd - 2;) {
+            const char *end   = findLineEnd(line, headerEnd);
+            const char *colon = static_cast<const char *>(memchr(line, ':', end - line));
+            if (!colon) {
+                refuse(conn, "400 Bad Request");
+                return false;
+            }
+            const char *value = colon + 1;
+            while (value < end && (*value == ' ' || *value == '\t')) value++;
+            size_t nameLen  = colon - line;
+            size_t valueLen = end - value;
+
+            if (equalsIgnoreCase(line, nameLen, "content-length")) {
+                char *digitsEnd;
+                unsigned long long length = strtoull(value, &digitsEnd, 10);
+                if (digitsEnd == value || digitsEnd > end) {
+                    refuse(conn, "400 Bad Request");
+                    return false;
+                }
+                haveLength    = true;
+                contentLength = length > m_maxRequestSize ? m_maxRequestSize + 1 : (size_t)length;
+            } else if (equalsIgnoreCase(line, nameLen, "transfer-encoding")) {
+                chunked = true;
+            } else if (equalsIgnoreCase(line, nameLen, "connection")) {
+                if (containsIgnoreCase(value, valueLen, "close")) keepAlive = false;
+                if (containsIgnoreCase(value, valueLen, "keep-alive")) keepAlive = true;
+            } else if (equalsIgnoreCase(line, nameLen, "expect")) {
+                expectContinue = containsIgnoreCase(value, valueLen, "100-continue");
+            }
+            line = end + 2;
+        }
+
+        // the query string plays no part
+        const char *query = static_cast<const char *>(memchr(target, '?', targetLen));
+        if (query) targetLen = query - target;
+
+        uint8_t op;
+        if (equalsIgnoreCase(target, targetLen, "/midi")) {
+            op = MFI_SERVER_OP_TO_MIDI;
+        } else if (equalsIgnoreCase(target, targetLen, "/mfi")) {
+            op = MFI_SERVER_OP_TO_MFI;
+        } else {
+            refuse(conn, "404 Not Found");
+            return false;
+        }
+        if (!equalsIgnoreCase(method, methodLen, "POST")) {
+            refuse(conn, "405 Method Not Allowed");
+            return false;
+        }
+        if (chunked) {
+            refuse(conn, "501 Not Implemented");
+            return false;
+        }
+        if (!haveLength) {
+            refuse(conn, "411 Length Required");
+            return false;
+        }
+        if (contentLength > m_maxRequestSize) {
+            refuse(conn, "413 Content Too Large");
+            return false;
+        }
+
+        size_t headerSize = headerEnd - begin;
+        if (available < headerSize + contentLength) {
+            // only when nothing is ahead of it, or it would overtake earlier responses
+            if (expectContinue && !conn->continueSent && conn->jobs.empty()) {
+                appendString(&conn->output, "HTTP/1.1 100 Continue\r\n\r\n");
+                conn->continueSent = true;
+            }
+            expectInput(conn, headerSize + contentLength);
+            return false;
+        }
+
+        const uint8_t *body = reinterpret_cast<const uint8_t *>(headerEnd);
+        mfiServerJob *job   = newJob(conn);
+        job->op             = op;
+        job->closeAfter     = !keepAlive;
+        job->input.assign(body, body + contentLength);
+        conn->inputStart += headerSize + contentLength;
+        conn->continueSent = false;
+        if (!keepAlive) conn->closing = true;
+        submit(job);
+        return true;
+    }
+
+    // moves the finished responses at the head of the line into the output buffer
+    void queueResponses(mfiServerConnection *conn) {
+        while (!conn->jobs.empty() && conn->jobs.front()->done) {
+            mfiServerJob *job = conn->jobs.front();
+            conn->jobs.pop_front();
+            if (job->http) {
+                appendHttpResponse(conn, job);
+            } else {
+                appendFrame(conn, job);
+            }
+            recycleJob(job);
+        }
+    }
+
+    void appendFrame(mfiServerConnection *conn, const mfiServerJob *job) {
+        bool ok     = job->status == MFI_SERVER_OK;
+        size_t size = ok ? job->output.size() : 0;
+
+        uint8_t header[MFI_FRAME_HEADER_SIZE] = { 'M', 'F', job->status, 0 };
+        mfiStoreBE32(header + 4, (uint32_t)size);
+        conn->output.insert(conn->output.end(), header, header + sizeof(header));
+        if (ok) conn->output.insert(conn->output.end(), job->output.begin(), job->output.end());
+    }
+
+    void appendHttpResponse(mfiServerConnection *conn, const mfiServerJob *job) {
+        const char *status;
+        const char *contentType = "text/plain";
+        const char *message     = nullptr;
+        if (job->httpStatus) {
+            status  = job->httpStatus;
+            message = job->httpStatus;
+        } else if (job->status == MFI_SERVER_OK) {
+            status      = "200 OK";
+            contentType = job->op == MFI_SERVER_OP_TO_MIDI ? "audio/midi" : "application/octet-stream";
+        } else {
+            status  = "422 Unprocessable Content";
+            message = job->op == MFI_SERVER_OP_TO_MIDI ? "malformed MFi file" : "malformed MIDI file";
+        }
+
+        size_t size = message ? strlen(message) + 1 : job->output.size();
+        char header[256];
+        snprintf(header, sizeof(header), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%s\r\n",
+            status, contentType, size, job->closeAfter ? "Connection: close\r\n" : "");
+        appendString(&conn->output, header);
+        if (message) {
+            appendString(&conn->output, message);
+            conn->output.push_back('\n');
+        } else {
+            conn->output.insert(conn->output.end(), job->output.begin(), job->output.end());
+        }
+    }
+
+    // false if the connection was closed
+    bool flushOutput(mfiServerConnection *conn) {
+        while (conn->outputDone < conn->output.size()) {
+            long count = sendSome(conn->socket, conn->output.data() + conn->outputDone, conn->output.size() - conn->outputDone);
+            if (count < 0) {
+                int error = socketError();
+                if (isTransient(error)) return true;
+                MFI_LOG(MFI_LOG_INFO, "connection failed: %s\n", describeError(error).c_str());
+                closeConnection(conn);
+                return false;
+            }
+            conn->outputDone += (size_t)count;
+        }
+        conn->output.clear();
+        conn->outputDone = 0;
+        return true;
+    }
+
+    void closeConnection(mfiServerConnection *conn) {
+        m_poller->remove(conn->socket);
+        closeSocket(conn->socket);
+        conn->socket = MFI_INVALID_SOCKET;
+
+        // the jobs a worker still has come back through takeCompleted
+        for (auto it = conn->jobs.begin(); it != conn->jobs.end();) {
+            if ((*it)->done) {
+                recycleJob(*it);
+                it = conn->jobs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        m_closed.push_back(conn);
+
+        if (m_listenPaused) {
+            m_poller->modify(m_listenSocket, &m_listenTag, MFI_POLL_IN);
+            m_listenPaused = false;
+        }
+    }
+
+    // frees closed connections, once no worker has a job of theirs
+    void deleteClosed() {
+        for (size_t i = 0; i < m_closed.size();) {
+            mfiServerConnection *conn = m_closed[i];
+            if (!conn->jobs.empty()) {
+                i++;
+                continue;
+            }
+            m_connections[conn->index]        = m_connections.back();
+            m_connections[conn->index]->index = conn->index;
+            m_connections.pop_back();
+            delete conn;
+            m_closed[i] = m_closed.back();
+            m_closed.pop_back();
+        }
+    }
+};
+
+mfiServer::mfiServer(unsigned numWorkers, unsigned maxInFlight)
+    : m_numWorkers(std::max(1u, numWorkers)),
+      m_maxInFlight(std::max(1u, maxInFlight)),
+      m_maxRequestSize(64 * 1024 * 1024),
+      m_cache(nullptr),
+      m_backendName("none"),
+      m_listenSocket(-1),
+      m_port(0),
+      m_wakeFds{ -1, -1 },
+      m_stopRequested(false) {
+#ifdef _WIN32
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+}
+
+mfiServer::~mfiServer() {
+    if (m_listenSocket != -1) closeSocket((mfiSocket)m_listenSocket);
+    closeWakeFd(m_wakeFds[0]);
+    closeWakeFd(m_wakeFds[1]);
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+bool mfiServer::listen(const char *address) {
+    // "port", "host:port", "[v6 host]:port", or ":port" for all interfaces
+    std::string host = "127.0.0.1";
+    std::string port = address;
+    const char *colon = strrchr(address, ':');
+    if (colon) {
+        host.assign(address, colon - address);
+        port = colon + 1;
+        if (host.size() >= 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+    }
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE;
+    addrinfo *results = nullptr;
+    int gaiError      = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &results);
+    if (gaiError != 0) {
+        MFI_LOG(MFI_LOG_ERROR, "can't resolve %s: %s\n", address, gai_strerror(gaiError));
+        return false;
+    }
+
+    mfiSocket s = MFI_INVALID_SOCKET;
+    int error   = 0;
+    for (addrinfo *ai = results; ai; ai = ai->ai_next) {
+        s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s == MFI_INVALID_SOCKET) {
+            error = socketError();
+            continue;
+        }
+#ifndef _WIN32
+        // restarting must not wait for the old connections' TIME_WAIT
+        int one = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#endif
+        if (bind(s, ai->ai_addr, (int)ai->ai_addrlen) == 0 && ::listen(s, SOMAXCONN) == 0 && setNonBlocking(s)) break;
+        error = socketError();
+        closeSocket(s);
+        s = MFI_INVALID_SOCKET;
+    }
+    freeaddrinfo(results);
+    if (s == MFI_INVALID_SOCKET) {
+        MFI_LOG(MFI_LOG_ERROR, "can't listen on %s: %s\n", address, describeError(error).c_str());
+        return false;
+    }
+
+    sockaddr_storage bound;
+    socklen_t boundLen = sizeof(bound);
+    getsockname(s, reinterpret_cast<sockaddr *>(&bound), &boundLen);
+    if (bound.ss_family == AF_INET6) {
+        m_port = ntohs(reinterpret_cast<sockaddr_in6 *>(&bound)->sin6_port);
+    } else {
+        m_port = ntohs(reinterpret_cast<sockaddr_in *>(&bound)->sin_port);
+    }
+
+    if (m_wakeFds[0] == -1 && !openWakeFds(m_wakeFds)) {
+        MFI_LOG(MFI_LOG_ERROR, "can't create the event loop's wakeup channel: %s\n", describeError(socketError()).c_str());
+        closeSocket(s);
+        return false;
+    }
+
+    if (m_listenSocket != -1) closeSocket((mfiSocket)m_listenSocket);
+    m_listenSocket = (intptr_t)s;
+    return true;
+}
+
+bool mfiServer::run() {
+    if (m_listenSocket == -1) {
+        MFI_LOG(MFI_LOG_ERROR, "the server isn't listening\n");
+        return false;
+    }
+
+    mfiServerLoop loop((mfiSocket)m_listenSocket, m_wakeFds, m_maxInFlight, m_maxRequestSize, m_cache, &m_stopRequested);
+    m_backendName = loop.backendName();
+    bool ok       = loop.run(m_numWorkers);
+    m_stopRequested.store(false);
+    return ok;
+}
+
+void mfiServer::stop() {
+    m_stopRequested.store(true);
+    if (m_wakeFds[1] != -1) signalWakeFd(m_wakeFds[1]);
+}
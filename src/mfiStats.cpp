@@ -0,0 +1,13 @@
+#include "mfi/mfiStats.h"
+
+void mfiCountSongEvents(const mfiSong &song, mfiStats *stats) {
+    stats->numTracks += (uint32_t)song.m_tracks.size();
+    for (const mfiTrack &track : song.m_tracks) {
+        stats->numNoteEvents  += track.notes().size();
+        stats->numTypeBEvents += track.typeBEvents().size();
+        stats->numSysExEvents += track.sysexEvents().size();
+        for (const mfiSysExEvent &sysex : track.sysexEvents()) {
+            stats->sysexBytes += sysex.size;
+        }
+    }
+}
@@ -0,0 +1,113 @@
+#include "mfi/mfiMediaFile.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MFI_SCAN_SSE2 1
+#include <emmintrin.h>
+#else
+#define MFI_SCAN_SSE2 0
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if MFI_SCAN_SSE2
+// index of the lowest set bit; mask is never 0
+static unsigned lowestBit(unsigned mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned)index;
+#else
+    return (unsigned)__builtin_ctz(mask);
+#endif
+}
+#endif
+
+mfiParseError mfiScanTrackEvents(const uint8_t *data, size_t size, mfiNoteType noteType, mfiTrackLayout *layout) {
+    size_t stride = noteType == MFI_NOTE_TYPE_LONG ? 4 : 3;
+
+    // every event takes at least 3 bytes, so this is enough for any chunk
+    std::vector<uint32_t> &offsets = layout->eventOffsets;
+    offsets.resize(size / 3 + 1);
+    uint32_t *out = offsets.data();
+
+    size_t numEvents     = 0;
+    size_t numNoteEvents = 0;
+    size_t pos           = 0;
+    mfiParseError error  = MFI_PARSE_OK;
+    bool inNoteRun       = false;
+    for (;;) {
+#if MFI_SCAN_SSE2
+        // The status byte of a note is the second of its 3 or 4 bytes; a
+        // key of 0x3F marks every other kind of event. Once a note follows
+        // a note, test the status bytes of the next 5 or 4 events at once
+        // and take all the notes before the first escape. Outside of runs
+        // the blocks would mostly end after one event, so those stay scalar.
+        unsigned statusLanes  = stride == 4 ? 0x2222 : 0x2492;
+        size_t notesPerBlock  = stride == 4 ? 4 : 5;
+        const __m128i keyMask = _mm_set1_epi8(0x3F);
+        while (inNoteRun && size - pos >= 16) {
+            __m128i block    = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+            __m128i escape   = _mm_cmpeq_epi8(_mm_and_si128(block, keyMask), keyMask);
+            unsigned escapes = (unsigned)_mm_movemask_epi8(escape) & statusLanes;
+            size_t numNotes  = escapes ? (lowestBit(escapes) - 1) / stride : notesPerBlock;
+
+            // all lanes are stored, there is room for them; only numNotes count
+            for (size_t i = 0; i < notesPerBlock; i++) {
+                out[numEvents + i] = (uint32_t)(pos + i * stride);
+            }
+            numEvents += numNotes;
+            pos += numNotes * stride;
+            numNoteEvents += numNotes;
+            if (escapes) break;
+        }
+#endif
+
+        // one event the slow way, with the checks readTrackEvents makes
+        if (pos == size) {
+            error = MFI_PARSE_NO_END_OF_TRACK;
+            break;
+        }
+        size_t remaining = size - pos;
+        out[numEvents++] = (uint32_t)pos;
+
+        uint8_t status = remaining > 1 ? data[pos + 1] : 0;
+        if ((status & 0x3F) != 0x3F) {
+            if (remaining < stride) {
+                error = MFI_PARSE_TRUNCATED;
+                break;
+            }
+            pos += stride;
+            numNoteEvents++;
+            inNoteRun = true;
+            continue;
+        }
+        inNoteRun = false;
+
+        // a missing first byte reads as 0, which is not a valid event
+        uint8_t firstByte = remaining > 2 ? data[pos + 2] : 0;
+        if ((firstByte & 0xF0) == 0xF0) {
+            if (remaining < 5 || remaining - 5 < mfiLoadBE16(data + pos + 3)) {
+                error = MFI_PARSE_TRUNCATED;
+                break;
+            }
+            pos += 5 + mfiLoadBE16(data + pos + 3);
+        } else if (firstByte & 0x80) {
+            if (remaining < 4) {
+                error = MFI_PARSE_TRUNCATED;
+                break;
+            }
+            pos += 4;
+            if ((status >> 6) == 3 && firstByte == 0xDF) break;
+        } else {
+            error = MFI_PARSE_BAD_EVENT;
+            break;
+        }
+    }
+
+    offsets.resize(numEvents);
+    layout->endOffset     = (uint32_t)pos;
+    layout->numNoteEvents = (uint32_t)numNoteEvents;
+    return error;
+}
@@ -0,0 +1,764 @@
+// Checks that the goldens can't make on their own, run by ctest:
+//
+//   mfiTests roundtrip <dir>  MFi to SMF and back with mfiMfiEncoder, which
+//                             after one generation has to be stable
+//   mfiTests rewrite <dir>    MFi to MFi through mfiMediaFileWriter, with the
+//                             original track chunks and with tracks
+//                             encoded from the parsed song, is the input
+//   mfiTests meta             an SMF whose track name and copyright are too
+//                             long for MFi sub-chunks still converts
+//   mfiTests adpcm <dir>      mfiAdpcmDecoder, whole and in pieces, gives
+//                             what a plain nibble by nibble decoder does
+//   mfiTests pack <dir> <goldendir>
+//                             a tar, a zip and a raw pack of the corpus
+//                             convert, as -a does, to a pack of the goldens
+//   mfiTests server <dir> <goldendir>
+//                             mfiServer answers pipelined frame and HTTP
+//                             requests for the corpus as the goldens
+//   mfiTests cache <dir> <goldendir> <cachedir>
+//                             mfiDiskCache serves what it stored, and
+//                             treats truncated, corrupted and misnamed
+//                             entries as misses
+//
+// <dir> holds the *.mld files the check runs over, and <goldendir> the
+// SMF each of them has to convert to, as for mfiGolden. <cachedir> is
+// emptied first. Exits with 1 after printing every failure.
+
+#include "mfi/mfi.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET mfiSocket;
+#define MFI_INVALID_SOCKET INVALID_SOCKET
+#else
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+typedef int mfiSocket;
+#define MFI_INVALID_SOCKET (-1)
+#endif
+
+struct mfiTestFile {
+    std::string name;
+    std::vector<uint8_t> data;
+};
+
+static bool readFile(const std::string &path, std::vector<uint8_t> *data) {
+    mfiMappedFile file(path.c_str());
+    if (!file.isOpen()) return false;
+    data->assign(file.data(), file.data() + file.size());
+    return true;
+}
+
+// every file of dir with the extension, sorted by name
+static bool collectFiles(const char *dir, const char *extension, std::vector<mfiTestFile> *files) {
+    namespace fs = std::filesystem;
+
+    std::error_code ec;
+    for (auto it = fs::directory_iterator(dir, ec); !ec && it != fs::directory_iterator(); it.increment(ec)) {
+        std::string ext = it->path().extension().string();
+        for (char &c : ext) c = (char)tolower((unsigned char)c);
+        if (!it->is_regular_file(ec) || ext != extension) continue;
+
+        mfiTestFile file;
+        file.name = it->path().filename().string();
+        if (!readFile(it->path().string(), &file.data)) {
+            fprintf(stderr, "cannot open %s\n", it->path().string().c_str());
+            return false;
+        }
+        files->push_back(std::move(file));
+    }
+    if (ec || files->empty()) {
+        fprintf(stderr, "no *%s files in %s\n", extension, dir);
+        return false;
+    }
+    std::sort(files->begin(), files->end(), [](const mfiTestFile &a, const mfiTestFile &b) { return a.name < b.name; });
+    return true;
+}
+
+static bool rewriteFile(const mfiTestFile &file, bool encodeTracks, std::vector<uint8_t> *output) {
+    mfiBufferReader rd(file.data.data(), file.data.size());
+    mfiFileHeader header{};
+    mfiFileIndex index;
+    mfiSong song;
+    if (!mfiMediaFile(&rd).readFileHeader(&header)) return false;
+    rd.seek(0);
+    if (!mfiMediaFile(&rd).readIndex(&index)) return false;
+    rd.seek(0);
+    if (encodeTracks && !mfiMediaFile(&rd).readFile(&song)) return false;
+
+    std::vector<mfiChunkData> adpcmChunks;
+    for (const mfiAdpcmChunk &chunk : index.adpcmChunks) {
+        adpcmChunks.push_back(mfiMediaFileWriter::rawChunk(file.data.data(), chunk));
+    }
+    std::vector<mfiChunkData> tracks;
+    std::vector<mfiBufferWriter> encoded(index.tracks.size());
+    for (size_t i = 0; i < index.tracks.size(); i++) {
+        if (!encodeTracks) {
+            tracks.push_back(mfiMediaFileWriter::rawChunk(file.data.data(), index.tracks[i]));
+            continue;
+        }
+        if (i >= song.m_tracks.size()) return false;
+        mfiMediaFileWriter::encodeTrack(song.m_tracks[i], header.info.noteType, &encoded[i]);
+        tracks.push_back({ 0x74726163, encoded[i].data(), (uint32_t)encoded[i].size() }); // 'trac'
+    }
+
+    mfiBufferWriter wr;
+    if (!mfiMediaFileWriter(&wr).writeFile(header, adpcmChunks, tracks)) return false;
+    wr.takeBuffer(output);
+    return true;
+}
+
+static bool testRewrite(char **args) {
+    std::vector<mfiTestFile> corpus;
+    if (!collectFiles(args[0], ".mld", &corpus)) return false;
+
+    bool ok = true;
+    for (const mfiTestFile &file : corpus) {
+        for (bool encodeTracks : { false, true }) {
+            std::vector<uint8_t> output;
+            if (!rewriteFile(file, encodeTracks, &output) || output != file.data) {
+                fprintf(stderr, "%s: rewriting it with %s tracks doesn't give the input back\n", file.name.c_str(), encodeTracks ? "encoded" : "raw");
+                ok = false;
+            }
+        }
+    }
+    printf("%zu files rewritten\n", corpus.size());
+    return ok;
+}
+
+// The first SMF loses what the encoder can't map, ADPCM and unknown events
+// among them, so it needn't match the next one; but from there on every
+// generation has to be the same, in both formats.
+static bool testRoundTrip(char **args) {
+    std::vector<mfiTestFile> corpus;
+    if (!collectFiles(args[0], ".mld", &corpus)) return false;
+
+    bool ok = true;
+    for (const mfiTestFile &file : corpus) {
+        std::vector<uint8_t> smf[3];
+        std::vector<uint8_t> mfi[2];
+        if (!mfiConvertToMidi(file.data.data(), file.data.size(), &smf[0])) {
+            fprintf(stderr, "%s: doesn't convert to SMF\n", file.name.c_str());
+            ok = false;
+            continue;
+        }
+        bool converted = true;
+        for (int i = 0; i < 2 && converted; i++) {
+            converted = mfiConvertToMfi(smf[i].data(), smf[i].size(), &mfi[i])
+                     && mfiConvertToMidi(mfi[i].data(), mfi[i].size(), &smf[i + 1]);
+        }
+        if (!converted) {
+            fprintf(stderr, "%s: the encoder's output doesn't convert back\n", file.name.c_str());
+            ok = false;
+        } else if (mfi[0] != mfi[1]) {
+            fprintf(stderr, "%s: the MFi changes from one round trip to the next\n", file.name.c_str());
+            ok = false;
+        } else if (smf[1] != smf[2]) {
+            fprintf(stderr, "%s: the SMF changes from one round trip to the next\n", file.name.c_str());
+            ok = false;
+        }
+    }
+    printf("%zu files round-tripped\n", corpus.size());
+    return ok;
+}
+
+static void writeVarLen(mfiBufferWriter *wr, uint32_t value) {
+    uint8_t bytes[5];
+    size_t n = 0;
+    do {
+        bytes[n++] = value & 0x7F;
+        value >>= 7;
+    } while (value);
+    while (n > 1) wr->writeUint8(bytes[--n] | 0x80);
+    wr->writeUint8(bytes[0]);
+}
+
+static void writeMeta(mfiBufferWriter *wr, uint8_t type, const std::string &text) {
+    wr->writeUint8(0);
+    wr->writeUint8(0xFF);
+    wr->writeUint8(type);
+    writeVarLen(wr, (uint32_t)text.size());
+    wr->write(text.data(), text.size());
+}
+
+// Each text is longer than a sub-chunk can be, and together they are well
+// past the header length; the encoder has to cut them rather than fail.
+static bool testOversizedMeta(char **) {
+    std::string title(70000, 'T');
+    std::string copyright(70000, 'C');
+
+    mfiBufferWriter track;
+    writeMeta(&track, 0x03, title);
+    writeMeta(&track, 0x02, copyright);
+    writeMeta(&track, 0x2F, "");
+
+    mfiBufferWriter wr;
+    wr.writeUint32(0x4D546864); // 'MThd'
+    wr.writeUint32(6);
+    wr.writeUint16(0);
+    wr.writeUint16(1);
+    wr.writeUint16(48);
+    wr.writeUint32(0x4D54726B); // 'MTrk'
+    wr.writeUint32((uint32_t)track.size());
+    wr.write(track.data(), track.size());
+
+    std::vector<uint8_t> mfi;
+    if (!mfiConvertToMfi(wr.data(), wr.size(), &mfi)) {
+        fprintf(stderr, "an SMF with oversized meta texts doesn't convert\n");
+        return false;
+    }
+
+    mfiBufferReader rd(mfi.data(), mfi.size());
+    mfiFileHeader header{};
+    mfiSong song;
+    if (!mfiMediaFile(&rd).readFileHeader(&header)) {
+        fprintf(stderr, "the MFi written for oversized meta texts doesn't parse\n");
+        return false;
+    }
+    rd.seek(0);
+    if (!mfiMediaFile(&rd).readFile(&song)) {
+        fprintf(stderr, "the MFi written for oversized meta texts doesn't parse\n");
+        return false;
+    }
+    bool ok = true;
+    if (header.title.empty() || title.compare(0, header.title.size(), header.title) != 0) {
+        fprintf(stderr, "the title isn't a prefix of the track name\n");
+        ok = false;
+    }
+    if (header.copyright.empty() || copyright.compare(0, header.copyright.size(), header.copyright) != 0) {
+        fprintf(stderr, "the copyright isn't a prefix of the SMF's\n");
+        ok = false;
+    }
+    if (ok) printf("%zu and %zu bytes of text kept\n", header.title.size(), header.copyright.size());
+    return ok;
+}
+
+static bool writeFile(const std::string &path, const std::vector<uint8_t> &data) {
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp) return false;
+    bool written = fwrite(data.data(), 1, data.size(), fp) == data.size();
+    return fclose(fp) == 0 && written;
+}
+
+// the golden for an entry of collectFiles
+static bool readGolden(const char *goldenDir, const mfiTestFile &file, std::vector<uint8_t> *golden) {
+    std::filesystem::path path = std::filesystem::path(goldenDir) / std::filesystem::path(file.name).replace_extension(".mid");
+    if (readFile(path.string(), golden)) return true;
+    fprintf(stderr, "no golden for %s at %s\n", file.name.c_str(), path.string().c_str());
+    return false;
+}
+
+// the Yamaha ADPCM step as written down, one nibble at a time
+static void referenceDecode(const uint8_t *data, size_t size, std::vector<int16_t> *pcm) {
+    static const int32_t scales[8] = { 230, 230, 230, 230, 307, 409, 512, 614 };
+
+    int32_t predictor = 0;
+    int32_t step      = 127;
+    for (size_t i = 0; i < 2 * size; i++) {
+        uint8_t nibble = i % 2 ? data[i / 2] >> 4 : data[i / 2] & 0x0F;
+        int32_t diff   = step * (2 * (nibble & 7) + 1) / 8;
+        predictor += nibble & 8 ? -diff : diff;
+        if (predictor > 32767) predictor = 32767;
+        if (predictor < -32768) predictor = -32768;
+        step = step * scales[nibble & 7] >> 8;
+        if (step < 127) step = 127;
+        if (step > 24576) step = 24576;
+        pcm->push_back((int16_t)predictor);
+    }
+}
+
+static bool checkAdpcm(const char *what, const uint8_t *data, size_t size) {
+    std::vector<int16_t> reference;
+    referenceDecode(data, size, &reference);
+
+    // decode() works in blocks of 512 bytes; pieces of these sizes start
+    // and end everywhere relative to them
+    for (size_t pieceSize : { size, (size_t)1, (size_t)7, (size_t)513 }) {
+        if (pieceSize == 0) continue;
+        std::vector<int16_t> pcm(2 * size);
+        mfiAdpcmDecoder decoder;
+        for (size_t offset = 0; offset < size; offset += pieceSize) {
+            decoder.decode(data + offset, std::min(pieceSize, size - offset), pcm.data() + 2 * offset);
+        }
+        if (pcm != reference) {
+            fprintf(stderr, "%s: decoding it in pieces of %zu bytes doesn't match the reference\n", what, pieceSize);
+            return false;
+        }
+    }
+
+    mfiBufferWriter wav;
+    mfiWriteWav(&wav, reference.data(), reference.size(), MFI_ADPCM_SAMPLE_RATE);
+    const uint8_t *header = wav.data();
+    bool valid = wav.size() == 44 + 2 * reference.size() && mfiLoadLE32(header + 4) == wav.size() - 8 && mfiLoadLE32(header + 40) == 2 * reference.size();
+    for (size_t i = 0; valid && i < reference.size(); i++) {
+        valid = (int16_t)mfiLoadLE16(header + 44 + 2 * i) == reference[i];
+    }
+    if (!valid) {
+        fprintf(stderr, "%s: the WAV file doesn't hold the samples\n", what);
+        return false;
+    }
+    return true;
+}
+
+// every ADPCM chunk of the corpus, and some noise long enough for several
+// blocks, which also drives the predictor to both of its limits
+static bool testAdpcm(char **args) {
+    std::vector<mfiTestFile> corpus;
+    if (!collectFiles(args[0], ".mld", &corpus)) return false;
+
+    bool ok          = true;
+    size_t numChunks = 0;
+    for (const mfiTestFile &file : corpus) {
+        mfiBufferReader rd(file.data.data(), file.data.size());
+        mfiFileIndex index;
+        if (!mfiMediaFile(&rd).readIndex(&index)) {
+            fprintf(stderr, "%s: doesn't parse\n", file.name.c_str());
+            ok = false;
+            continue;
+        }
+        for (const mfiAdpcmChunk &chunk : index.adpcmChunks) {
+            ok = checkAdpcm(file.name.c_str(), file.data.data() + chunk.offset, chunk.size) && ok;
+            numChunks++;
+        }
+    }
+    if (numChunks == 0) {
+        fprintf(stderr, "no ADPCM chunks in %s\n", args[0]);
+        ok = false;
+    }
+
+    std::vector<uint8_t> noise(3000);
+    uint32_t seed = 1;
+    for (uint8_t &byte : noise) {
+        seed = seed * 1103515245 + 12345;
+        byte = (uint8_t)(seed >> 16);
+    }
+    std::fill(noise.begin() + 1000, noise.begin() + 1200, 0x77);
+    std::fill(noise.begin() + 2000, noise.begin() + 2200, 0xFF);
+    ok = checkAdpcm("noise", noise.data(), noise.size()) && ok;
+
+    printf("%zu ADPCM chunks decoded\n", numChunks);
+    return ok;
+}
+
+static uint32_t crc32(const uint8_t *data, size_t size) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) crc = crc >> 1 ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+    return ~crc;
+}
+
+// a zip archive of stored entries, which is all mfiScanPack reads
+static void writeZip(const std::vector<mfiTestFile> &files, mfiBufferWriter *wr) {
+    std::vector<uint32_t> offsets;
+    for (const mfiTestFile &file : files) {
+        offsets.push_back((uint32_t)wr->size());
+        wr->writeUint32LE(0x04034B50);
+        wr->writeUint16LE(10); // version needed
+        wr->writeUint16LE(0);  // flags
+        wr->writeUint16LE(0);  // stored
+        wr->writeUint32LE(0);  // time and date
+        wr->writeUint32LE(crc32(file.data.data(), file.data.size()));
+        wr->writeUint32LE((uint32_t)file.data.size());
+        wr->writeUint32LE((uint32_t)file.data.size());
+        wr->writeUint16LE((uint16_t)file.name.size());
+        wr->writeUint16LE(0); // extra field
+        wr->write(file.name.data(), file.name.size());
+        wr->write(file.data.data(), file.data.size());
+    }
+
+    size_t centralStart = wr->size();
+    for (size_t i = 0; i < files.size(); i++) {
+        const mfiTestFile &file = files[i];
+        wr->writeUint32LE(0x02014B50);
+        wr->writeUint16LE(10); // version made by
+        wr->writeUint16LE(10); // version needed
+        wr->writeUint16LE(0);  // flags
+        wr->writeUint16LE(0);  // stored
+        wr->writeUint32LE(0);  // time and date
+        wr->writeUint32LE(crc32(file.data.data(), file.data.size()));
+        wr->writeUint32LE((uint32_t)file.data.size());
+        wr->writeUint32LE((uint32_t)file.data.size());
+        wr->writeUint16LE((uint16_t)file.name.size());
+        wr->writeUint16LE(0); // extra field
+        wr->writeUint16LE(0); // comment
+        wr->writeUint16LE(0); // disk
+        wr->writeUint16LE(0); // internal attributes
+        wr->writeUint32LE(0); // external attributes
+        wr->writeUint32LE(offsets[i]);
+        wr->write(file.name.data(), file.name.size());
+    }
+    size_t centralSize = wr->size() - centralStart;
+
+    wr->writeUint32LE(0x06054B50);
+    wr->writeUint16LE(0); // disk
+    wr->writeUint16LE(0); // disk with the central directory
+    wr->writeUint16LE((uint16_t)files.size());
+    wr->writeUint16LE((uint16_t)files.size());
+    wr->writeUint32LE((uint32_t)centralSize);
+    wr->writeUint32LE((uint32_t)centralStart);
+    wr->writeUint16LE(0); // comment
+}
+
+// The corpus goes into a pack of each format, which mfiConvertPack has to
+// turn into what mfiPackWriter makes of the goldens under the same names:
+// a tar, or for the raw pack the goldens back to back.
+static bool testPack(char **args) {
+    std::vector<mfiTestFile> corpus;
+    if (!collectFiles(args[0], ".mld", &corpus)) return false;
+    std::vector<std::vector<uint8_t>> goldens(corpus.size());
+    for (size_t i = 0; i < corpus.size(); i++) {
+        if (!readGolden(args[1], corpus[i], &goldens[i])) return false;
+    }
+
+    bool ok = true;
+    for (mfiPackFormat format : { MFI_PACK_TAR, MFI_PACK_ZIP, MFI_PACK_RAW }) {
+        const char *formatName = format == MFI_PACK_TAR ? "tar" : format == MFI_PACK_ZIP ? "zip" : "raw";
+
+        mfiBufferWriter pack;
+        mfiBufferWriter expected;
+        mfiPackWriter packWriter(&pack, format);
+        mfiPackWriter expectedWriter(&expected, format);
+        size_t numExpected = 0;
+        for (size_t i = 0; i < corpus.size(); i++) {
+            const mfiTestFile &file = corpus[i];
+            if (format != MFI_PACK_ZIP) packWriter.writeEntry(file.name, file.data.data(), file.data.size());
+            // an empty golden is a file the converter rejects, which leaves it out
+            if (goldens[i].empty()) continue;
+            std::string smfName = std::filesystem::path(file.name).replace_extension(".mid").string();
+            expectedWriter.writeEntry(smfName, goldens[i].data(), goldens[i].size());
+            numExpected++;
+        }
+        if (format == MFI_PACK_ZIP) {
+            writeZip(corpus, &pack);
+        } else {
+            packWriter.finish();
+        }
+        expectedWriter.finish();
+
+        mfiBufferWriter output;
+        mfiPackStats stats{};
+        if (!mfiConvertPack(pack.data(), pack.size(), &output, 2, &stats)) {
+            fprintf(stderr, "the %s pack isn't taken for a pack\n", formatName);
+            ok = false;
+            continue;
+        }
+        if (stats.numEntries != corpus.size() || stats.numEntries - stats.numFailed != numExpected) {
+            fprintf(stderr, "the %s pack converts %zu of %zu entries, not %zu of %zu\n",
+                formatName, stats.numEntries - stats.numFailed, stats.numEntries, numExpected, corpus.size());
+            ok = false;
+        } else if (output.size() != expected.size() || memcmp(output.data(), expected.data(), expected.size()) != 0) {
+            fprintf(stderr, "the %s pack doesn't convert to a pack of the goldens\n", formatName);
+            ok = false;
+        }
+    }
+    printf("%zu files in each pack\n", corpus.size());
+    return ok;
+}
+
+static void closeSocket(mfiSocket s) {
+#ifdef _WIN32
+    closesocket(s);
+#else
+    close(s);
+#endif
+}
+
+// wakes a thread blocked sending on s, before s is closed
+static void shutdownSocket(mfiSocket s) {
+#ifdef _WIN32
+    shutdown(s, SD_BOTH);
+#else
+    shutdown(s, SHUT_RDWR);
+#endif
+}
+
+// a blocking connection to the server's loopback port
+static mfiSocket connectToServer(uint16_t port) {
+    mfiSocket s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s == MFI_INVALID_SOCKET) return s;
+    sockaddr_in addr{};
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(s, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0) {
+        closeSocket(s);
+        return MFI_INVALID_SOCKET;
+    }
+    return s;
+}
+
+static bool sendAll(mfiSocket s, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        int sent = send(s, reinterpret_cast<const char *>(data), (int)std::min<size_t>(size, INT32_MAX), 0);
+        if (sent <= 0) return false;
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+static bool recvAll(mfiSocket s, uint8_t *data, size_t size) {
+    while (size > 0) {
+        int received = recv(s, reinterpret_cast<char *>(data), (int)std::min<size_t>(size, INT32_MAX), 0);
+        if (received <= 0) return false;
+        data += received;
+        size -= received;
+    }
+    return true;
+}
+
+// the status code and body of one HTTP response
+static bool recvHttpResponse(mfiSocket s, int *status, std::vector<uint8_t> *body) {
+    std::string header;
+    while (header.size() < 4 || header.compare(header.size() - 4, 4, "\r\n\r\n") != 0) {
+        uint8_t c;
+        if (header.size() > 16 * 1024 || !recvAll(s, &c, 1)) return false;
+        header += (char)c;
+    }
+    size_t length = header.find("\r\nContent-Length: ");
+    if (header.compare(0, 9, "HTTP/1.1 ") != 0 || length == std::string::npos) return false;
+    *status = atoi(header.c_str() + 9);
+    body->resize(strtoull(header.c_str() + length + 18, nullptr, 10));
+    return recvAll(s, body->data(), body->size());
+}
+
+// One connection sends every file as a frame, and then a frame that isn't
+// an MFi file; another sends every golden back as an HTTP POST /mfi and
+// then every file as POST /midi. Each connection sends all of its requests
+// from a thread of its own while the responses are read, so they pipeline.
+static bool testServer(char **args) {
+    std::vector<mfiTestFile> corpus;
+    if (!collectFiles(args[0], ".mld", &corpus)) return false;
+    std::vector<std::vector<uint8_t>> goldens(corpus.size());
+    std::vector<std::vector<uint8_t>> encoded(corpus.size());
+    for (size_t i = 0; i < corpus.size(); i++) {
+        if (!readGolden(args[1], corpus[i], &goldens[i])) return false;
+        if (!mfiConvertToMfi(goldens[i].data(), goldens[i].size(), &encoded[i])) {
+            fprintf(stderr, "%s: the golden doesn't convert to MFi\n", corpus[i].name.c_str());
+            return false;
+        }
+    }
+
+    mfiServer server(2, 8);
+    if (!server.listen("127.0.0.1:0")) return false;
+    std::thread serverThread([&server] { server.run(); });
+
+    bool ok = true;
+    mfiBufferWriter frames;
+    for (const mfiTestFile &file : corpus) {
+        frames.writeUint32(0x4D464D00); // 'M' 'F' 'M' 0
+        frames.writeUint32((uint32_t)file.data.size());
+        frames.write(file.data.data(), file.data.size());
+    }
+    frames.writeUint32(0x4D464D00);
+    frames.writeUint32(4);
+    frames.writeUint32(0x6E6F7065); // 'nope'
+
+    mfiSocket s = connectToServer(server.port());
+    if (s == MFI_INVALID_SOCKET) {
+        fprintf(stderr, "cannot connect to the server\n");
+        ok = false;
+    } else {
+        std::thread sender([&] { sendAll(s, frames.data(), frames.size()); });
+        for (size_t i = 0; i <= corpus.size(); i++) {
+            uint8_t header[8];
+            std::vector<uint8_t> payload;
+            bool received = recvAll(s, header, sizeof(header)) && mfiLoadBE32(header) >> 16 == 0x4D46;
+            if (received) {
+                payload.resize(mfiLoadBE32(header + 4));
+                received = recvAll(s, payload.data(), payload.size());
+            }
+            uint8_t status = header[2];
+            if (i == corpus.size()) {
+                if (!received || status != MFI_SERVER_BAD_INPUT || !payload.empty()) {
+                    fprintf(stderr, "the server doesn't refuse a frame that isn't MFi\n");
+                    ok = false;
+                }
+            } else if (!received || status != MFI_SERVER_OK || payload != goldens[i]) {
+                fprintf(stderr, "%s: the server's frame isn't the golden\n", corpus[i].name.c_str());
+                ok = false;
+                break;
+            }
+        }
+        shutdownSocket(s);
+        sender.join();
+        closeSocket(s);
+    }
+
+    std::string requests;
+    for (size_t i = 0; i < 2 * corpus.size(); i++) {
+        bool toMfi                        = i < corpus.size();
+        const std::vector<uint8_t> &input = toMfi ? goldens[i] : corpus[i - corpus.size()].data;
+        requests += std::string("POST ") + (toMfi ? "/mfi" : "/midi") + " HTTP/1.1\r\nHost: localhost\r\n";
+        requests += "Content-Length: " + std::to_string(input.size()) + "\r\n\r\n";
+        requests.append(reinterpret_cast<const char *>(input.data()), input.size());
+    }
+
+    s = connectToServer(server.port());
+    if (s == MFI_INVALID_SOCKET) {
+        fprintf(stderr, "cannot connect to the server\n");
+        ok = false;
+    } else {
+        std::thread sender([&] { sendAll(s, reinterpret_cast<const uint8_t *>(requests.data()), requests.size()); });
+        for (size_t i = 0; i < 2 * corpus.size(); i++) {
+            bool toMfi                           = i < corpus.size();
+            const mfiTestFile &file              = corpus[toMfi ? i : i - corpus.size()];
+            const std::vector<uint8_t> &expected = toMfi ? encoded[i] : goldens[i - corpus.size()];
+            int status                           = 0;
+            std::vector<uint8_t> body;
+            if (!recvHttpResponse(s, &status, &body) || status != 200 || body != expected) {
+                fprintf(stderr, "%s: the server's POST %s response isn't %s\n", file.name.c_str(), toMfi ? "/mfi" : "/midi", toMfi ? "the encoded golden" : "the golden");
+                ok = false;
+                break;
+            }
+        }
+        shutdownSocket(s);
+        sender.join();
+        closeSocket(s);
+    }
+
+    server.stop();
+    serverThread.join();
+    printf("%zu files served over %s\n", corpus.size(), server.backendName());
+    return ok;
+}
+
+// the only entry in a cache directory
+static std::filesystem::path onlyEntry(const char *cacheDir) {
+    std::error_code ec;
+    std::filesystem::path entry;
+    for (auto it = std::filesystem::directory_iterator(cacheDir, ec); !ec && it != std::filesystem::directory_iterator(); it.increment(ec)) {
+        if (!entry.empty()) return {};
+        entry = it->path();
+    }
+    return entry;
+}
+
+static bool cacheHits(mfiDiskCache *cache, const mfiTestFile &file, std::vector<uint8_t> *smf) {
+    mfiBufferWriter wr;
+    if (!cache->lookup(mfiMakeCacheKey(file.data.data(), file.data.size(), 0), &wr)) return false;
+    wr.takeBuffer(smf);
+    return true;
+}
+
+// Each file goes into an empty cache through mfiConvertToMidiCached, which
+// has to store it and then find it. Then its entry is cut short, has a byte
+// of its SMF flipped, and is replaced by the entry of another file; each of
+// these has to be a miss, which the next conversion repairs.
+static bool testDiskCache(char **args) {
+    std::vector<mfiTestFile> corpus;
+    if (!collectFiles(args[0], ".mld", &corpus)) return false;
+    std::vector<std::vector<uint8_t>> goldens(corpus.size());
+    for (size_t i = 0; i < corpus.size(); i++) {
+        if (!readGolden(args[1], corpus[i], &goldens[i])) return false;
+    }
+
+    const char *cacheDir = args[2];
+    std::error_code ec;
+    std::filesystem::remove_all(cacheDir, ec);
+    mfiDiskCache cache(cacheDir);
+
+    bool ok = true;
+    std::vector<uint8_t> previousStored;
+    for (size_t i = 0; i < corpus.size(); i++) {
+        const mfiTestFile &file = corpus[i];
+        std::filesystem::remove_all(cacheDir, ec);
+        std::filesystem::create_directories(cacheDir, ec);
+
+        std::vector<uint8_t> smf;
+        if (!mfiConvertToMidiCached(file.data.data(), file.data.size(), &smf, &cache) || smf != goldens[i]) {
+            fprintf(stderr, "%s: doesn't convert to its golden through the cache\n", file.name.c_str());
+            ok = false;
+            continue;
+        }
+        std::filesystem::path entry = onlyEntry(cacheDir);
+        std::vector<uint8_t> stored;
+        if (entry.empty() || !readFile(entry.string(), &stored) || !cacheHits(&cache, file, &smf) || smf != goldens[i]) {
+            fprintf(stderr, "%s: the cache doesn't serve what it stored\n", file.name.c_str());
+            ok = false;
+            continue;
+        }
+
+        // cut short by a byte
+        std::filesystem::resize_file(entry, stored.size() - 1, ec);
+        if (ec || cacheHits(&cache, file, &smf)) {
+            fprintf(stderr, "%s: the cache serves a truncated entry\n", file.name.c_str());
+            ok = false;
+        }
+
+        // the same size, with the last byte of the SMF flipped
+        std::vector<uint8_t> corrupted = stored;
+        corrupted.back() ^= 0xFF;
+        if (!writeFile(entry.string(), corrupted) || cacheHits(&cache, file, &smf)) {
+            fprintf(stderr, "%s: the cache serves an entry with a corrupted SMF\n", file.name.c_str());
+            ok = false;
+        }
+
+        // another file's entry under this one's name
+        if (!previousStored.empty()) {
+            if (!writeFile(entry.string(), previousStored) || cacheHits(&cache, file, &smf)) {
+                fprintf(stderr, "%s: the cache serves another file's entry\n", file.name.c_str());
+                ok = false;
+            }
+        }
+
+        // a miss is converted again and stored over the bad entry
+        bool repaired = mfiConvertToMidiCached(file.data.data(), file.data.size(), &smf, &cache) && smf == goldens[i];
+        if (!repaired || !cacheHits(&cache, file, &smf) || smf != goldens[i]) {
+            fprintf(stderr, "%s: the cache doesn't recover from a bad entry\n", file.name.c_str());
+            ok = false;
+        }
+        previousStored = std::move(stored);
+    }
+    std::filesystem::remove_all(cacheDir, ec);
+    printf("%zu files through the disk cache\n", corpus.size());
+    return ok;
+}
+
+struct mfiTest {
+    const char *name;
+    const char *args;
+    int numArgs;
+    bool (*run)(char **args);
+};
+
+static const mfiTest s_tests[] = {
+    { "rewrite", "<dir>", 1, testRewrite },
+    { "roundtrip", "<dir>", 1, testRoundTrip },
+    { "meta", "", 0, testOversizedMeta },
+    { "adpcm", "<dir>", 1, testAdpcm },
+    { "pack", "<dir> <goldendir>", 2, testPack },
+    { "server", "<dir> <goldendir>", 2, testServer },
+    { "cache", "<dir> <goldendir> <cachedir>", 3, testDiskCache },
+};
+
+int main(int argc, char **argv) {
+    // the corpus may well contain files with unknown events
+    g_mfiLogLevel = -1;
+
+    for (const mfiTest &test : s_tests) {
+        if (argc == test.numArgs + 2 && strcmp(argv[1], test.name) == 0) return test.run(argv + 2) ? 0 : 1;
+    }
+
+    fprintf(stderr, "Usage:\n");
+    for (const mfiTest &test : s_tests) {
+        fprintf(stderr, "  mfiTests %s %s\n", test.name, test.args);
+    }
+    return 1;
+}